@@ -0,0 +1,392 @@
+#include "access_rules.h"
+#include "hardware_manager.h"
+#include <time.h>
+
+static int hexNibble(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+AccessRules::AccessRules(Preferences *prefs) : preferences(prefs), loaded(false)
+{
+  table = new AccessTable();
+  memset(table, 0, sizeof(AccessTable));
+}
+
+AccessRules::~AccessRules()
+{
+  delete table;
+}
+
+void AccessRules::load()
+{
+  loaded = preferences->getBytesLength("accessTable") == sizeof(AccessTable) &&
+           preferences->getBytes("accessTable", table, sizeof(AccessTable)) == sizeof(AccessTable);
+
+  if (!loaded)
+  {
+    memset(table, 0, sizeof(AccessTable));
+  }
+}
+
+void AccessRules::clear()
+{
+  preferences->remove("accessTable");
+  memset(table, 0, sizeof(AccessTable));
+  loaded = false;
+}
+
+// Message layout:
+// {
+//   "version": 7, "tzOffset": -300,
+//   "rules": [{ "group": 1, "lockers": ["A1", "A2"], "windows": [[daysMask, startMin, endMin], ...] }],
+//   "credentials": [["04A1B2C3", group, "A1"], ["<credential id>", group, "A2", "phone"], ...]
+// }
+// A credential's optional fourth element is its kind: "uid" (default), "phone" or
+// "desfire". Kinds match exactly, so a "desfire" entry is never opened by its UID alone.
+// daysMask bit 0 is Sunday. A window whose end is not after its start runs past midnight.
+bool AccessRules::compile(const JsonDocument &doc, const HardwareManager *hardware)
+{
+  // A replayed or reordered push must not roll the schedule back
+  uint32_t version = doc["version"] | 0UL;
+  if (loaded && version <= table->version)
+  {
+    Serial.print(F("Access rules: stale version "));
+    Serial.println(version);
+    return false;
+  }
+
+  // Compile into a scratch table so a bad push leaves the live rules untouched
+  AccessTable *staging = new AccessTable();
+  memset(staging, 0, sizeof(AccessTable));
+
+  staging->version = version;
+  staging->tzOffsetMinutes = doc["tzOffset"] | 0;
+
+  JsonArrayConst rules = doc["rules"];
+  if (rules.size() > MAX_ACCESS_RULES)
+  {
+    Serial.println(F("Access rules: too many rules"));
+    delete staging;
+    return false;
+  }
+
+  uint32_t ruleBit = 1;
+  for (JsonVariantConst rule : rules)
+  {
+    int group = rule["group"] | -1;
+    if (group < 0 || group >= MAX_ACCESS_GROUPS)
+    {
+      Serial.println(F("Access rules: bad group"));
+      delete staging;
+      return false;
+    }
+    staging->groupRules[group] |= ruleBit;
+
+    // Lockers that live on other modules are simply not in this table
+    for (JsonVariantConst lockerId : rule["lockers"].as<JsonArrayConst>())
+    {
+      int index = hardware->findLockerIndex(lockerId.as<const char *>());
+      if (index >= 0)
+        staging->lockerRules[index] |= ruleBit;
+    }
+
+    for (JsonVariantConst window : rule["windows"].as<JsonArrayConst>())
+    {
+      if (!addWindow(*staging, ruleBit, window))
+      {
+        Serial.println(F("Access rules: bad window"));
+        delete staging;
+        return false;
+      }
+    }
+
+    ruleBit <<= 1;
+  }
+
+  for (JsonVariantConst credential : doc["credentials"].as<JsonArrayConst>())
+  {
+    const char *uidHex = credential[0];
+    int group = credential[1] | -1;
+    int index = hardware->findLockerIndex(credential[2].as<const char *>());
+
+    if (index < 0 || group < 0 || group >= MAX_ACCESS_GROUPS)
+      continue; // Credential for a locker on another module
+
+    if (!patchAddCredential(*staging, uidHex, credential[3].as<const char *>(), group, index))
+    {
+      Serial.print(F("Access rules: skipped credential "));
+      Serial.println(uidHex);
+    }
+  }
+
+  memcpy(table, staging, sizeof(AccessTable));
+  delete staging;
+
+  preferences->putBytes("accessTable", table, sizeof(AccessTable));
+  loaded = true;
+
+  Serial.print(F("Access rules v"));
+  Serial.print(table->version);
+  Serial.print(F(": "));
+  Serial.print(rules.size());
+  Serial.print(F(" rules, "));
+  Serial.print(table->credentialCount);
+  Serial.println(F(" credentials"));
+  return true;
+}
+
+AccessTable *AccessRules::beginPatch() const
+{
+  AccessTable *staged = new AccessTable();
+  memcpy(staged, table, sizeof(AccessTable));
+  return staged;
+}
+
+bool AccessRules::patchAddCredential(AccessTable &staged, const char *uidHex, const char *kindName,
+                                     uint8_t group, uint8_t lockerIndex)
+{
+  uint8_t uid[MAX_UID_LENGTH];
+  uint8_t uidLength = parseUid(uidHex, uid);
+  uint8_t kind;
+  if (uidLength == 0 || !parseKind(kindName, kind) || group >= MAX_ACCESS_GROUPS || lockerIndex >= MAX_LOCKERS)
+    return false;
+
+  return addCredential(staged, uid, uidLength, kind, group, lockerIndex);
+}
+
+bool AccessRules::patchRemoveCredential(AccessTable &staged, const char *uidHex, const char *kindName)
+{
+  uint8_t uid[MAX_UID_LENGTH];
+  uint8_t uidLength = parseUid(uidHex, uid);
+  uint8_t kind;
+  if (uidLength == 0 || !parseKind(kindName, kind))
+    return false;
+
+  uint32_t slot = hashUid(uid, uidLength, kind) & (ACCESS_CREDENTIAL_SLOTS - 1);
+  for (int probe = 0; probe < ACCESS_CREDENTIAL_SLOTS; probe++)
+  {
+    AccessCredential &entry = staged.credentials[slot];
+    if (entry.uidLength == 0)
+      return true; // Already absent; removal is idempotent
+
+    if (entry.uidLength == uidLength && entry.kind == kind && memcmp(entry.uid, uid, uidLength) == 0)
+      break;
+    slot = (slot + 1) & (ACCESS_CREDENTIAL_SLOTS - 1);
+  }
+
+  // Backward-shift deletion keeps probe chains intact without tombstones
+  uint32_t hole = slot;
+  uint32_t next = (hole + 1) & (ACCESS_CREDENTIAL_SLOTS - 1);
+  while (staged.credentials[next].uidLength != 0)
+  {
+    AccessCredential &candidate = staged.credentials[next];
+    uint32_t home = hashUid(candidate.uid, candidate.uidLength, candidate.kind) & (ACCESS_CREDENTIAL_SLOTS - 1);
+    uint32_t distanceToHole = (hole - home) & (ACCESS_CREDENTIAL_SLOTS - 1);
+    uint32_t distanceToNext = (next - home) & (ACCESS_CREDENTIAL_SLOTS - 1);
+
+    if (distanceToHole < distanceToNext)
+    {
+      staged.credentials[hole] = candidate;
+      hole = next;
+    }
+    next = (next + 1) & (ACCESS_CREDENTIAL_SLOTS - 1);
+  }
+
+  memset(&staged.credentials[hole], 0, sizeof(AccessCredential));
+  staged.credentialCount--;
+  return true;
+}
+
+void AccessRules::patchClearLocker(AccessTable &staged, int lockerIndex)
+{
+  if (lockerIndex >= 0 && lockerIndex < MAX_LOCKERS)
+    staged.lockerRules[lockerIndex] = 0;
+}
+
+void AccessRules::commitPatch(AccessTable *staged)
+{
+  memcpy(table, staged, sizeof(AccessTable));
+  delete staged;
+
+  preferences->putBytes("accessTable", table, sizeof(AccessTable));
+  loaded = true;
+}
+
+uint8_t AccessRules::parseUid(const char *uidHex, uint8_t *uid)
+{
+  size_t hexLength = uidHex ? strlen(uidHex) : 0;
+  if (hexLength == 0 || hexLength % 2 != 0 || hexLength > MAX_UID_LENGTH * 2)
+    return 0;
+
+  for (size_t i = 0; i < hexLength / 2; i++)
+  {
+    int high = hexNibble(uidHex[i * 2]);
+    int low = hexNibble(uidHex[i * 2 + 1]);
+    if (high < 0 || low < 0)
+      return 0;
+    uid[i] = (high << 4) | low;
+  }
+  return hexLength / 2;
+}
+
+bool AccessRules::parseKind(const char *name, uint8_t &kind)
+{
+  if (!name || strcmp(name, "uid") == 0)
+    kind = CREDENTIAL_UID;
+  else if (strcmp(name, "phone") == 0)
+    kind = CREDENTIAL_PHONE;
+  else if (strcmp(name, "desfire") == 0)
+    kind = CREDENTIAL_DESFIRE;
+  else
+    return false;
+  return true;
+}
+
+bool AccessRules::addWindow(AccessTable &target, uint32_t ruleBit, JsonArrayConst window)
+{
+  int daysMask = window[0] | 0;
+  int startMinute = window[1] | -1;
+  int endMinute = window[2] | -1;
+
+  if (startMinute < 0 || startMinute >= 24 * 60 || endMinute < 0 || endMinute > 24 * 60)
+    return false;
+
+  // Rounded inward to whole slots, so a tap is never granted outside the
+  // window; a window shorter than a slot grants nothing
+  int startSlot = (startMinute + ACCESS_SLOT_MINUTES - 1) / ACCESS_SLOT_MINUTES;
+  int endSlot = endMinute / ACCESS_SLOT_MINUTES;
+  if (endMinute <= startMinute)
+    endSlot += ACCESS_SLOTS_PER_DAY; // Overnight window
+
+  for (int day = 0; day < 7; day++)
+  {
+    if (!(daysMask & (1 << day)))
+      continue;
+
+    for (int slot = startSlot; slot < endSlot; slot++)
+    {
+      int weekSlot = (day * ACCESS_SLOTS_PER_DAY + slot) % ACCESS_SLOTS_PER_WEEK;
+      target.slotRules[weekSlot] |= ruleBit;
+    }
+  }
+  return true;
+}
+
+uint32_t AccessRules::hashUid(const uint8_t *uid, uint8_t uidLength, uint8_t kind)
+{
+  // FNV-1a over the kind, then the UID
+  uint32_t hash = (2166136261UL ^ kind) * 16777619UL;
+  for (uint8_t i = 0; i < uidLength; i++)
+  {
+    hash ^= uid[i];
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+bool AccessRules::addCredential(AccessTable &target, const uint8_t *uid, uint8_t uidLength, uint8_t kind,
+                                uint8_t group, uint8_t lockerIndex)
+{
+  if (target.credentialCount >= MAX_CREDENTIALS)
+    return false;
+
+  uint32_t slot = hashUid(uid, uidLength, kind) & (ACCESS_CREDENTIAL_SLOTS - 1);
+  for (int probe = 0; probe < ACCESS_CREDENTIAL_SLOTS; probe++)
+  {
+    AccessCredential &entry = target.credentials[slot];
+    bool sameUid = entry.uidLength == uidLength && entry.kind == kind && memcmp(entry.uid, uid, uidLength) == 0;
+
+    if (entry.uidLength == 0 || sameUid)
+    {
+      if (!sameUid)
+        target.credentialCount++;
+      entry.uidLength = uidLength;
+      memcpy(entry.uid, uid, uidLength);
+      entry.kind = kind;
+      entry.group = group;
+      entry.lockerIndex = lockerIndex;
+      return true;
+    }
+    slot = (slot + 1) & (ACCESS_CREDENTIAL_SLOTS - 1);
+  }
+  return false;
+}
+
+const AccessCredential *AccessRules::findCredential(const uint8_t *uid, uint8_t uidLength, uint8_t kind) const
+{
+  uint32_t slot = hashUid(uid, uidLength, kind) & (ACCESS_CREDENTIAL_SLOTS - 1);
+  for (int probe = 0; probe < ACCESS_CREDENTIAL_SLOTS; probe++)
+  {
+    const AccessCredential &entry = table->credentials[slot];
+    if (entry.uidLength == 0)
+      return nullptr;
+    if (entry.uidLength == uidLength && entry.kind == kind && memcmp(entry.uid, uid, uidLength) == 0)
+      return &entry;
+    slot = (slot + 1) & (ACCESS_CREDENTIAL_SLOTS - 1);
+  }
+  return nullptr;
+}
+
+int AccessRules::currentSlot() const
+{
+  time_t now = time(nullptr);
+  if (now < (time_t)CLOCK_VALID_EPOCH)
+    return -1;
+
+  now += (time_t)table->tzOffsetMinutes * 60;
+  struct tm local;
+  gmtime_r(&now, &local);
+
+  return local.tm_wday * ACCESS_SLOTS_PER_DAY +
+         (local.tm_hour * 60 + local.tm_min) / ACCESS_SLOT_MINUTES;
+}
+
+AccessRules::Decision AccessRules::check(const uint8_t *uid, uint8_t uidLength, CredentialKind kind,
+                                         int &lockerIndex) const
+{
+  lockerIndex = -1;
+  if (!loaded)
+    return ACCESS_NO_RULES;
+
+  const AccessCredential *credential = findCredential(uid, uidLength, kind);
+  if (!credential)
+    return ACCESS_UNKNOWN_CREDENTIAL;
+
+  lockerIndex = credential->lockerIndex;
+
+  int slot = currentSlot();
+  if (slot < 0)
+    return ACCESS_NO_CLOCK; // Fail closed until the clock has synced once
+
+  uint32_t match = table->groupRules[credential->group] &
+                   table->lockerRules[credential->lockerIndex] &
+                   table->slotRules[slot];
+  return match ? ACCESS_GRANTED : ACCESS_OUTSIDE_WINDOW;
+}
+
+const char *AccessRules::decisionName(Decision decision)
+{
+  switch (decision)
+  {
+  case ACCESS_GRANTED:
+    return "granted";
+  case ACCESS_NO_RULES:
+    return "no_rules";
+  case ACCESS_UNKNOWN_CREDENTIAL:
+    return "unknown_credential";
+  case ACCESS_OUTSIDE_WINDOW:
+    return "outside_window";
+  case ACCESS_NO_CLOCK:
+    return "no_clock";
+  case ACCESS_WRONG_READER:
+    return "wrong_reader";
+  }
+  return "unknown";
+}
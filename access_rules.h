@@ -0,0 +1,87 @@
+#ifndef ACCESS_RULES_H
+#define ACCESS_RULES_H
+
+#include <Preferences.h>
+#include <ArduinoJson.h>
+#include "config.h"
+
+class HardwareManager;
+
+// Credential entry in the open-addressed hash table, keyed on UID and kind
+// so a phone credential id never matches a card with the same bytes
+struct AccessCredential
+{
+  uint8_t uidLength; // 0 = empty slot
+  uint8_t uid[MAX_UID_LENGTH];
+  uint8_t kind; // CredentialKind
+  uint8_t group;
+  uint8_t lockerIndex;
+};
+
+// Compiled rule set. Each rule owns one bit; a tap is allowed when the
+// credential's group, the locker and the current week slot share a rule bit.
+struct AccessTable
+{
+  uint32_t version;
+  int16_t tzOffsetMinutes;
+  uint16_t credentialCount;
+  uint32_t groupRules[MAX_ACCESS_GROUPS];
+  uint32_t lockerRules[MAX_LOCKERS];
+  uint32_t slotRules[ACCESS_SLOTS_PER_WEEK];
+  AccessCredential credentials[ACCESS_CREDENTIAL_SLOTS];
+};
+
+class AccessRules
+{
+public:
+  enum Decision
+  {
+    ACCESS_GRANTED,
+    ACCESS_NO_RULES,
+    ACCESS_UNKNOWN_CREDENTIAL,
+    ACCESS_OUTSIDE_WINDOW,
+    ACCESS_NO_CLOCK,
+    ACCESS_WRONG_READER // Tapped on a reader that does not serve the credential's locker
+  };
+
+private:
+  Preferences *preferences;
+  AccessTable *table;
+  bool loaded;
+
+  static uint32_t hashUid(const uint8_t *uid, uint8_t uidLength, uint8_t kind);
+  static uint8_t parseUid(const char *uidHex, uint8_t *uid);
+  static bool parseKind(const char *name, uint8_t &kind);
+  static bool addWindow(AccessTable &target, uint32_t ruleBit, JsonArrayConst window);
+  static bool addCredential(AccessTable &target, const uint8_t *uid, uint8_t uidLength, uint8_t kind,
+                            uint8_t group, uint8_t lockerIndex);
+  const AccessCredential *findCredential(const uint8_t *uid, uint8_t uidLength, uint8_t kind) const;
+  int currentSlot() const;
+
+public:
+  AccessRules(Preferences *prefs);
+  ~AccessRules();
+
+  void load();
+  bool compile(const JsonDocument &doc, const HardwareManager *hardware);
+  void clear();
+
+  // Config patches edit a copy of the live table, then commit it in one write.
+  // A null kind name means "uid".
+  AccessTable *beginPatch() const;
+  static bool patchAddCredential(AccessTable &staged, const char *uidHex, const char *kindName,
+                                 uint8_t group, uint8_t lockerIndex);
+  static bool patchRemoveCredential(AccessTable &staged, const char *uidHex, const char *kindName);
+  static void patchClearLocker(AccessTable &staged, int lockerIndex);
+  void commitPatch(AccessTable *staged);
+
+  Decision check(const uint8_t *uid, uint8_t uidLength, CredentialKind kind, int &lockerIndex) const;
+  static const char *decisionName(Decision decision);
+
+  // Getters
+  bool hasRules() const { return loaded; }
+  uint32_t getVersion() const { return loaded ? table->version : 0; }
+  uint16_t getCredentialCount() const { return loaded ? table->credentialCount : 0; }
+};
+
+#endif
@@ -0,0 +1,418 @@
+#include "bus_manager.h"
+
+BusManager::BusManager(Preferences *prefs)
+    : preferences(prefs), activeBoards(0), commandQueue(nullptr), eventQueue(nullptr), task(nullptr),
+      pollCursor(0), seq(0), rxLength(0), transactions(0), badFrames(0), timeouts(0), maxActuationMs(0)
+{
+  doorMap = new BusDoorMap();
+  memset(doorMap, 0, sizeof(BusDoorMap));
+  memset(boards, 0, sizeof(boards));
+}
+
+BusManager::~BusManager()
+{
+  if (task)
+    vTaskDelete(task);
+  if (commandQueue)
+    vQueueDelete(commandQueue);
+  if (eventQueue)
+    vQueueDelete(eventQueue);
+  delete doorMap;
+}
+
+bool BusManager::initialize()
+{
+  if (preferences->getBytesLength("busDoors") != sizeof(BusDoorMap) ||
+      preferences->getBytes("busDoors", doorMap, sizeof(BusDoorMap)) != sizeof(BusDoorMap))
+  {
+    memset(doorMap, 0, sizeof(BusDoorMap));
+  }
+
+  updateActiveBoards();
+
+  // Controllers without remote boards leave UART2 and the DE pin alone
+  if (doorMap->count == 0)
+    return false;
+
+  return start();
+}
+
+bool BusManager::start()
+{
+  Serial2.begin(BUS_BAUD, SERIAL_8N1, BUS_RX_PIN, BUS_TX_PIN);
+  pinMode(BUS_DE_PIN, OUTPUT);
+  digitalWrite(BUS_DE_PIN, LOW);
+
+  commandQueue = xQueueCreate(BUS_COMMAND_QUEUE, sizeof(BusCommand));
+  eventQueue = xQueueCreate(BUS_EVENT_QUEUE, sizeof(BusEvent));
+  if (!commandQueue || !eventQueue)
+    return false;
+
+  // Above the Arduino loop task so LCD holds and blocking calls there do not
+  // stretch actuation latency
+  return xTaskCreate(taskEntry, "bus", 4096, this, 2, &task) == pdPASS;
+}
+
+// { "version": 4, "doors": [["B01", 1, 0], ["B02", 1, 1], ...] }
+bool BusManager::configure(const JsonDocument &doc)
+{
+  JsonArrayConst doors = doc["doors"];
+  if (doors.size() > MAX_BUS_DOORS)
+    return false;
+
+  BusDoorMap *staging = new BusDoorMap();
+  memset(staging, 0, sizeof(BusDoorMap));
+  staging->version = doc["version"] | 0UL;
+
+  for (JsonVariantConst door : doors)
+  {
+    const char *lockerId = door[0] | "";
+    int board = door[1] | 0;
+    int index = door[2] | -1;
+
+    if (strlen(lockerId) == 0 || strlen(lockerId) >= LOCKER_ID_SIZE || board < 1 || board > BUS_MAX_BOARDS ||
+        index < 0 || index >= BUS_DOORS_PER_BOARD)
+    {
+      delete staging;
+      return false;
+    }
+
+    BusDoor &entry = staging->doors[staging->count++];
+    strncpy(entry.lockerId, lockerId, LOCKER_ID_SIZE - 1);
+    entry.board = board;
+    entry.door = index;
+  }
+
+  memcpy(doorMap, staging, sizeof(BusDoorMap));
+  delete staging;
+
+  preferences->putBytes("busDoors", doorMap, sizeof(BusDoorMap));
+  updateActiveBoards();
+
+  Serial.print(F("Bus doors v"));
+  Serial.print(doorMap->version);
+  Serial.print(F(": "));
+  Serial.println(doorMap->count);
+
+  if (!task && doorMap->count > 0)
+    return start();
+  return true;
+}
+
+void BusManager::updateActiveBoards()
+{
+  uint8_t mask = 0;
+  for (int i = 0; i < doorMap->count; i++)
+  {
+    mask |= 1 << (doorMap->doors[i].board - 1);
+  }
+  activeBoards = mask;
+}
+
+int BusManager::findDoor(const char *lockerId) const
+{
+  if (!lockerId || lockerId[0] == '\0')
+    return -1;
+
+  for (int i = 0; i < doorMap->count; i++)
+  {
+    if (strcmp(doorMap->doors[i].lockerId, lockerId) == 0)
+      return i;
+  }
+  return -1;
+}
+
+bool BusManager::actuate(const char *lockerId, bool unlock)
+{
+  int index = findDoor(lockerId);
+  if (index < 0 || !task)
+    return false;
+
+  BusCommand command;
+  command.board = doorMap->doors[index].board;
+  command.doorMask = 1 << doorMap->doors[index].door;
+  command.unlock = unlock;
+  command.queuedAt = millis();
+  return xQueueSend(commandQueue, &command, 0) == pdTRUE;
+}
+
+// Called from the main loop; turns board state changes into per-locker updates
+void BusManager::loop()
+{
+  if (!task)
+    return;
+
+  BusEvent event;
+  while (xQueueReceive(eventQueue, &event, 0) == pdTRUE)
+  {
+    for (int i = 0; i < doorMap->count; i++)
+    {
+      const BusDoor &door = doorMap->doors[i];
+      uint8_t bit = 1 << door.door;
+      if (door.board != event.board)
+        continue;
+
+      if ((event.failedMask & bit) && actuationFailedHandler)
+        actuationFailedHandler(door.lockerId);
+
+      if (!(event.changedMask & bit))
+        continue;
+
+      const char *status = !event.online ? "offline" : (event.lockedMask & bit) ? "locked" : "unlocked";
+      if (doorStateHandler)
+        doorStateHandler(door.lockerId, status);
+    }
+  }
+}
+
+void BusManager::toJson(JsonObject out) const
+{
+  int online = 0;
+  for (int i = 0; i < BUS_MAX_BOARDS; i++)
+  {
+    if (boards[i].online)
+      online++;
+  }
+
+  out["doors"] = doorMap->count;
+  out["boardsOnline"] = online;
+  out["transactions"] = transactions;
+  out["badFrames"] = badFrames;
+  out["timeouts"] = timeouts;
+  out["maxActuationMs"] = maxActuationMs;
+}
+
+void BusManager::taskEntry(void *arg)
+{
+  static_cast<BusManager *>(arg)->runScheduler();
+}
+
+void BusManager::runScheduler()
+{
+  for (;;)
+  {
+    drainCommands();
+
+    int index = nextBoard();
+    if (index < 0)
+    {
+      vTaskDelay(pdMS_TO_TICKS(10));
+      continue;
+    }
+
+    BusBoard &board = boards[index];
+    if (board.pendingSince == 0)
+    {
+      transact(index, BUS_CMD_POLL, nullptr, 0);
+      continue;
+    }
+
+    // Every action queued for this board goes out in one frame
+    uint8_t payload[2] = {board.pendingUnlock, board.pendingLock};
+    unsigned long since = board.pendingSince;
+    if (transact(index, BUS_CMD_ACTUATE, payload, sizeof(payload)))
+    {
+      board.pendingUnlock &= ~payload[0];
+      board.pendingLock &= ~payload[1];
+      if (board.pendingUnlock == 0 && board.pendingLock == 0)
+        board.pendingSince = 0;
+
+      uint32_t latency = millis() - since;
+      if (latency > maxActuationMs)
+        maxActuationMs = latency;
+    }
+  }
+}
+
+void BusManager::drainCommands()
+{
+  BusCommand command;
+  while (xQueueReceive(commandQueue, &command, 0) == pdTRUE)
+  {
+    BusBoard &board = boards[command.board - 1];
+    if (command.unlock)
+    {
+      board.pendingUnlock |= command.doorMask;
+      board.pendingLock &= ~command.doorMask;
+    }
+    else
+    {
+      board.pendingLock |= command.doorMask;
+      board.pendingUnlock &= ~command.doorMask;
+    }
+
+    if (board.pendingSince == 0)
+      board.pendingSince = command.queuedAt | 1; // 0 means nothing pending
+  }
+}
+
+// Oldest pending actuation first; otherwise the next board in poll order
+int BusManager::nextBoard()
+{
+  uint8_t active = activeBoards;
+  int oldest = -1;
+
+  for (int i = 0; i < BUS_MAX_BOARDS; i++)
+  {
+    if (!(active & (1 << i)) || boards[i].pendingSince == 0)
+      continue;
+    if (oldest < 0 || (long)(boards[i].pendingSince - boards[oldest].pendingSince) < 0)
+      oldest = i;
+  }
+
+  if (oldest >= 0)
+    return oldest;
+
+  for (int step = 1; step <= BUS_MAX_BOARDS; step++)
+  {
+    int i = (pollCursor + step) % BUS_MAX_BOARDS;
+    if (active & (1 << i))
+    {
+      pollCursor = i;
+      return i;
+    }
+  }
+  return -1;
+}
+
+bool BusManager::transact(int index, uint8_t cmd, const uint8_t *payload, uint8_t length)
+{
+  uint8_t frame[BUS_FRAME_SIZE];
+  uint8_t address = index + 1;
+  uint8_t frameSeq = ++seq;
+
+  frame[0] = BUS_START;
+  frame[1] = address;
+  frame[2] = frameSeq;
+  frame[3] = cmd;
+  frame[4] = length;
+  if (length > 0)
+    memcpy(frame + BUS_HEADER_SIZE, payload, length);
+
+  uint16_t crc = crc16(frame + 1, BUS_HEADER_SIZE - 1 + length);
+  frame[BUS_HEADER_SIZE + length] = crc & 0xFF;
+  frame[BUS_HEADER_SIZE + length + 1] = crc >> 8;
+
+  // Drop the tail of any reply that arrived after its timeout
+  while (Serial2.available())
+    Serial2.read();
+
+  digitalWrite(BUS_DE_PIN, HIGH);
+  Serial2.write(frame, BUS_HEADER_SIZE + length + 2);
+  Serial2.flush(); // Returns after the last stop bit, so the driver can be released
+  digitalWrite(BUS_DE_PIN, LOW);
+  transactions++;
+
+  rxLength = 0;
+  unsigned long start = millis();
+  while (millis() - start < BUS_REPLY_TIMEOUT)
+  {
+    while (Serial2.available() && rxLength < BUS_FRAME_SIZE)
+    {
+      uint8_t value = Serial2.read();
+      if (rxLength == 0 && value != BUS_START)
+        continue; // Resync on the start byte
+      rxBuffer[rxLength++] = value;
+    }
+
+    if (rxLength >= BUS_HEADER_SIZE)
+    {
+      uint8_t replyLength = rxBuffer[4];
+      size_t total = BUS_HEADER_SIZE + replyLength + 2;
+      bool complete = replyLength <= BUS_MAX_PAYLOAD && rxLength >= total;
+
+      if (replyLength > BUS_MAX_PAYLOAD ||
+          (complete && (crc16(rxBuffer + 1, total - 3) != (rxBuffer[total - 2] | (rxBuffer[total - 1] << 8)) ||
+                        rxBuffer[1] != address || rxBuffer[2] != frameSeq ||
+                        rxBuffer[3] != (cmd | BUS_REPLY_FLAG) || replyLength < 2)))
+      {
+        badFrames++;
+        handleFailure(index);
+        return false;
+      }
+
+      if (complete)
+      {
+        handleReply(index);
+        return true;
+      }
+    }
+
+    vTaskDelay(1);
+  }
+
+  timeouts++;
+  handleFailure(index);
+  return false;
+}
+
+void BusManager::handleReply(int index)
+{
+  BusBoard &board = boards[index];
+  uint8_t locked = rxBuffer[BUS_HEADER_SIZE];
+
+  // First contact and recovery report every door; afterwards only changes
+  uint8_t changed = (board.known && board.online) ? (locked ^ board.lockedMask) : 0xFF;
+
+  board.lockedMask = locked;
+  board.failures = 0;
+  board.known = true;
+  board.online = true;
+
+  if (changed)
+    publish(index, locked, changed, 0, true);
+}
+
+void BusManager::handleFailure(int index)
+{
+  BusBoard &board = boards[index];
+
+  // Let other boards' actions go first while this one is failing
+  if (board.pendingSince != 0)
+    board.pendingSince = millis() | 1;
+
+  if (board.failures < BUS_OFFLINE_AFTER)
+    board.failures++;
+  if (board.failures < BUS_OFFLINE_AFTER)
+    return;
+
+  // Give up on queued actions rather than replaying them much later, and
+  // say so, since the server is still waiting for their status updates
+  uint8_t failed = board.pendingUnlock | board.pendingLock;
+  board.pendingUnlock = 0;
+  board.pendingLock = 0;
+  board.pendingSince = 0;
+
+  bool wentOffline = board.online || !board.known;
+  board.online = false;
+  board.known = true;
+
+  if (wentOffline || failed)
+    publish(index, 0, wentOffline ? 0xFF : 0, failed, false);
+}
+
+void BusManager::publish(int index, uint8_t lockedMask, uint8_t changedMask, uint8_t failedMask, bool online)
+{
+  BusEvent event;
+  event.board = index + 1;
+  event.lockedMask = lockedMask;
+  event.changedMask = changedMask;
+  event.failedMask = failedMask;
+  event.online = online;
+  xQueueSend(eventQueue, &event, 0);
+}
+
+uint16_t BusManager::crc16(const uint8_t *data, size_t length)
+{
+  // CRC-16/MODBUS
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < length; i++)
+  {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++)
+    {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+  }
+  return crc;
+}
@@ -0,0 +1,135 @@
+#ifndef BUS_MANAGER_H
+#define BUS_MANAGER_H
+
+#include <Preferences.h>
+#include <ArduinoJson.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include <functional>
+#include "config.h"
+
+// Frame: 0x7E | addr | seq | cmd | len | payload[len] | crc16 (Modbus, LE)
+// The CRC covers addr through payload. Boards answer with cmd | 0x80.
+#define BUS_START 0x7E
+#define BUS_HEADER_SIZE 5
+#define BUS_MAX_PAYLOAD 8
+#define BUS_FRAME_SIZE (BUS_HEADER_SIZE + BUS_MAX_PAYLOAD + 2)
+#define BUS_REPLY_FLAG 0x80
+
+enum BusCommandCode : uint8_t
+{
+  BUS_CMD_POLL = 0x01,   // Reply: [lockedMask, openMask]
+  BUS_CMD_ACTUATE = 0x02 // Payload: [unlockMask, lockMask]; reply as POLL
+};
+
+// Remote door assignment, stored as one NVS blob
+struct BusDoor
+{
+  char lockerId[LOCKER_ID_SIZE];
+  uint8_t board; // Bus address, 1..BUS_MAX_BOARDS
+  uint8_t door;  // 0..BUS_DOORS_PER_BOARD-1
+};
+
+struct BusDoorMap
+{
+  uint32_t version;
+  uint8_t count;
+  BusDoor doors[MAX_BUS_DOORS];
+};
+
+struct BusCommand
+{
+  uint8_t board;
+  uint8_t doorMask;
+  bool unlock;
+  unsigned long queuedAt;
+};
+
+struct BusEvent
+{
+  uint8_t board;
+  uint8_t lockedMask;
+  uint8_t changedMask; // Doors whose status to report
+  uint8_t failedMask;  // Doors whose queued action was given up
+  bool online;
+};
+
+struct BusBoard
+{
+  uint8_t pendingUnlock;
+  uint8_t pendingLock;
+  unsigned long pendingSince; // Oldest queued action, 0 = none
+  uint8_t lockedMask;
+  uint8_t failures;
+  bool known;
+  bool online;
+};
+
+// Drives remote locker boards over RS-485 from a dedicated task, so
+// actuation latency does not depend on the main loop's delays. Queued
+// actions for a board are merged into one ACTUATE frame and always take the
+// next bus slot ahead of polling, which bounds actuation latency to roughly
+// one reply timeout per board with pending work.
+class BusManager
+{
+public:
+  typedef std::function<void(const char *lockerId, const char *status)> DoorStateCallback;
+  typedef std::function<void(const char *lockerId)> ActuationFailedCallback;
+
+private:
+  Preferences *preferences;
+  BusDoorMap *doorMap;
+  volatile uint8_t activeBoards; // Bit per board index in the door map
+  QueueHandle_t commandQueue;
+  QueueHandle_t eventQueue;
+  TaskHandle_t task;
+  DoorStateCallback doorStateHandler;
+  ActuationFailedCallback actuationFailedHandler;
+
+  // Bus task state
+  BusBoard boards[BUS_MAX_BOARDS];
+  uint8_t pollCursor;
+  uint8_t seq;
+  uint8_t rxBuffer[BUS_FRAME_SIZE];
+  uint8_t rxLength;
+
+  // Counters for telemetry
+  volatile uint32_t transactions;
+  volatile uint32_t badFrames;
+  volatile uint32_t timeouts;
+  volatile uint32_t maxActuationMs;
+
+  static void taskEntry(void *arg);
+  void runScheduler();
+  void drainCommands();
+  int nextBoard();
+  bool transact(int index, uint8_t cmd, const uint8_t *payload, uint8_t length);
+  void handleReply(int index);
+  void handleFailure(int index);
+  void publish(int index, uint8_t lockedMask, uint8_t changedMask, uint8_t failedMask, bool online);
+  void updateActiveBoards();
+  bool start();
+  static uint16_t crc16(const uint8_t *data, size_t length);
+
+public:
+  BusManager(Preferences *prefs);
+  ~BusManager();
+
+  bool initialize();
+  void loop();
+  bool configure(const JsonDocument &doc);
+
+  int findDoor(const char *lockerId) const;
+  bool actuate(const char *lockerId, bool unlock);
+  void onDoorState(DoorStateCallback callback) { doorStateHandler = callback; }
+  void onActuationFailed(ActuationFailedCallback callback) { actuationFailedHandler = callback; }
+  void toJson(JsonObject out) const;
+
+  // Getters
+  bool isEnabled() const { return task != nullptr; }
+  uint8_t getDoorCount() const { return doorMap->count; }
+  uint32_t getVersion() const { return doorMap->version; }
+};
+
+#endif
@@ -0,0 +1,300 @@
+#include "card_auth.h"
+#include "virtual_clock.h"
+#include "command_auth.h"
+
+// Native DESFire commands, wrapped as 90 cmd 00 00 Lc data 00
+#define DESFIRE_SELECT_APPLICATION 0x5A
+#define DESFIRE_AUTHENTICATE_AES 0xAA
+#define DESFIRE_ADDITIONAL_FRAME 0xAF
+#define DESFIRE_OK 0x00
+
+#define AES_BLOCK 16
+
+// Status words of wrapped commands are 91 xx
+static bool hasStatus(const uint8_t *response, int length, uint8_t status)
+{
+  return length >= 2 && response[length - 2] == 0x91 && response[length - 1] == status;
+}
+
+static uint8_t wrapCommand(uint8_t *apdu, uint8_t command, const uint8_t *data, uint8_t dataLength)
+{
+  uint8_t length = 0;
+  apdu[length++] = 0x90;
+  apdu[length++] = command;
+  apdu[length++] = 0x00;
+  apdu[length++] = 0x00;
+  apdu[length++] = dataLength;
+  memcpy(apdu + length, data, dataLength);
+  length += dataLength;
+  apdu[length++] = 0x00;
+  return length;
+}
+
+static void rotateLeft(const uint8_t *in, uint8_t *out)
+{
+  for (size_t i = 0; i < AES_BLOCK; i++)
+  {
+    out[i] = in[(i + 1) % AES_BLOCK];
+  }
+}
+
+// CMAC subkey step: shift left one bit, folding the carry back with Rb = 0x87
+static void doubleBlock(const uint8_t *in, uint8_t *out)
+{
+  uint8_t carry = in[0] & 0x80;
+  for (size_t i = 0; i < AES_BLOCK - 1; i++)
+  {
+    out[i] = (in[i] << 1) | (in[i + 1] >> 7);
+  }
+  out[AES_BLOCK - 1] = in[AES_BLOCK - 1] << 1;
+  if (carry)
+    out[AES_BLOCK - 1] ^= 0x87;
+}
+
+CardAuthenticator::CardAuthenticator(Preferences *prefs)
+    : preferences(prefs), hasKey(false), verifiedCount(0), rejectedCount(0), cacheHits(0), cacheMisses(0),
+      overBudget(0), lastAuthMs(0), maxAuthMs(0)
+{
+  mbedtls_aes_init(&master);
+  memset(subkey1, 0, sizeof(subkey1));
+  memset(subkey2, 0, sizeof(subkey2));
+  memset(cache, 0, sizeof(cache));
+}
+
+CardAuthenticator::~CardAuthenticator()
+{
+  mbedtls_aes_free(&master);
+  memset(subkey1, 0, sizeof(subkey1));
+  memset(subkey2, 0, sizeof(subkey2));
+  memset(cache, 0, sizeof(cache));
+}
+
+void CardAuthenticator::loadKey()
+{
+  uint8_t key[CARD_KEY_SIZE];
+  if (preferences->getBytesLength("cardKey") == CARD_KEY_SIZE &&
+      preferences->getBytes("cardKey", key, CARD_KEY_SIZE) == CARD_KEY_SIZE)
+  {
+    setKey(key);
+  }
+  memset(key, 0, sizeof(key));
+}
+
+bool CardAuthenticator::saveKey(const char *hexKey)
+{
+  uint8_t key[CARD_KEY_SIZE];
+  if (!hexKey || strlen(hexKey) != CARD_KEY_SIZE * 2 || !CommandAuthenticator::parseHex(hexKey, key, CARD_KEY_SIZE))
+  {
+    Serial.println(F("Card key rejected: expected 32 hex chars"));
+    return false;
+  }
+
+  preferences->putBytes("cardKey", key, CARD_KEY_SIZE);
+  setKey(key);
+  memset(key, 0, sizeof(key));
+  return true;
+}
+
+// Keys the master context and precomputes the CMAC subkeys; keys derived
+// from the old master key are dropped
+void CardAuthenticator::setKey(const uint8_t *key)
+{
+  uint8_t zero[AES_BLOCK] = {0};
+  uint8_t l[AES_BLOCK];
+  mbedtls_aes_setkey_enc(&master, key, CARD_KEY_SIZE * 8);
+  mbedtls_aes_crypt_ecb(&master, MBEDTLS_AES_ENCRYPT, zero, l);
+  doubleBlock(l, subkey1);
+  doubleBlock(subkey1, subkey2);
+  memset(l, 0, sizeof(l));
+  memset(cache, 0, sizeof(cache));
+  hasKey = true;
+}
+
+// AN10922 AES-128: CMAC(master, 01 || UID || AID || system id). The input is
+// always shorter than two blocks, so it is padded with 80 00.. and the last
+// block is masked with K2; the branch for K1 keeps the construction whole.
+void CardAuthenticator::diversify(const uint8_t *uid, uint8_t uidLength, uint8_t *key)
+{
+  uint8_t data[2 * AES_BLOCK] = {0};
+  size_t length = 0;
+  data[length++] = 0x01;
+  memcpy(data + length, uid, uidLength);
+  length += uidLength;
+  data[length++] = CARD_AID & 0xFF;
+  data[length++] = (CARD_AID >> 8) & 0xFF;
+  data[length++] = (CARD_AID >> 16) & 0xFF;
+  memcpy(data + length, CARD_SYSTEM_ID, strlen(CARD_SYSTEM_ID));
+  length += strlen(CARD_SYSTEM_ID);
+
+  const uint8_t *subkey = subkey1;
+  if (length < sizeof(data))
+  {
+    data[length] = 0x80;
+    subkey = subkey2;
+  }
+  for (size_t i = 0; i < AES_BLOCK; i++)
+  {
+    data[AES_BLOCK + i] ^= subkey[i];
+  }
+
+  uint8_t iv[AES_BLOCK] = {0};
+  uint8_t out[2 * AES_BLOCK];
+  mbedtls_aes_crypt_cbc(&master, MBEDTLS_AES_ENCRYPT, sizeof(data), iv, data, out);
+  memcpy(key, out + AES_BLOCK, CARD_KEY_SIZE);
+  memset(data, 0, sizeof(data));
+  memset(out, 0, sizeof(out));
+}
+
+// Cached derived key for a UID, deriving into the least recently used slot
+// on a miss; free slots have lastUsed 0 and go first
+const uint8_t *CardAuthenticator::cardKey(const uint8_t *uid, uint8_t uidLength)
+{
+  CachedKey *oldest = &cache[0];
+  for (CachedKey &entry : cache)
+  {
+    if (entry.uidLength == uidLength && memcmp(entry.uid, uid, uidLength) == 0)
+    {
+      entry.lastUsed = clockMillis();
+      cacheHits++;
+      return entry.key;
+    }
+    if (entry.lastUsed < oldest->lastUsed)
+      oldest = &entry;
+  }
+
+  cacheMisses++;
+  diversify(uid, uidLength, oldest->key);
+  oldest->uidLength = uidLength;
+  memcpy(oldest->uid, uid, uidLength);
+  oldest->lastUsed = clockMillis();
+  return oldest->key;
+}
+
+CardAuthenticator::Result CardAuthenticator::authenticate(const uint8_t *uid, uint8_t uidLength, ApduExchange exchange)
+{
+  if (!hasKey || uidLength == 0 || uidLength > MAX_UID_LENGTH)
+    return CARD_NO_APP;
+
+  unsigned long start = clockMillis();
+  uint8_t apdu[NFC_APDU_MAX];
+  uint8_t response[CARD_RESPONSE_MAX];
+
+  // SelectApplication, AID least significant byte first
+  const uint8_t aid[] = {CARD_AID & 0xFF, (CARD_AID >> 8) & 0xFF, (CARD_AID >> 16) & 0xFF};
+  uint8_t length = wrapCommand(apdu, DESFIRE_SELECT_APPLICATION, aid, sizeof(aid));
+  int received = exchange(apdu, length, response, sizeof(response));
+  if (!hasStatus(response, received, DESFIRE_OK))
+    return CARD_NO_APP;
+
+  Result result = runAuthentication(cardKey(uid, uidLength), exchange);
+  recordAuthentication(result, clockMillis() - start);
+  return result;
+}
+
+// AuthenticateAES in EV1 mode: the card sends E(RndB); we answer with
+// E(RndA || RndB <<< 8) and expect E(RndA <<< 8) back. CBC chains across the
+// messages, each IV being the previous message's last cryptogram block.
+CardAuthenticator::Result CardAuthenticator::runAuthentication(const uint8_t *key, ApduExchange &exchange)
+{
+  uint8_t apdu[NFC_APDU_MAX];
+  uint8_t response[CARD_RESPONSE_MAX];
+  uint8_t iv[AES_BLOCK] = {0};
+  uint8_t rndA[AES_BLOCK];
+  uint8_t rndB[AES_BLOCK];
+  uint8_t token[2 * AES_BLOCK];
+  Result result = CARD_BAD_RESPONSE;
+
+  mbedtls_aes_context encrypt;
+  mbedtls_aes_context decrypt;
+  mbedtls_aes_init(&encrypt);
+  mbedtls_aes_init(&decrypt);
+  mbedtls_aes_setkey_enc(&encrypt, key, CARD_KEY_SIZE * 8);
+  mbedtls_aes_setkey_dec(&decrypt, key, CARD_KEY_SIZE * 8);
+
+  const uint8_t keyNo = CARD_KEY_NO;
+  uint8_t length = wrapCommand(apdu, DESFIRE_AUTHENTICATE_AES, &keyNo, 1);
+  int received = exchange(apdu, length, response, sizeof(response));
+  if (received == AES_BLOCK + 2 && hasStatus(response, received, DESFIRE_ADDITIONAL_FRAME))
+  {
+    // mbedtls leaves the IV at the last ciphertext block, ready for the next message
+    mbedtls_aes_crypt_cbc(&decrypt, MBEDTLS_AES_DECRYPT, AES_BLOCK, iv, response, rndB);
+
+    for (size_t i = 0; i < AES_BLOCK; i += 4)
+    {
+      uint32_t random = esp_random();
+      memcpy(rndA + i, &random, 4);
+    }
+    memcpy(token, rndA, AES_BLOCK);
+    rotateLeft(rndB, token + AES_BLOCK);
+    mbedtls_aes_crypt_cbc(&encrypt, MBEDTLS_AES_ENCRYPT, sizeof(token), iv, token, token);
+
+    length = wrapCommand(apdu, DESFIRE_ADDITIONAL_FRAME, token, sizeof(token));
+    received = exchange(apdu, length, response, sizeof(response));
+    if (received == AES_BLOCK + 2 && hasStatus(response, received, DESFIRE_OK))
+    {
+      uint8_t expected[AES_BLOCK];
+      uint8_t answer[AES_BLOCK];
+      rotateLeft(rndA, expected);
+      mbedtls_aes_crypt_cbc(&decrypt, MBEDTLS_AES_DECRYPT, AES_BLOCK, iv, response, answer);
+
+      uint8_t diff = 0;
+      for (size_t i = 0; i < AES_BLOCK; i++)
+      {
+        diff |= expected[i] ^ answer[i];
+      }
+      result = diff == 0 ? CARD_OK : CARD_AUTH_FAILED;
+    }
+    else if (received == 2)
+    {
+      result = CARD_AUTH_FAILED; // 91 AE: the card found our RndB' wrong
+    }
+  }
+
+  mbedtls_aes_free(&encrypt);
+  mbedtls_aes_free(&decrypt);
+  memset(rndA, 0, sizeof(rndA));
+  memset(rndB, 0, sizeof(rndB));
+  return result;
+}
+
+void CardAuthenticator::recordAuthentication(Result result, unsigned long elapsedMs)
+{
+  if (result == CARD_OK)
+    verifiedCount++;
+  else
+    rejectedCount++;
+
+  lastAuthMs = elapsedMs;
+  if (elapsedMs > maxAuthMs)
+    maxAuthMs = elapsedMs;
+  if (elapsedMs > CARD_TAP_BUDGET_MS)
+    overBudget++;
+}
+
+void CardAuthenticator::toJson(JsonObject out) const
+{
+  out["provisioned"] = hasKey;
+  out["verified"] = verifiedCount;
+  out["rejected"] = rejectedCount;
+  out["cacheHits"] = cacheHits;
+  out["cacheMisses"] = cacheMisses;
+  out["lastMs"] = lastAuthMs;
+  out["maxMs"] = maxAuthMs;
+  out["overBudget"] = overBudget;
+}
+
+const char *CardAuthenticator::resultName(Result result)
+{
+  switch (result)
+  {
+  case CARD_OK:
+    return "ok";
+  case CARD_NO_APP:
+    return "no_app";
+  case CARD_BAD_RESPONSE:
+    return "bad_response";
+  case CARD_AUTH_FAILED:
+    return "auth_failed";
+  }
+  return "unknown";
+}
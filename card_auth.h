@@ -0,0 +1,78 @@
+#ifndef CARD_AUTH_H
+#define CARD_AUTH_H
+
+#include <Preferences.h>
+#include <ArduinoJson.h>
+#include <functional>
+#include <mbedtls/aes.h>
+#include "config.h"
+
+// Mutual AES authentication with MIFARE DESFire EV1 and later cards. Each
+// card's key is diversified from the site master key with its UID, the
+// NexLock AID and CARD_SYSTEM_ID, as in NXP AN10922, so a cloned UID opens
+// nothing and a key read out of one card opens only that card. Derivation is
+// a CMAC on the ESP32 AES accelerator; derived keys are cached per UID so a
+// returning card costs only the authentication itself.
+class CardAuthenticator
+{
+public:
+  enum Result
+  {
+    CARD_OK,
+    CARD_NO_APP,       // Not a DESFire card, or no NexLock application; treated as a plain card
+    CARD_BAD_RESPONSE, // Wrong length or status word
+    CARD_AUTH_FAILED   // The card does not hold its derived key
+  };
+
+  // Sends one APDU; returns the response length, status word included, or -1
+  typedef std::function<int(const uint8_t *apdu, uint8_t length, uint8_t *response, uint8_t size)> ApduExchange;
+
+private:
+  struct CachedKey
+  {
+    uint8_t uidLength; // 0 = free
+    uint8_t uid[MAX_UID_LENGTH];
+    uint8_t key[CARD_KEY_SIZE];
+    unsigned long lastUsed;
+  };
+
+  Preferences *preferences;
+  mbedtls_aes_context master;     // Keyed once; derivation only encrypts
+  uint8_t subkey1[CARD_KEY_SIZE]; // CMAC subkeys of the master key
+  uint8_t subkey2[CARD_KEY_SIZE];
+  bool hasKey;
+  CachedKey cache[CARD_KEY_CACHE_SIZE];
+
+  // Authentication counters for telemetry
+  uint32_t verifiedCount;
+  uint32_t rejectedCount;
+  uint32_t cacheHits;
+  uint32_t cacheMisses;
+  uint32_t overBudget;
+  unsigned long lastAuthMs;
+  unsigned long maxAuthMs;
+
+  void setKey(const uint8_t *key);
+  void diversify(const uint8_t *uid, uint8_t uidLength, uint8_t *key);
+  const uint8_t *cardKey(const uint8_t *uid, uint8_t uidLength);
+  Result runAuthentication(const uint8_t *key, ApduExchange &exchange);
+  void recordAuthentication(Result result, unsigned long elapsedMs);
+
+public:
+  CardAuthenticator(Preferences *prefs);
+  ~CardAuthenticator();
+
+  void loadKey();
+  bool saveKey(const char *hexKey);
+  bool isProvisioned() const { return hasKey; }
+
+  // Selects the NexLock application and runs AuthenticateAES with the card's
+  // derived key. Three exchanges; the session key is not kept, as only the
+  // proof that the card holds its key matters at the door.
+  Result authenticate(const uint8_t *uid, uint8_t uidLength, ApduExchange exchange);
+
+  void toJson(JsonObject out) const;
+  static const char *resultName(Result result);
+};
+
+#endif
@@ -0,0 +1,275 @@
+#include "command_auth.h"
+
+CommandAuthenticator::CommandAuthenticator(Preferences *prefs)
+    : preferences(prefs), hasKey(false), highestNonce(0), replayBitmap(0),
+      persistedNonce(0), lastVerifyMicros(0), maxVerifyMicros(0),
+      verifiedCount(0), rejectedCount(0)
+{
+  mbedtls_md_init(&hmacCtx);
+}
+
+CommandAuthenticator::~CommandAuthenticator()
+{
+  mbedtls_md_free(&hmacCtx);
+}
+
+void CommandAuthenticator::loadKey()
+{
+  uint8_t key[AUTH_KEY_SIZE];
+  if (preferences->getBytesLength("authKey") == AUTH_KEY_SIZE &&
+      preferences->getBytes("authKey", key, AUTH_KEY_SIZE) == AUTH_KEY_SIZE)
+  {
+    setKey(key, AUTH_KEY_SIZE);
+  }
+  memset(key, 0, sizeof(key));
+
+  // After a restart we cannot know which nonces below the stored high-water
+  // mark were used, so treat the whole window as consumed.
+  highestNonce = preferences->getUInt("authNonce", 0);
+  persistedNonce = highestNonce;
+  replayBitmap = ~0ULL;
+}
+
+bool CommandAuthenticator::saveKey(const char *hexKey)
+{
+  uint8_t key[AUTH_KEY_SIZE];
+  if (!hexKey || strlen(hexKey) != AUTH_KEY_SIZE * 2 || !parseHex(hexKey, key, AUTH_KEY_SIZE))
+  {
+    Serial.println(F("Auth key rejected: expected 64 hex chars"));
+    return false;
+  }
+
+  preferences->putBytes("authKey", key, AUTH_KEY_SIZE);
+  preferences->putUInt("authNonce", 0);
+  highestNonce = 0;
+  persistedNonce = 0;
+  replayBitmap = 0;
+
+  bool ok = setKey(key, AUTH_KEY_SIZE);
+  memset(key, 0, sizeof(key));
+  return ok;
+}
+
+bool CommandAuthenticator::setKey(const uint8_t *key, size_t length)
+{
+  mbedtls_md_free(&hmacCtx);
+  mbedtls_md_init(&hmacCtx);
+
+  // mbedtls routes SHA-256 through the ESP32 SHA accelerator. Keying the
+  // context once here lets verify() use hmac_reset instead of re-deriving
+  // the inner/outer pads for every message.
+  hasKey = mbedtls_md_setup(&hmacCtx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1) == 0 &&
+           mbedtls_md_hmac_starts(&hmacCtx, key, length) == 0;
+
+  if (!hasKey)
+  {
+    Serial.println(F("Auth: HMAC setup failed"));
+  }
+  return hasKey;
+}
+
+CommandAuthenticator::Result CommandAuthenticator::verify(const char *type, const char *moduleId,
+                                                          const char *lockerId, uint32_t nonce,
+                                                          const char *signatureHex)
+{
+  unsigned long start = micros();
+
+  uint8_t expected[AUTH_SIG_SIZE];
+  uint8_t received[AUTH_SIG_SIZE];
+
+  if (!hasKey)
+  {
+    rejectedCount++;
+    recordTiming(start);
+    return AUTH_NO_KEY;
+  }
+
+  if (!signatureHex || nonce == 0 || strlen(signatureHex) != AUTH_SIG_SIZE * 2 ||
+      !parseHex(signatureHex, received, AUTH_SIG_SIZE))
+  {
+    rejectedCount++;
+    recordTiming(start);
+    return AUTH_MISSING_SIGNATURE;
+  }
+
+  if (isReplay(nonce))
+  {
+    rejectedCount++;
+    recordTiming(start);
+    return AUTH_REPLAYED_NONCE;
+  }
+
+  // Signed payload: "<type>\n<moduleId>\n<lockerId>\n<nonce>"
+  char nonceText[11];
+  snprintf(nonceText, sizeof(nonceText), "%lu", (unsigned long)nonce);
+
+  const char *parts[] = {type, moduleId, lockerId, nonceText};
+  mbedtls_md_hmac_reset(&hmacCtx);
+  for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++)
+  {
+    if (i > 0)
+      mbedtls_md_hmac_update(&hmacCtx, (const unsigned char *)"\n", 1);
+    const char *part = parts[i] ? parts[i] : "";
+    mbedtls_md_hmac_update(&hmacCtx, (const unsigned char *)part, strlen(part));
+  }
+  mbedtls_md_hmac_finish(&hmacCtx, expected);
+
+  // Constant-time compare
+  uint8_t diff = 0;
+  for (size_t i = 0; i < AUTH_SIG_SIZE; i++)
+  {
+    diff |= expected[i] ^ received[i];
+  }
+
+  recordTiming(start);
+
+  if (diff != 0)
+  {
+    rejectedCount++;
+    return AUTH_BAD_SIGNATURE;
+  }
+
+  acceptNonce(nonce);
+  verifiedCount++;
+  return AUTH_OK;
+}
+
+// The frame's last member is "sig": {...,"sig":"<64 hex>"}. The HMAC covers
+// "<moduleId>\n" followed by the minified frame with that member removed.
+CommandAuthenticator::Result CommandAuthenticator::checkFrame(const char *frame, size_t length,
+                                                              const char *moduleId)
+{
+  static const char SIG_MEMBER[] = ",\"sig\":\"";
+  const size_t memberLength = sizeof(SIG_MEMBER) - 1;
+  const size_t suffixLength = memberLength + AUTH_SIG_SIZE * 2 + 2; // Member, hex, closing quote and brace
+
+  if (!hasKey)
+    return AUTH_NO_KEY;
+
+  // Unsigned frames are the common case and are not timed
+  uint8_t received[AUTH_SIG_SIZE];
+  if (length <= suffixLength || frame[length - 1] != '}' || frame[length - 2] != '"' ||
+      memcmp(frame + length - suffixLength, SIG_MEMBER, memberLength) != 0 ||
+      !parseHex(frame + length - suffixLength + memberLength, received, AUTH_SIG_SIZE))
+    return AUTH_MISSING_SIGNATURE;
+
+  unsigned long start = micros();
+  uint8_t expected[AUTH_SIG_SIZE];
+
+  mbedtls_md_hmac_reset(&hmacCtx);
+  mbedtls_md_hmac_update(&hmacCtx, (const unsigned char *)moduleId, strlen(moduleId));
+  mbedtls_md_hmac_update(&hmacCtx, (const unsigned char *)"\n", 1);
+  mbedtls_md_hmac_update(&hmacCtx, (const unsigned char *)frame, length - suffixLength);
+  mbedtls_md_hmac_update(&hmacCtx, (const unsigned char *)"}", 1);
+  mbedtls_md_hmac_finish(&hmacCtx, expected);
+
+  uint8_t diff = 0;
+  for (size_t i = 0; i < AUTH_SIG_SIZE; i++)
+  {
+    diff |= expected[i] ^ received[i];
+  }
+
+  recordTiming(start);
+  return diff == 0 ? AUTH_OK : AUTH_BAD_SIGNATURE;
+}
+
+CommandAuthenticator::Result CommandAuthenticator::acceptFrame(Result frameResult, uint32_t nonce)
+{
+  Result result = frameResult;
+  if (result == AUTH_OK && nonce == 0)
+    result = AUTH_MISSING_SIGNATURE;
+  else if (result == AUTH_OK && isReplay(nonce))
+    result = AUTH_REPLAYED_NONCE;
+
+  if (result != AUTH_OK)
+  {
+    rejectedCount++;
+    return result;
+  }
+
+  acceptNonce(nonce);
+  verifiedCount++;
+  return AUTH_OK;
+}
+
+void CommandAuthenticator::recordTiming(unsigned long start)
+{
+  lastVerifyMicros = micros() - start;
+  if (lastVerifyMicros > maxVerifyMicros)
+    maxVerifyMicros = lastVerifyMicros;
+}
+
+bool CommandAuthenticator::isReplay(uint32_t nonce) const
+{
+  if (nonce > highestNonce)
+    return false;
+
+  uint32_t age = highestNonce - nonce;
+  if (age >= AUTH_REPLAY_WINDOW)
+    return true; // Too old to tell, treat as replay
+
+  return (replayBitmap >> age) & 1ULL;
+}
+
+void CommandAuthenticator::acceptNonce(uint32_t nonce)
+{
+  if (nonce > highestNonce)
+  {
+    uint32_t shift = nonce - highestNonce;
+    replayBitmap = shift >= AUTH_REPLAY_WINDOW ? 0 : replayBitmap << shift;
+    highestNonce = nonce;
+  }
+  replayBitmap |= 1ULL << (highestNonce - nonce);
+}
+
+void CommandAuthenticator::persistReplayState()
+{
+  // Called once a command is accepted and before it is acted on, so a reset
+  // in between cannot hand its nonce back
+  if (highestNonce != persistedNonce)
+  {
+    preferences->putUInt("authNonce", highestNonce);
+    persistedNonce = highestNonce;
+  }
+}
+
+bool CommandAuthenticator::parseHex(const char *hex, uint8_t *out, size_t outLength)
+{
+  for (size_t i = 0; i < outLength; i++)
+  {
+    uint8_t value = 0;
+    for (int j = 0; j < 2; j++)
+    {
+      char c = hex[i * 2 + j];
+      value <<= 4;
+      if (c >= '0' && c <= '9')
+        value |= c - '0';
+      else if (c >= 'a' && c <= 'f')
+        value |= c - 'a' + 10;
+      else if (c >= 'A' && c <= 'F')
+        value |= c - 'A' + 10;
+      else
+        return false;
+    }
+    out[i] = value;
+  }
+  return true;
+}
+
+const char *CommandAuthenticator::resultName(Result result)
+{
+  switch (result)
+  {
+  case AUTH_OK:
+    return "ok";
+  case AUTH_MISSING_SIGNATURE:
+    return "missing_signature";
+  case AUTH_BAD_SIGNATURE:
+    return "bad_signature";
+  case AUTH_REPLAYED_NONCE:
+    return "replayed_nonce";
+  case AUTH_NO_KEY:
+    return "no_key";
+  }
+  return "unknown";
+}
@@ -0,0 +1,72 @@
+#ifndef COMMAND_AUTH_H
+#define COMMAND_AUTH_H
+
+#include <Preferences.h>
+#include <mbedtls/md.h>
+#include "config.h"
+
+// Verifies HMAC-SHA256 signatures on lock/unlock frames using the per-module
+// key delivered with module_configured. Other control frames are signed whole
+// (see checkFrame) and share the nonce window. Replays are rejected with a
+// sliding window (highest accepted nonce plus a bitmap of the ones below it),
+// so the cache stays a fixed 12 bytes no matter how many commands arrive.
+class CommandAuthenticator
+{
+public:
+  enum Result
+  {
+    AUTH_OK,
+    AUTH_MISSING_SIGNATURE,
+    AUTH_BAD_SIGNATURE,
+    AUTH_REPLAYED_NONCE,
+    AUTH_NO_KEY // Frame may never run unsigned and no key is provisioned
+  };
+
+private:
+  Preferences *preferences;
+  mbedtls_md_context_t hmacCtx;
+  bool hasKey;
+
+  uint32_t highestNonce;
+  uint64_t replayBitmap;
+  uint32_t persistedNonce;
+
+  // Per-message verification timing
+  unsigned long lastVerifyMicros;
+  unsigned long maxVerifyMicros;
+  uint32_t verifiedCount;
+  uint32_t rejectedCount;
+
+  bool setKey(const uint8_t *key, size_t length);
+  bool isReplay(uint32_t nonce) const;
+  void acceptNonce(uint32_t nonce);
+  void recordTiming(unsigned long start);
+
+public:
+  CommandAuthenticator(Preferences *prefs);
+  ~CommandAuthenticator();
+
+  void loadKey();
+  bool saveKey(const char *hexKey);
+  bool isProvisioned() const { return hasKey; }
+
+  Result verify(const char *type, const char *moduleId, const char *lockerId,
+                uint32_t nonce, const char *signatureHex);
+
+  // Whole-frame signatures: checkFrame runs on the raw text before it is
+  // parsed, acceptFrame consumes the frame's nonce once it has been read
+  Result checkFrame(const char *frame, size_t length, const char *moduleId);
+  Result acceptFrame(Result frameResult, uint32_t nonce);
+  void persistReplayState();
+
+  static const char *resultName(Result result);
+  static bool parseHex(const char *hex, uint8_t *out, size_t outLength); // Also used for other keys
+
+  // Getters
+  unsigned long getLastVerifyMicros() const { return lastVerifyMicros; }
+  unsigned long getMaxVerifyMicros() const { return maxVerifyMicros; }
+  uint32_t getVerifiedCount() const { return verifiedCount; }
+  uint32_t getRejectedCount() const { return rejectedCount; }
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <Arduino.h>
 #include <ESP32Servo.h>
+#include "fixed_string.h"
 
 // Version information
 #define FIRMWARE_VERSION "1.0.0"
@@ -11,8 +12,17 @@
 // Pin definitions for PN532 (I2C)
 #define PN532_SDA 21
 #define PN532_SCL 22
-#define PN532_IRQ 19   // Optional interrupt pin
-#define PN532_RESET 18 // Optional reset pin
+#define PN532_IRQ 19   // Data-ready line; -1 if not wired (the library then polls the status byte)
+#define PN532_RESET 18 // RSTPD_N; pulsed to recover a wedged reader
+
+// Additional readers (see NFC_READERS below)
+#define NFC_BUS1_SDA 32      // Second I2C controller (Wire1)
+#define NFC_BUS1_SCL 33
+#define NFC_MUX_ADDRESS 0x70 // TCA9548A, for readers with a mux channel
+
+// Optional presence sensor (PIR or IR break-beam) that keeps NFC polling fast
+#define PROXIMITY_PIN -1 // -1 = not fitted
+#define PROXIMITY_ACTIVE HIGH
 
 // Other pin definitions
 #define SERVO_PIN1 4
@@ -20,21 +30,41 @@
 #define SERVO_PIN3 6
 #define CONFIG_BUTTON_PIN 2
 
+// RS-485 bus to remote locker boards (UART2 through a half-duplex transceiver)
+#define BUS_TX_PIN 17
+#define BUS_RX_PIN 16
+#define BUS_DE_PIN 25 // DE and /RE tied together
+
 // Servo positions
 #define LOCK_POSITION 0
 #define OPEN_POSITION 90
 
 // Timing constants (reduced intervals to save memory)
+// These are defaults; see runtime_params.h for the server-tunable copies.
 #define PING_INTERVAL 60000
 #define STATUS_CHECK_INTERVAL 2000
 #define AVAILABLE_BROADCAST_INTERVAL 15000
-#define NFC_TIMEOUT 3000
+#define NFC_TIMEOUT 3000 // Same card is ignored for this long after a tap
+#define NFC_POLL_TIMEOUT 100
+#define NFC_FAST_INTERVAL 0     // Poll start-to-start while active; 0 = every loop
+#define NFC_IDLE_INTERVAL 500   // Poll start-to-start once idle
+#define NFC_ACTIVE_WINDOW 30000 // Fast polling lasts this long after a tap, actuation or presence
+#define LCD_HOLD_TIME 1500
+#define LCD_ERROR_HOLD_TIME 2000
+#define RECONNECT_INTERVAL 5000
+#define WIFI_RETRY_DELAY 3000
+#define LOOP_DELAY 100
+#define TELEMETRY_INTERVAL 300000
+#define TRACE_ENABLED 0     // 1 = write the session trace to Serial (see trace_recorder.h)
+#define TRACE_MAX_RECORD 512 // Bytes of payload per trace line; about 45 ms of Serial at 115200 baud
+#define SECURE_CARDS_ONLY 0 // 1 = refuse taps identified by UID alone (see card_auth.h)
 #define CONFIG_BUTTON_HOLD_TIME 5000
 
 // Network constants
 #define DEFAULT_SERVER_PORT 3000
 #define WIFI_CONNECTION_TIMEOUT 20
 #define MAX_LOCKERS 3
+#define LOCKER_ID_SIZE 24 // Including terminator
 
 // LCD constants
 #define LCD_ADDRESS 0x27
@@ -45,6 +75,141 @@
 #define SMALL_JSON_SIZE 256
 #define MEDIUM_JSON_SIZE 512
 #define LARGE_JSON_SIZE 1024
+#define BULK_JSON_SIZE 16384
+#define TELEMETRY_JSON_SIZE (LARGE_JSON_SIZE * 4)
+
+// Fixed-capacity text and per-iteration scratch memory
+#define MODULE_ID_SIZE 64  // Including terminator
+#define MAC_STRING_SIZE 18 // "AA:BB:CC:DD:EE:FF" plus terminator
+#define NFC_CODE_SIZE (MAX_UID_LENGTH * 2 + 1)
+#define SCRATCH_ARENA_SIZE (BULK_JSON_SIZE * 2 + 4096) // Bulk inbound frame, its document and replies
+
+// Heap drift monitor
+#define HEAP_SAMPLE_INTERVAL 10000    // Walks the heap; cheap at this rate
+#define HEAP_TREND_WINDOW 3600000     // One baseline point per window; default for heapTrendWindow
+#define HEAP_TREND_POINTS 24          // A day of hourly baselines
+#define HEAP_TREND_MIN_POINTS 6       // Fewer points are too noisy to call drift
+#define HEAP_DRIFT_BYTES_PER_HOUR 256 // Steady baseline loss that counts as a leak
+
+// PN532 fault detection and recovery
+#define NFC_PROBE_INTERVAL 300 // Liveness probe between polls that found no card
+#define NFC_FAULT_THRESHOLD 2  // Failed probes in a row before recovery; a stuck SDA recovers at once
+#define NFC_RESET_PULSE_MS 10  // RSTPD_N held low
+#define NFC_RESET_WAKE_MS 10   // Oscillator start-up after reset
+
+// PN532 frames and ISO-DEP exchanges
+#define NFC_FRAME_MAX 64       // Longest response data read from the reader
+#define NFC_COMMAND_TIMEOUT 20 // ms for a reply that needs no card, such as RFConfiguration
+#define NFC_TARGET_MAX 40      // InListPassiveTarget data: UID plus ATS
+#define NFC_APDU_MAX 48        // Longest command or response APDU
+#define NFC_APDU_TIMEOUT 80    // ms per exchange; a phone app answers in 20-40 ms
+
+// Phone credentials (host card emulation, see phone_credentials.h)
+#define PHONE_KEY_SIZE 32
+#define PHONE_CHALLENGE_SIZE 16
+#define PHONE_MAC_SIZE 16                                         // Truncated HMAC-SHA256
+#define PHONE_RESPONSE_SIZE (MAX_UID_LENGTH + PHONE_MAC_SIZE + 2) // Credential id, MAC, status word
+#define PHONE_SELECT_RESPONSE_MAX 8                               // The app answers SELECT with 90 00
+#define PHONE_TAP_BUDGET_MS 150                                   // Detection to decision; slower exchanges are counted
+
+// Secure cards (MIFARE DESFire EV1 and later, AES; see card_auth.h)
+#define CARD_KEY_SIZE 16         // AES-128 master key
+#define CARD_AID 0x4B584E        // NexLock application, "NXK"
+#define CARD_KEY_NO 1            // Application key checked at the door
+#define CARD_SYSTEM_ID "NexLock" // AN10922 system identifier, part of every derived key
+#define CARD_KEY_CACHE_SIZE 16   // Derived keys kept for recently seen cards
+#define CARD_RESPONSE_MAX 20     // Cryptogram plus status word
+#define CARD_TAP_BUDGET_MS 150   // Detection to decision; slower authentications are counted
+
+// Watchdog: the task WDT catches a hung loop; per-subsystem budgets (ms) catch slow ones
+#define WATCHDOG_TIMEOUT 30000 // Loop not fed this long: panic and restart
+#define WATCHDOG_STRIKES 3     // Consecutive over-budget sections before a reinit
+#define WATCHDOG_MAX_REINITS 3 // Failed reinits in a row before a restart
+// Default budgets; overridable per site as runtime parameters
+#define SLO_NETWORK_MS 5000    // One server loop pass; a connect attempt can take ~3 s
+#define SLO_NFC_MS 1500        // One card poll; nfcPollTimeout can be up to 1 s
+#define SLO_ACTUATION_MS 50    // Commanding a servo
+#define SLO_DISPLAY_MS 100     // Redrawing the LCD
+
+// Access rules (credential group x locker set x weekly time windows)
+#define MAX_ACCESS_RULES 32 // One bit per rule in the compiled masks
+#define MAX_ACCESS_GROUPS 16
+#define MAX_CREDENTIALS 128
+#define ACCESS_CREDENTIAL_SLOTS 256 // Hash table size, power of two
+#define MAX_UID_LENGTH 7            // Single and double size UIDs; longer ones are refused at the reader
+#define ACCESS_SLOT_MINUTES 15
+#define ACCESS_SLOTS_PER_DAY (24 * 60 / ACCESS_SLOT_MINUTES)
+#define ACCESS_SLOTS_PER_WEEK (7 * ACCESS_SLOTS_PER_DAY)
+
+// Time sync
+#define NTP_SERVER "pool.ntp.org"
+#define CLOCK_VALID_EPOCH 1700000000UL // Anything earlier means SNTP has not synced
+
+// OTA over WebSocket
+#define OTA_CHUNK_HEADER_SIZE 4    // Little-endian image offset before each binary chunk
+#define OTA_WINDOW_BYTES 16384     // Unacknowledged bytes the server may have in flight
+#define OTA_ACK_BYTES 8192         // Acknowledge after this many new bytes
+#define OTA_CHECKPOINT_BYTES 65536 // Persist progress for resume after a reboot
+#define OTA_CONFIRM_TIMEOUT 300000 // New image must register within this window
+#define OTA_MAX_BOOT_ATTEMPTS 3
+#define OTA_PEER_PORT 8080
+#define OTA_PEER_SPAN 16384       // Bytes per HTTP range request between peers
+#define OTA_PEER_POLL_BUDGET 50   // ms of range pulling or serving per loop iteration
+#define OTA_PEER_TIMEOUT 2000     // ms a peer may stay silent mid-range
+#define OTA_PEER_CONNECT_TIMEOUT 1000 // ms to connect to a peer before the range counts as failed
+#define OTA_PEER_OPEN_STACK 6144  // Range open task; exits once the response headers arrive
+#define OTA_PEER_MAX_FAILURES 5   // Then report failure so the server can fall back
+#define OTA_SERVE_HASH_SLICE 16384 // Bytes of the running image hashed per loop before seeding
+
+// ESP-NOW mesh fallback
+#define MESH_BEACON_INTERVAL 5000
+#define MESH_ROUTE_TIMEOUT 15000 // Neighbor is dropped after missing ~3 beacons
+#define MESH_MAX_NEIGHBORS 8
+#define MESH_MAX_REVERSE_ROUTES 16
+#define MESH_MAX_PEERS 16        // Unicast peers kept registered; ESP-NOW allows 20 in all
+#define MESH_PEER_TIMEOUT 60000  // Unused unicast peers are removed after this
+#define MESH_DEDUPE_SIZE 32
+#define MESH_RX_QUEUE 8
+#define MESH_DEFAULT_TTL 4
+
+// Gateway mode: one module carries a cabinet's secondaries on its WebSocket
+#define MAX_GATEWAY_CHANNELS 8
+#define GATEWAY_CHANNEL_TIMEOUT_PINGS 3 // Secondary is dropped after missing this many pings
+
+// RS-485 remote locker boards
+#define BUS_BAUD 115200
+#define BUS_MAX_BOARDS 8
+#define BUS_DOORS_PER_BOARD 8
+#define MAX_BUS_DOORS (BUS_MAX_BOARDS * BUS_DOORS_PER_BOARD)
+#define BUS_REPLY_TIMEOUT 20      // ms; a full frame is under 2 ms at 115200
+#define BUS_OFFLINE_AFTER 5       // Consecutive timeouts before a board is reported offline
+#define BUS_COMMAND_QUEUE 32
+#define BUS_EVENT_QUEUE 16
+
+// Frame compression (raw deflate in binary frames, negotiated at registration)
+#define DEFLATE_THRESHOLD 512      // Smaller frames go out as plain text
+#define DEFLATE_WINDOW 1024        // Longest match distance the compressor searches
+#define DEFLATE_HASH_BITS 9        // 1 KB hash table; no chains
+#define DEFLATE_MAX_INFLATED BULK_JSON_SIZE
+#define DEFLATE_STAT_CLASSES 6
+
+// Outbound send queue: control > telemetry > bulk
+#define SEND_CONTROL_SLOTS 12
+#define SEND_CONTROL_SLOT_SIZE 384                   // Acks, status, events, relayed frames
+#define SEND_CONTROL_SPILL_SIZE 2048                 // One control frame too large for a slot
+#define SEND_TELEMETRY_SLOT_SIZE 5120                // One slot; a newer report replaces a queued one
+#define SEND_BULK_SLOTS 2
+#define SEND_BULK_SLOT_SIZE 4096                     // perf_report dumps
+#define SEND_PUMP_BUDGET 4096                        // Bytes of telemetry/bulk written per loop iteration
+
+// Bulk socket
+#define BULK_CONNECT_STACK 6144   // Connect task; exits once the handshake finishes
+#define BULK_RECONNECT_MAX 300000 // Ceiling for the backoff between failed attempts
+
+// Command authentication (HMAC-SHA256)
+#define AUTH_KEY_SIZE 32
+#define AUTH_SIG_SIZE 32
+#define AUTH_REPLAY_WINDOW 64
 
 // PROGMEM strings to save RAM
 const char HTML_HEADER[] PROGMEM = "<!DOCTYPE html><html><head><title>NexLock</title><meta name='viewport' content='width=device-width,initial-scale=1'><style>body{font-family:Arial;margin:20px;background:#f0f0f0}.container{background:white;padding:15px;border-radius:5px}input{width:100%;padding:8px;margin:8px 0}button{background:#007bff;color:white;padding:12px;border:none;border-radius:3px;width:100%}</style></head><body><div class='container'>";
@@ -53,14 +218,49 @@ const char HTML_FORM[] PROGMEM = "<h2>WiFi Setup</h2><form action='/configure' m
 
 const char HTML_FOOTER[] PROGMEM = "</div></body></html>";
 
+// What a reported tap was identified by; access rules key credentials on it too
+enum CredentialKind
+{
+  CREDENTIAL_UID,    // The card's UID
+  CREDENTIAL_PHONE,  // A phone credential id, verified by challenge and response
+  CREDENTIAL_DESFIRE // The UID of a DESFire card that proved it holds its derived key
+};
+
 // Locker configuration structure
 struct LockerConfig
 {
-  String lockerId;
+  FixedString<LOCKER_ID_SIZE> lockerId;
   uint8_t servoPin;
   Servo *servo;
   uint8_t currentPosition;
   unsigned long lastStatusUpdate;
 };
 
+// PN532 readers. They all answer at the same I2C address, so a second reader
+// on a bus needs a TCA9548A channel or the second controller. All readers
+// share the RSTPD_N line on PN532_RESET.
+struct NfcReaderWiring
+{
+  uint8_t bus;        // 0 = Wire (PN532_SDA/SCL), 1 = Wire1 (NFC_BUS1_SDA/SCL)
+  int8_t muxChannel;  // 0-7, or -1 if wired directly
+  int8_t irqPin;      // -1 if not wired
+  uint8_t lockerMask; // Bit per locker slot the reader serves
+};
+
+const NfcReaderWiring NFC_READERS[] = {
+    {0, -1, PN532_IRQ, 0xFF}, // One reader for the whole bank
+    // One reader per locker behind a TCA9548A:
+    // {0, 0, -1, 0x01}, {0, 1, -1, 0x02}, {0, 2, -1, 0x04},
+};
+#define NFC_READER_COUNT (sizeof(NFC_READERS) / sizeof(NFC_READERS[0]))
+
+// Persisted locker assignment. Stored as one NVS blob so a config patch
+// commits atomically; an empty id marks a free slot.
+struct LockerSet
+{
+  uint32_t version;
+  uint8_t count; // Slots in use, including free gaps left by removals
+  char ids[MAX_LOCKERS][LOCKER_ID_SIZE];
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,75 @@
+#ifndef FIXED_STRING_H
+#define FIXED_STRING_H
+
+#include <Arduino.h>
+
+// Inline character buffer for IDs and short text that lives as long as its
+// owner. Appends past the capacity are truncated rather than reallocated,
+// so it never touches the heap.
+template <size_t N>
+class FixedString
+{
+private:
+  char buffer[N];
+  size_t len;
+
+public:
+  FixedString() : len(0) { buffer[0] = '\0'; }
+  FixedString(const char *text) : len(0)
+  {
+    buffer[0] = '\0';
+    append(text);
+  }
+
+  FixedString &operator=(const char *text)
+  {
+    clear();
+    return append(text);
+  }
+
+  FixedString &append(const char *text)
+  {
+    while (text && *text && len < N - 1)
+      buffer[len++] = *text++;
+    buffer[len] = '\0';
+    return *this;
+  }
+
+  FixedString &append(char c)
+  {
+    if (len < N - 1)
+      buffer[len++] = c;
+    buffer[len] = '\0';
+    return *this;
+  }
+
+  FixedString &append(long value)
+  {
+    char digits[12];
+    snprintf(digits, sizeof(digits), "%ld", value);
+    return append(digits);
+  }
+
+  FixedString &appendHex(uint8_t value)
+  {
+    static const char hex[] = "0123456789ABCDEF";
+    append(hex[value >> 4]);
+    return append(hex[value & 0x0F]);
+  }
+
+  void clear()
+  {
+    len = 0;
+    buffer[0] = '\0';
+  }
+
+  bool operator==(const char *other) const { return strcmp(buffer, other ? other : "") == 0; }
+  bool operator!=(const char *other) const { return !(*this == other); }
+
+  const char *c_str() const { return buffer; }
+  size_t length() const { return len; }
+  bool isEmpty() const { return len == 0; }
+  static constexpr size_t capacity() { return N - 1; }
+};
+
+#endif
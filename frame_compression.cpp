@@ -0,0 +1,260 @@
+#include "frame_compression.h"
+#include <esp_idf_version.h>
+
+// tinfl lives in ROM; IDF 5 dropped the target-less header path
+#if ESP_IDF_VERSION_MAJOR >= 5
+#include <esp32/rom/miniz.h>
+#else
+#include <rom/miniz.h>
+#endif
+
+static const uint16_t LENGTH_BASE[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                         35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                         3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t DIST_BASE[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                       257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+                                       8193, 12289, 16385, 24577};
+static const uint8_t DIST_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                       7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+namespace
+{
+  // Deflate packs fields LSB first; Huffman codes are stored MSB first
+  struct BitWriter
+  {
+    uint8_t *out;
+    size_t capacity;
+    size_t pos;
+    uint32_t bits;
+    int count;
+    bool overflow;
+
+    void put(uint32_t value, int length)
+    {
+      bits |= value << count;
+      count += length;
+      while (count >= 8)
+      {
+        if (pos >= capacity)
+        {
+          overflow = true;
+          return;
+        }
+        out[pos++] = bits & 0xFF;
+        bits >>= 8;
+        count -= 8;
+      }
+    }
+
+    void putCode(uint32_t code, int length)
+    {
+      uint32_t reversed = 0;
+      for (int i = 0; i < length; i++)
+      {
+        reversed = (reversed << 1) | (code & 1);
+        code >>= 1;
+      }
+      put(reversed, length);
+    }
+
+    void putSymbol(int symbol)
+    {
+      // Fixed literal/length code from RFC 1951 section 3.2.6
+      if (symbol < 144)
+        putCode(0x30 + symbol, 8);
+      else if (symbol < 256)
+        putCode(0x190 + symbol - 144, 9);
+      else if (symbol < 280)
+        putCode(symbol - 256, 7);
+      else
+        putCode(0xC0 + symbol - 280, 8);
+    }
+
+    void putMatch(size_t length, size_t distance)
+    {
+      int code = 0;
+      while (code < 28 && LENGTH_BASE[code + 1] <= length)
+        code++;
+      putSymbol(257 + code);
+      put(length - LENGTH_BASE[code], LENGTH_EXTRA[code]);
+
+      int distCode = 0;
+      while (distCode < 29 && DIST_BASE[distCode + 1] <= distance)
+        distCode++;
+      putCode(distCode, 5);
+      put(distance - DIST_BASE[distCode], DIST_EXTRA[distCode]);
+    }
+
+    void finish()
+    {
+      if (count > 0)
+        put(0, 8 - count);
+    }
+  };
+}
+
+static inline uint32_t hashAt(const uint8_t *data)
+{
+  uint32_t key = (data[0] << 16) | (data[1] << 8) | data[2];
+  return (uint32_t)(key * 2654435761U) >> (32 - DEFLATE_HASH_BITS);
+}
+
+FrameCompressor::FrameCompressor() : decompressor(nullptr), inflateBuffer(nullptr), inflatedFrames(0), inflateMicros(0)
+{
+  memset(stats, 0, sizeof(stats));
+}
+
+FrameCompressor::~FrameCompressor()
+{
+  delete decompressor;
+  delete[] inflateBuffer;
+}
+
+bool FrameCompressor::isCompressed(const uint8_t *data, size_t length)
+{
+  return length > DEFLATE_MAGIC_SIZE && memcmp(data, DEFLATE_MAGIC, DEFLATE_MAGIC_SIZE) == 0;
+}
+
+// Returns the packed size, or 0 when the frame did not shrink
+size_t FrameCompressor::deflate(const char *input, size_t length, uint8_t *output, size_t capacity)
+{
+  if (length == 0 || length >= 0xFFFF)
+    return 0;
+
+  unsigned long start = micros();
+  const uint8_t *in = (const uint8_t *)input;
+  BitWriter writer = {output, min(capacity, length - 1), 0, 0, 0, false};
+
+  memset(hashTable, 0, sizeof(hashTable));
+  writer.put(1, 1); // BFINAL
+  writer.put(1, 2); // BTYPE = fixed Huffman
+
+  size_t i = 0;
+  while (i < length && !writer.overflow)
+  {
+    size_t matchLength = 0;
+    size_t distance = 0;
+
+    if (i + 3 <= length)
+    {
+      uint32_t hash = hashAt(in + i);
+      size_t candidate = hashTable[hash]; // Position + 1, 0 = empty
+      hashTable[hash] = i + 1;
+
+      if (candidate != 0 && i - (candidate - 1) <= DEFLATE_WINDOW)
+      {
+        size_t from = candidate - 1;
+        size_t limit = min((size_t)258, length - i);
+        while (matchLength < limit && in[from + matchLength] == in[i + matchLength])
+          matchLength++;
+        distance = i - from;
+      }
+    }
+
+    if (matchLength >= 3)
+    {
+      writer.putMatch(matchLength, distance);
+      for (size_t k = 1; k < matchLength && i + k + 3 <= length; k++)
+        hashTable[hashAt(in + i + k)] = i + k + 1;
+      i += matchLength;
+    }
+    else
+    {
+      writer.putSymbol(in[i]);
+      i++;
+    }
+  }
+
+  writer.putSymbol(256); // End of block
+  writer.finish();
+
+  size_t packed = writer.overflow ? 0 : writer.pos;
+
+  DeflateStats *entry = statsFor(input);
+  entry->frames++;
+  entry->rawBytes += length;
+  entry->packedBytes += packed ? packed : length;
+  entry->micros += micros() - start;
+  return packed;
+}
+
+// Returns a NUL-terminated buffer that stays valid until the next call, or nullptr
+char *FrameCompressor::inflate(const uint8_t *input, size_t length, size_t &outLength)
+{
+  unsigned long start = micros();
+  outLength = 0;
+
+  // ~11 KB of decoder state plus the output buffer: too much for the loop
+  // task's stack, and too much to allocate per frame. Both are taken once,
+  // when the server first sends a compressed frame, and reused.
+  if (!decompressor)
+  {
+    decompressor = new tinfl_decompressor;
+    inflateBuffer = new char[DEFLATE_MAX_INFLATED + 1];
+  }
+  tinfl_init(decompressor);
+
+  size_t inBytes = length;
+  size_t outBytes = DEFLATE_MAX_INFLATED;
+  tinfl_status status = tinfl_decompress(decompressor, input, &inBytes, (uint8_t *)inflateBuffer,
+                                         (uint8_t *)inflateBuffer, &outBytes, TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+  if (status != TINFL_STATUS_DONE)
+    return nullptr;
+
+  inflateBuffer[outBytes] = '\0';
+  outLength = outBytes;
+  inflatedFrames++;
+  inflateMicros += micros() - start;
+  return inflateBuffer;
+}
+
+// Stats are kept per message type; later types share the last slot
+DeflateStats *FrameCompressor::statsFor(const char *json)
+{
+  char type[sizeof(stats[0].type)] = "other";
+  if (strncmp(json, "{\"type\":\"", 9) == 0)
+  {
+    size_t n = 0;
+    while (n < sizeof(type) - 1 && json[9 + n] && json[9 + n] != '"')
+    {
+      type[n] = json[9 + n];
+      n++;
+    }
+    type[n] = '\0';
+  }
+
+  for (int i = 0; i < DEFLATE_STAT_CLASSES - 1; i++)
+  {
+    if (stats[i].frames == 0)
+    {
+      strcpy(stats[i].type, type);
+      return &stats[i];
+    }
+    if (strcmp(stats[i].type, type) == 0)
+      return &stats[i];
+  }
+
+  strcpy(stats[DEFLATE_STAT_CLASSES - 1].type, "other");
+  return &stats[DEFLATE_STAT_CLASSES - 1];
+}
+
+void FrameCompressor::toJson(JsonObject out) const
+{
+  out["inflated"] = inflatedFrames;
+  out["inflateUs"] = inflateMicros;
+
+  JsonArray classes = out.createNestedArray("classes");
+  for (int i = 0; i < DEFLATE_STAT_CLASSES; i++)
+  {
+    if (stats[i].frames == 0)
+      continue;
+
+    JsonObject entry = classes.createNestedObject();
+    entry["type"] = (const char *)stats[i].type;
+    entry["frames"] = stats[i].frames;
+    entry["raw"] = stats[i].rawBytes;
+    entry["packed"] = stats[i].packedBytes;
+    entry["us"] = stats[i].micros;
+  }
+}
@@ -0,0 +1,50 @@
+#ifndef FRAME_COMPRESSION_H
+#define FRAME_COMPRESSION_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "config.h"
+
+// Compressed JSON travels in binary frames that start with this tag. Read as
+// an OTA chunk offset it would be ~22 MB, past any OTA partition, so the two
+// kinds of binary frame cannot be confused.
+#define DEFLATE_MAGIC "NXZ\x01"
+#define DEFLATE_MAGIC_SIZE 4
+
+struct tinfl_decompressor_tag;
+
+struct DeflateStats
+{
+  char type[20];
+  uint32_t frames;
+  uint32_t rawBytes;
+  uint32_t packedBytes;
+  uint32_t micros;
+};
+
+// Raw deflate (RFC 1951) for large frames. The compressor emits one
+// fixed-Huffman block from a single-candidate hash match finder, so its
+// working set is the hash table alone. Inflate uses the ROM tinfl.
+class FrameCompressor
+{
+private:
+  uint16_t hashTable[1 << DEFLATE_HASH_BITS];
+  tinfl_decompressor_tag *decompressor; // Allocated on the first inflate
+  char *inflateBuffer;
+  DeflateStats stats[DEFLATE_STAT_CLASSES];
+  uint32_t inflatedFrames;
+  uint32_t inflateMicros;
+
+  DeflateStats *statsFor(const char *json);
+
+public:
+  FrameCompressor();
+  ~FrameCompressor();
+
+  size_t deflate(const char *input, size_t length, uint8_t *output, size_t capacity);
+  char *inflate(const uint8_t *input, size_t length, size_t &outLength);
+  static bool isCompressed(const uint8_t *data, size_t length);
+  void toJson(JsonObject out) const;
+};
+
+#endif
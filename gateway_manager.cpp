@@ -0,0 +1,183 @@
+#include "gateway_manager.h"
+#include "virtual_clock.h"
+#include "mesh_manager.h"
+#include "runtime_params.h"
+
+GatewayManager::GatewayManager(Preferences *prefs, RuntimeParams *runtimeParams, MeshManager *meshManager)
+    : preferences(prefs), params(runtimeParams), mesh(meshManager), role(ROLE_STANDALONE),
+      framesMuxed(0), pingsAbsorbed(0)
+{
+  memset(gatewayMac, 0, sizeof(gatewayMac));
+  memset(channels, 0, sizeof(channels));
+}
+
+void GatewayManager::load()
+{
+  role = (GatewayRole)preferences->getUChar("gwRole", ROLE_STANDALONE);
+
+  if (role == ROLE_SECONDARY &&
+      preferences->getBytes("gwMac", gatewayMac, sizeof(gatewayMac)) != sizeof(gatewayMac))
+  {
+    role = ROLE_STANDALONE; // Secondary without a gateway would be unreachable
+  }
+
+  if (!mesh && role != ROLE_STANDALONE)
+  {
+    Serial.println(F("Gateway: no ESP-NOW transport, running standalone"));
+    role = ROLE_STANDALONE;
+  }
+
+  if (mesh)
+  {
+    mesh->onDirect([this](const uint8_t *sender, MeshFrameKind kind, char *payload)
+                   { handleFrame(sender, kind, payload); });
+  }
+}
+
+// { "type": "set_role", "role": "secondary", "gateway": "A1B2C3D4E5F6" }
+bool GatewayManager::setRole(const char *name, const char *gatewayHex)
+{
+  if (!name)
+    return false;
+
+  GatewayRole newRole;
+  if (strcmp(name, "standalone") == 0)
+    newRole = ROLE_STANDALONE;
+  else if (strcmp(name, "gateway") == 0)
+    newRole = ROLE_GATEWAY;
+  else if (strcmp(name, "secondary") == 0)
+    newRole = ROLE_SECONDARY;
+  else
+    return false;
+
+  if (newRole == ROLE_SECONDARY)
+  {
+    uint8_t mac[6];
+    if (!MeshManager::parseMac(gatewayHex, mac))
+      return false;
+    preferences->putBytes("gwMac", mac, sizeof(mac));
+  }
+  else
+  {
+    preferences->remove("gwMac");
+  }
+
+  preferences->putUChar("gwRole", newRole);
+  return true;
+}
+
+const char *GatewayManager::roleName(GatewayRole role)
+{
+  switch (role)
+  {
+  case ROLE_STANDALONE:
+    return "standalone";
+  case ROLE_GATEWAY:
+    return "gateway";
+  case ROLE_SECONDARY:
+    return "secondary";
+  }
+  return "unknown";
+}
+
+void GatewayManager::handleFrame(const uint8_t *sender, uint8_t kind, char *payload)
+{
+  if (role == ROLE_SECONDARY && kind == MESH_MUX_DOWN)
+  {
+    // Only our own gateway may command us. The MAC can be spoofed, so the
+    // server signs what it sends down here as well.
+    if (memcmp(sender, gatewayMac, 6) == 0 && downstreamHandler)
+      downstreamHandler(payload);
+    return;
+  }
+
+  if (role != ROLE_GATEWAY || kind != MESH_MUX_UP)
+    return;
+
+  int index = channelFor(sender);
+  if (index < 0)
+  {
+    Serial.println(F("Gateway: channel table full"));
+    return;
+  }
+
+  // Firmware serializes "type" first, so a prefix test avoids a parse
+  if (strncmp(payload, "{\"type\":\"ping\"", 14) == 0)
+  {
+    pingsAbsorbed++;
+    return;
+  }
+
+  framesMuxed++;
+  if (upstreamHandler)
+    upstreamHandler(index + 1, payload);
+}
+
+int GatewayManager::channelFor(const uint8_t *mac)
+{
+  int freeSlot = -1;
+  for (int i = 0; i < MAX_GATEWAY_CHANNELS; i++)
+  {
+    if (channels[i].lastSeen != 0 && memcmp(channels[i].mac, mac, 6) == 0)
+    {
+      channels[i].lastSeen = clockMillis();
+      return i;
+    }
+    if (freeSlot < 0 && !isChannelLive(i))
+      freeSlot = i;
+  }
+
+  if (freeSlot < 0)
+    return -1;
+
+  memcpy(channels[freeSlot].mac, mac, 6);
+  channels[freeSlot].lastSeen = clockMillis();
+  if (attachHandler)
+    attachHandler(freeSlot + 1, mac);
+  return freeSlot;
+}
+
+bool GatewayManager::isChannelLive(int index) const
+{
+  if (channels[index].lastSeen == 0)
+    return false;
+  return clockMillis() - channels[index].lastSeen <
+         GATEWAY_CHANNEL_TIMEOUT_PINGS * params->get(PARAM_PING_INTERVAL);
+}
+
+bool GatewayManager::sendUpstream(const char *payload, size_t length)
+{
+  if (role != ROLE_SECONDARY)
+    return false;
+  return mesh->sendDirect(gatewayMac, MESH_MUX_UP, payload, length);
+}
+
+bool GatewayManager::sendDownstream(uint8_t channel, const char *payload, size_t length)
+{
+  if (role != ROLE_GATEWAY || channel == 0 || channel > MAX_GATEWAY_CHANNELS ||
+      channels[channel - 1].lastSeen == 0)
+    return false;
+  return mesh->sendDirect(channels[channel - 1].mac, MESH_MUX_DOWN, payload, length);
+}
+
+// Re-sends the channel map, e.g. after the gateway's socket reconnects
+void GatewayManager::announceChannels()
+{
+  if (!attachHandler)
+    return;
+
+  for (int i = 0; i < MAX_GATEWAY_CHANNELS; i++)
+  {
+    if (isChannelLive(i))
+      attachHandler(i + 1, channels[i].mac);
+  }
+}
+
+void GatewayManager::liveChannels(JsonArray out) const
+{
+  for (int i = 0; i < MAX_GATEWAY_CHANNELS; i++)
+  {
+    if (isChannelLive(i))
+      out.add(i + 1);
+  }
+}
@@ -0,0 +1,79 @@
+#ifndef GATEWAY_MANAGER_H
+#define GATEWAY_MANAGER_H
+
+#include <Preferences.h>
+#include <ArduinoJson.h>
+#include <functional>
+#include "config.h"
+
+class MeshManager;
+class RuntimeParams;
+
+enum GatewayRole : uint8_t
+{
+  ROLE_STANDALONE = 0, // Own WebSocket (default)
+  ROLE_GATEWAY = 1,    // Own WebSocket, also carries its secondaries
+  ROLE_SECONDARY = 2   // No WebSocket; all traffic goes through the gateway
+};
+
+struct GatewayChannel
+{
+  uint8_t mac[6];
+  unsigned long lastSeen; // 0 = free slot
+};
+
+// Multiplexes a cabinet's secondary controllers onto the gateway's socket.
+// Each secondary gets a channel ID (slot + 1) that tags its frames upstream;
+// secondary pings end at the gateway and are folded into the gateway's own.
+class GatewayManager
+{
+public:
+  typedef std::function<void(uint8_t channel, const char *payload)> UpstreamCallback;
+  typedef std::function<void(uint8_t channel, const uint8_t *mac)> AttachCallback;
+  typedef std::function<void(char *payload)> DownstreamCallback;
+
+private:
+  Preferences *preferences;
+  RuntimeParams *params;
+  MeshManager *mesh;
+  GatewayRole role;
+  uint8_t gatewayMac[6];
+  GatewayChannel channels[MAX_GATEWAY_CHANNELS];
+
+  UpstreamCallback upstreamHandler;
+  AttachCallback attachHandler;
+  DownstreamCallback downstreamHandler;
+
+  // Counters for telemetry
+  uint32_t framesMuxed;
+  uint32_t pingsAbsorbed;
+
+  void handleFrame(const uint8_t *sender, uint8_t kind, char *payload);
+  int channelFor(const uint8_t *mac);
+  bool isChannelLive(int index) const;
+
+public:
+  GatewayManager(Preferences *prefs, RuntimeParams *runtimeParams, MeshManager *meshManager);
+
+  void load();
+  bool setRole(const char *roleName, const char *gatewayHex);
+  static const char *roleName(GatewayRole role);
+
+  void onUpstream(UpstreamCallback callback) { upstreamHandler = callback; }
+  void onAttach(AttachCallback callback) { attachHandler = callback; }
+  void onDownstream(DownstreamCallback callback) { downstreamHandler = callback; }
+
+  bool sendUpstream(const char *payload, size_t length);
+  bool sendDownstream(uint8_t channel, const char *payload, size_t length);
+  void announceChannels();
+  void liveChannels(JsonArray out) const;
+
+  // Getters
+  GatewayRole getRole() const { return role; }
+  bool isGateway() const { return role == ROLE_GATEWAY; }
+  bool isSecondary() const { return role == ROLE_SECONDARY; }
+  uint32_t getFramesMuxed() const { return framesMuxed; }
+  uint32_t getPingsAbsorbed() const { return pingsAbsorbed; }
+};
+
+#endif
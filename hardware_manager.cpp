@@ -1,26 +1,63 @@
 #include "hardware_manager.h"
+#include "perf_counters.h"
+#include "watchdog.h"
+#include <driver/gpio.h>
 
-HardwareManager::HardwareManager(Preferences *prefs)
-    : preferences(prefs), lockers(nullptr), numLockers(0), isConfigured(false),
-      waitingForValidation(false), nfcScanTime(0)
+HardwareManager::HardwareManager(Preferences *prefs, RuntimeParams *runtimeParams)
+    : preferences(prefs), params(runtimeParams), phone(nullptr), cardAuth(nullptr), numLockers(0), configVersion(0),
+      isConfigured(false), waitingForValidation(false), lastUidLength(0), lastCredential(CREDENTIAL_UID), lastActivity(0), nfcRecoveries(0), busClears(0),
+      lastRecoveryMs(0), maxRecoveryMs(0), lcdHoldStart(0), lcdHoldDuration(0)
 {
+  for (int i = 0; i < MAX_LOCKERS; i++)
+  {
+    assignLockerHardware(i);
+  }
+
+  nextReader = 0;
+  lastReader = -1;
+  for (uint8_t bus = 0; bus < 2; bus++)
+  {
+    muxState[bus] = -1;
+    busHasMux[bus] = false;
+  }
+  for (uint8_t i = 0; i < NFC_READER_COUNT; i++)
+  {
+    if (NFC_READERS[i].muxChannel >= 0)
+      busHasMux[NFC_READERS[i].bus] = true;
+  }
+  for (uint8_t i = 0; i < NFC_READER_COUNT; i++)
+  {
+    NfcReader &reader = readers[i];
+    memset(&reader, 0, sizeof(NfcReader));
+    reader.wiring = &NFC_READERS[i];
+    reader.wire = reader.wiring->bus == 0 ? &Wire : &Wire1;
+    reader.nfc = new Adafruit_PN532(reader.wiring->irqPin, PN532_RESET, reader.wire);
+  }
 
-  nfc = new Adafruit_PN532(PN532_SDA, PN532_SCL);
   lcd = new LiquidCrystal_I2C(LCD_ADDRESS, LCD_COLS, LCD_ROWS);
 }
 
 HardwareManager::~HardwareManager()
 {
-  delete nfc;
+  for (uint8_t i = 0; i < NFC_READER_COUNT; i++)
+  {
+    delete readers[i].nfc;
+  }
   delete lcd;
-  if (lockers)
-    delete[] lockers;
 }
 
 bool HardwareManager::initialize()
 {
   // Initialize I2C
   Wire.begin(PN532_SDA, PN532_SCL);
+  for (uint8_t i = 0; i < NFC_READER_COUNT; i++)
+  {
+    if (NFC_READERS[i].bus == 1)
+    {
+      Wire1.begin(NFC_BUS1_SDA, NFC_BUS1_SCL);
+      break;
+    }
+  }
 
   // Initialize LCD
   lcd->init();
@@ -28,6 +65,8 @@ bool HardwareManager::initialize()
 
   // Initialize config button
   pinMode(CONFIG_BUTTON_PIN, INPUT_PULLUP);
+  if (PROXIMITY_PIN >= 0)
+    pinMode(PROXIMITY_PIN, INPUT);
 
   // Allow allocation of all timers for servo library
   ESP32PWM::allocateTimer(0);
@@ -39,24 +78,49 @@ bool HardwareManager::initialize()
 
   if (isConfigured)
   {
-    // Initialize PN532
-    nfc->begin();
-
-    // Check if PN532 is connected
-    uint32_t versiondata = nfc->getFirmwareVersion();
-    if (!versiondata)
+    // Initialize the PN532s; the shared reset line stays ours for later recovery.
+    // begin() may pulse reset, so every reader is started before any is configured.
+    pinMode(PN532_RESET, OUTPUT);
+    digitalWrite(PN532_RESET, HIGH);
+    for (uint8_t i = 0; i < NFC_READER_COUNT; i++)
     {
-      Serial.println("PN532 not found - check I2C wiring");
-      updateLCD("NFC Error", "Check I2C wiring");
-      delay(2000);
+      selectReader(readers[i]);
+      readers[i].nfc->begin();
     }
-    else
+
+    // Check each PN532 is connected and configure it to read RFID tags
+    uint8_t missing = 0;
+    for (uint8_t i = 0; i < NFC_READER_COUNT; i++)
     {
-      Serial.print("Found PN532 with firmware version: 0x");
+      NfcReader &reader = readers[i];
+      uint32_t versiondata = selectReader(reader) ? reader.nfc->getFirmwareVersion() : 0;
+      reader.present = versiondata && reader.nfc->SAMConfig();
+      if (!reader.present)
+      {
+        missing++;
+        continue;
+      }
+
+      Serial.print("Found PN532 ");
+      Serial.print(i);
+      Serial.print(" with firmware version: 0x");
       Serial.println(versiondata, HEX);
+    }
 
-      // Configure board to read RFID tags
-      nfc->SAMConfig();
+    // A reader left wedged by a warm reset gets one recovery before it is reported missing
+    if (missing && restartNFC())
+    {
+      missing = 0;
+      for (uint8_t i = 0; i < NFC_READER_COUNT; i++)
+        missing += readers[i].present ? 0 : 1;
+    }
+
+    if (missing)
+    {
+      Serial.print(missing);
+      Serial.println(" PN532 not found - check I2C wiring");
+      updateLCD("NFC Error", "Check I2C wiring");
+      clockDelay(params->get(PARAM_LCD_ERROR_HOLD_TIME));
     }
 
     initializeServos();
@@ -69,114 +133,756 @@ bool HardwareManager::initialize()
   return false;
 }
 
+void HardwareManager::assignLockerHardware(int index)
+{
+  // Slot hardware is fixed by index; config only decides which id a slot carries
+  switch (index)
+  {
+  case 0:
+    lockers[index].servoPin = SERVO_PIN1;
+    lockers[index].servo = &servo1;
+    break;
+  case 1:
+    lockers[index].servoPin = SERVO_PIN2;
+    lockers[index].servo = &servo2;
+    break;
+  case 2:
+    lockers[index].servoPin = SERVO_PIN3;
+    lockers[index].servo = &servo3;
+    break;
+  }
+
+  lockers[index].currentPosition = LOCK_POSITION;
+  lockers[index].lastStatusUpdate = 0;
+}
+
 void HardwareManager::loadLockerConfiguration()
 {
-  String moduleId = preferences->getString("moduleId", "");
-  isConfigured = (moduleId.length() > 0);
+  PerfProbe probe(PERF_CONFIG_LOAD);
+  char storedId[MODULE_ID_SIZE] = "";
+  preferences->getString("moduleId", storedId, sizeof(storedId));
+  moduleId = storedId;
+  isConfigured = !moduleId.isEmpty();
 
   if (isConfigured)
   {
-    numLockers = preferences->getInt("numLockers", 0);
-    if (numLockers > 0 && numLockers <= MAX_LOCKERS)
+    LockerSet set;
+    bool loaded = preferences->getBytesLength("lockerSet") == sizeof(LockerSet) &&
+                  preferences->getBytes("lockerSet", &set, sizeof(LockerSet)) == sizeof(LockerSet);
+
+    if (!loaded)
     {
-      lockers = new LockerConfig[numLockers];
+      loaded = loadLegacyLockerSet(set);
+    }
 
+    if (loaded && set.count <= MAX_LOCKERS)
+    {
+      numLockers = set.count;
+      configVersion = set.version;
       for (int i = 0; i < numLockers; i++)
       {
-        String key = "locker" + String(i);
-        lockers[i].lockerId = preferences->getString(key.c_str(), "");
-
-        // Assign hardware based on index
-        switch (i)
-        {
-        case 0:
-          lockers[i].servoPin = SERVO_PIN1;
-          lockers[i].servo = &servo1;
-          break;
-        case 1:
-          lockers[i].servoPin = SERVO_PIN2;
-          lockers[i].servo = &servo2;
-          break;
-        case 2:
-          lockers[i].servoPin = SERVO_PIN3;
-          lockers[i].servo = &servo3;
-          break;
-        }
-
-        lockers[i].currentPosition = LOCK_POSITION;
-        lockers[i].lastStatusUpdate = 0;
+        set.ids[i][LOCKER_ID_SIZE - 1] = '\0';
+        lockers[i].lockerId = set.ids[i];
       }
     }
   }
 }
 
-void HardwareManager::saveLockerConfiguration(const String &moduleId, const String *lockerIds, int count)
+bool HardwareManager::loadLegacyLockerSet(LockerSet &set)
 {
+  // Modules configured before lockerSet existed keep one key per locker
+  memset(&set, 0, sizeof(LockerSet));
+
+  int count = preferences->getInt("numLockers", 0);
+  if (count <= 0 || count > MAX_LOCKERS)
+    return false;
+
+  set.count = count;
+  for (int i = 0; i < count; i++)
+  {
+    char key[12];
+    snprintf(key, sizeof(key), "locker%d", i);
+    preferences->getString(key, set.ids[i], LOCKER_ID_SIZE);
+  }
+  return true;
+}
+
+// IDs that do not fit their buffers are refused rather than truncated, so a
+// stored ID always matches what the server sends
+bool HardwareManager::saveLockerConfiguration(const char *moduleId, const char *const *lockerIds, int count,
+                                              uint32_t version)
+{
+  PerfProbe probe(PERF_CONFIG_SAVE);
+  if (strlen(moduleId) > this->moduleId.capacity())
+  {
+    Serial.print(F("Module id too long: "));
+    Serial.println(moduleId);
+    return false;
+  }
+
+  LockerSet set;
+  memset(&set, 0, sizeof(LockerSet));
+  set.version = version;
+  set.count = min(count, MAX_LOCKERS);
+
+  for (int i = 0; i < set.count; i++)
+  {
+    if (strlen(lockerIds[i]) >= LOCKER_ID_SIZE)
+    {
+      Serial.print(F("Locker id too long: "));
+      Serial.println(lockerIds[i]);
+      return false;
+    }
+    strncpy(set.ids[i], lockerIds[i], LOCKER_ID_SIZE - 1);
+  }
+
   preferences->putString("moduleId", moduleId);
-  preferences->putInt("numLockers", count);
+  this->moduleId = moduleId;
+  preferences->putBytes("lockerSet", &set, sizeof(LockerSet));
+  return true;
+}
+
+void HardwareManager::getLockerSet(LockerSet &set) const
+{
+  memset(&set, 0, sizeof(LockerSet));
+  set.version = configVersion;
+  set.count = numLockers;
 
-  for (int i = 0; i < count && i < MAX_LOCKERS; i++)
+  for (int i = 0; i < numLockers; i++)
   {
-    String key = "locker" + String(i);
-    preferences->putString(key.c_str(), lockerIds[i]);
+    strncpy(set.ids[i], lockers[i].lockerId.c_str(), LOCKER_ID_SIZE - 1);
   }
 }
 
+void HardwareManager::applyLockerSet(const LockerSet &set)
+{
+  // A single blob write is the commit point; a power cut leaves the old set
+  preferences->putBytes("lockerSet", &set, sizeof(LockerSet));
+
+  for (int i = 0; i < MAX_LOCKERS; i++)
+  {
+    bool wasAssigned = i < numLockers && !lockers[i].lockerId.isEmpty();
+    bool isAssigned = i < set.count && set.ids[i][0] != '\0';
+
+    lockers[i].lockerId = isAssigned ? set.ids[i] : "";
+
+    if (isAssigned && !wasAssigned)
+    {
+      lockers[i].servo->attach(lockers[i].servoPin);
+      lockers[i].servo->write(LOCK_POSITION);
+      lockers[i].currentPosition = LOCK_POSITION;
+    }
+    else if (!isAssigned && wasAssigned)
+    {
+      // Secure a removed locker before it stops being addressable
+      lockers[i].servo->write(LOCK_POSITION);
+      lockers[i].currentPosition = LOCK_POSITION;
+    }
+  }
+
+  numLockers = set.count;
+  configVersion = set.version;
+}
+
+int HardwareManager::findLockerIndex(const LockerSet &set, const char *lockerId)
+{
+  if (!lockerId || lockerId[0] == '\0')
+    return -1;
+
+  for (int i = 0; i < set.count; i++)
+  {
+    if (strncmp(set.ids[i], lockerId, LOCKER_ID_SIZE) == 0)
+      return i;
+  }
+  return -1;
+}
+
 void HardwareManager::initializeServos()
 {
   for (int i = 0; i < numLockers; i++)
   {
+    if (lockers[i].lockerId.isEmpty())
+      continue; // Free slot
+
     lockers[i].servo->attach(lockers[i].servoPin);
     lockers[i].servo->write(LOCK_POSITION);
     lockers[i].currentPosition = LOCK_POSITION;
   }
 }
 
-bool HardwareManager::scanNFC(String &nfcCode)
+// All readers share RSTPD_N, so a recovery frees the buses, resets every
+// reader and reconfigures each one. Measured from the first failed probe, so
+// the figure is time to recovery. True if at least one reader answers again;
+// one that does not is left out of polling until the next recovery.
+bool HardwareManager::restartNFC()
+{
+  unsigned long faultSince = clockMillis();
+  for (uint8_t i = 0; i < NFC_READER_COUNT; i++)
+  {
+    if (readers[i].faultSince != 0 && readers[i].faultSince < faultSince)
+      faultSince = readers[i].faultSince; // Earliest open fault
+  }
+  nfcRecoveries++;
+
+  // A stuck slave holds SDA low on the channel it sits on, which is the one
+  // selected when the fault was seen; check the others too
+  for (uint8_t i = 0; i < NFC_READER_COUNT; i++)
+  {
+    uint8_t bus = readers[i].wiring->bus;
+    if (isBusStuck(bus) || (selectReader(readers[i]) && isBusStuck(bus)))
+    {
+      busClears++;
+      muxState[bus] = -1;
+      if (!clearI2CBus(bus))
+        Serial.println(F("I2C: SDA still held low after bus clear"));
+    }
+  }
+
+  digitalWrite(PN532_RESET, LOW);
+  clockDelay(NFC_RESET_PULSE_MS);
+  digitalWrite(PN532_RESET, HIGH);
+  clockDelay(NFC_RESET_WAKE_MS);
+
+  // A bus clear's stray clocks can leave a mux on another channel; rewrite
+  // every mux before talking to the readers again
+  muxState[0] = muxState[1] = -1;
+
+  uint8_t answering = 0;
+  for (uint8_t i = 0; i < NFC_READER_COUNT; i++)
+  {
+    NfcReader &reader = readers[i];
+    reader.armed = false;
+    reader.present = selectReader(reader) && reader.nfc->SAMConfig();
+    if (!reader.present)
+    {
+      Serial.print(F("PN532 "));
+      Serial.print(i);
+      Serial.println(F(" did not answer after reset"));
+      continue;
+    }
+    reader.faultSince = 0;
+    reader.faults = 0;
+    answering++;
+  }
+
+  if (answering == 0)
+    return false;
+
+  lastRecoveryMs = clockMillis() - faultSince;
+  if (lastRecoveryMs > maxRecoveryMs)
+    maxRecoveryMs = lastRecoveryMs;
+
+  Serial.print(F("PN532 recovered in "));
+  Serial.print(lastRecoveryMs);
+  Serial.println(F(" ms"));
+  return true;
+}
+
+// SDA and SCL of reader bus 0 (Wire) or 1 (Wire1)
+static void readerBusPins(uint8_t bus, int &sda, int &scl)
+{
+  sda = bus == 0 ? PN532_SDA : NFC_BUS1_SDA;
+  scl = bus == 0 ? PN532_SCL : NFC_BUS1_SCL;
+}
+
+// Between transactions the bus idles high; a slave that lost sync mid-byte
+// holds SDA low and every later transaction fails
+bool HardwareManager::isBusStuck(uint8_t bus)
+{
+  int sda, scl;
+  readerBusPins(bus, sda, scl);
+  return gpio_get_level((gpio_num_t)sda) == 0;
+}
+
+// Bus clear (I2C specification 3.1.16): clock SCL until the slave has shifted
+// out the rest of its byte and lets go of SDA, then issue a STOP
+bool HardwareManager::clearI2CBus(uint8_t bus)
+{
+  int sda, scl;
+  readerBusPins(bus, sda, scl);
+  TwoWire &wire = bus == 0 ? Wire : Wire1;
+
+  wire.end();
+  pinMode(sda, INPUT_PULLUP);
+  pinMode(scl, OUTPUT_OPEN_DRAIN);
+  digitalWrite(scl, HIGH);
+
+  for (int i = 0; i < 9 && digitalRead(sda) == LOW; i++)
+  {
+    digitalWrite(scl, LOW);
+    delayMicroseconds(5);
+    digitalWrite(scl, HIGH);
+    delayMicroseconds(5);
+  }
+
+  // STOP: SDA rises while SCL is high
+  pinMode(sda, OUTPUT_OPEN_DRAIN);
+  digitalWrite(sda, LOW);
+  delayMicroseconds(5);
+  digitalWrite(sda, HIGH);
+  delayMicroseconds(5);
+  bool released = digitalRead(sda) == HIGH;
+
+  wire.begin(sda, scl); // The LCD shares bus 0
+  return released;
+}
+
+// An armed reader that never becomes ready looks the same as an empty field,
+// so when the RF-off command after a poll is not acknowledged either, the
+// reader gets a firmware-version probe
+void HardwareManager::checkNFCHealth(NfcReader &reader, unsigned long currentTime)
+{
+  if (currentTime - reader.lastProbe < NFC_PROBE_INTERVAL)
+    return;
+  reader.lastProbe = currentTime;
+
+  bool stuck = isBusStuck(reader.wiring->bus);
+  if (!stuck && selectReader(reader) && reader.nfc->getFirmwareVersion())
+  {
+    reader.faults = 0;
+    reader.faultSince = 0;
+    return;
+  }
+
+  if (reader.faultSince == 0)
+    reader.faultSince = currentTime;
+
+  if (stuck || ++reader.faults >= NFC_FAULT_THRESHOLD)
+  {
+    Serial.println(stuck ? F("I2C: SDA stuck low, recovering readers") : F("PN532 not answering, recovering"));
+    restartNFC();
+  }
+}
+
+void HardwareManager::nfcToJson(JsonObject out) const
+{
+  unsigned long uptime = clockMillis();
+  uint32_t polls = 0;
+  uint64_t fieldOnMs = 0;
+  bool faulted = false;
+
+  JsonArray list = out.createNestedArray("readers");
+  for (uint8_t i = 0; i < NFC_READER_COUNT; i++)
+  {
+    const NfcReader &reader = readers[i];
+    JsonObject entry = list.createNestedObject();
+    entry["present"] = reader.present;
+    entry["faulted"] = reader.faultSince != 0;
+    entry["polls"] = reader.polls;
+    entry["taps"] = reader.taps;
+    entry["dutyPermille"] = uptime ? (uint32_t)((uint64_t)reader.fieldOnMs * 1000 / uptime) : 0;
+
+    polls += reader.polls;
+    fieldOnMs += reader.fieldOnMs;
+    faulted = faulted || reader.faultSince != 0;
+  }
+
+  out["recoveries"] = nfcRecoveries;
+  out["busClears"] = busClears;
+  out["lastRecoveryMs"] = lastRecoveryMs;
+  out["maxRecoveryMs"] = maxRecoveryMs;
+  out["faulted"] = faulted;
+  out["polls"] = polls;
+  out["dutyPermille"] = uptime ? (uint32_t)(fieldOnMs * 1000 / uptime / NFC_READER_COUNT) : 0; // Mean per reader
+  out["fast"] = isPollingFast();
+}
+
+bool HardwareManager::restartLCD()
+{
+  lcd->init();
+  lcd->backlight();
+  updateSystemStatus();
+  return true; // Write-only; there is nothing to read back
+}
+
+// Re-attaches assigned servos at their last commanded position
+bool HardwareManager::restartServos()
+{
+  for (int i = 0; i < numLockers; i++)
+  {
+    if (lockers[i].lockerId.isEmpty())
+      continue; // Free slot
+
+    lockers[i].servo->detach();
+    lockers[i].servo->attach(lockers[i].servoPin);
+    lockers[i].servo->write(lockers[i].currentPosition);
+  }
+  return true;
+}
+
+// Every reader is serviced on each pass, so detection latency stays at about
+// one loop period however many readers there are. The starting reader
+// rotates so a card held on one reader cannot starve the others.
+bool HardwareManager::scanNFC(FixedString<NFC_CODE_SIZE> &nfcCode)
 {
   if (!isConfigured)
     return false;
 
-  if (readNFCCard(nfcCode))
+  WatchdogSection section(WD_NFC);
+  unsigned long now = clockMillis();
+  if (PROXIMITY_PIN >= 0 && digitalRead(PROXIMITY_PIN) == PROXIMITY_ACTIVE)
+    lastActivity = now;
+
+  uint8_t start = nextReader;
+  nextReader = (nextReader + 1) % NFC_READER_COUNT;
+
+  for (uint8_t k = 0; k < NFC_READER_COUNT; k++)
   {
-    Serial.print(F("NFC: "));
-    Serial.println(nfcCode);
-    updateLCD(F("NFC Detected"), nfcCode.substring(0, 12));
-    delay(1500);
-    updateSystemStatus();
-    return true;
+    uint8_t i = (start + k) % NFC_READER_COUNT;
+    if (serviceReader(i, now, nfcCode))
+    {
+      lastReader = i;
+      lastActivity = clockMillis();
+      Serial.print(F("NFC "));
+      Serial.print(i);
+      Serial.print(F(": "));
+      Serial.println(nfcCode.c_str());
+      return true;
+    }
+  }
+  return false;
+}
+
+// Collects an armed reader once it has a result or the poll timeout has
+// passed, then re-arms it in the same pass if its next poll is already due
+bool HardwareManager::serviceReader(int index, unsigned long currentTime, FixedString<NFC_CODE_SIZE> &nfcCode)
+{
+  NfcReader &reader = readers[index];
+  if (!reader.present)
+    return false;
+
+  if (reader.armed)
+  {
+    bool selected = selectReader(reader);
+    bool ready = selected && isReaderReady(reader);
+    if (selected && !ready && currentTime - reader.armedAt < params->get(PARAM_NFC_POLL_TIMEOUT))
+      return false;
+
+    bool found = ready && readDetectedCard(reader, nfcCode);
+    disarmReader(reader, ready);
+    if (found)
+    {
+      reader.taps++;
+      return true;
+    }
+
+    checkNFCHealth(reader, clockMillis());
+    if (!reader.present)
+      return false; // Recovery gave up on it
   }
 
+  if (!isPollDue(reader, currentTime))
+    return false;
+
+  reader.lastPoll = currentTime;
+  reader.polls++;
+  reader.armedAt = clockMillis();
+  reader.armed = selectReader(reader) && setRFField(reader, true) &&
+                 reader.nfc->startPassiveTargetIDDetection(PN532_MIFARE_ISO14443A);
+  if (!reader.armed)
+    checkNFCHealth(reader, clockMillis());
   return false;
 }
 
-bool HardwareManager::readNFCCard(String &nfcCode)
+// Cancels a search still running, then switches the RF field off until the
+// next poll. The reader's ACK to that doubles as its liveness probe.
+void HardwareManager::disarmReader(NfcReader &reader, bool answered)
+{
+  if (!answered)
+    abortCommand(reader);
+  if (setRFField(reader, false))
+    reader.lastProbe = clockMillis();
+
+  reader.fieldOnMs += clockMillis() - reader.armedAt;
+  reader.armed = false;
+}
+
+bool HardwareManager::isPollingFast() const
+{
+  return clockMillis() - lastActivity < params->get(PARAM_NFC_ACTIVE_WINDOW);
+}
+
+bool HardwareManager::isPollDue(const NfcReader &reader, unsigned long currentTime) const
+{
+  uint32_t interval = params->get(isPollingFast() ? PARAM_NFC_FAST_INTERVAL : PARAM_NFC_IDLE_INTERVAL);
+  return reader.polls == 0 || currentTime - reader.lastPoll >= interval;
+}
+
+bool HardwareManager::readerServesLocker(int reader, int lockerIndex) const
+{
+  if (reader < 0 || reader >= (int)NFC_READER_COUNT || lockerIndex < 0 || lockerIndex >= MAX_LOCKERS)
+    return false;
+  return (readers[reader].wiring->lockerMask >> lockerIndex) & 1;
+}
+
+// Switches the TCA9548A to the reader's channel; the write is skipped when
+// it already is. A directly wired reader on a bus that also has a mux gets
+// every channel switched off, so no muxed PN532 answers at its address.
+bool HardwareManager::selectReader(NfcReader &reader)
 {
-  uint8_t success;
-  uint8_t uid[] = {0, 0, 0, 0, 0, 0, 0};
-  uint8_t uidLength;
+  uint8_t bus = reader.wiring->bus;
+  int8_t channel = reader.wiring->muxChannel;
+  if (!busHasMux[bus])
+    return true;
 
-  // Wait for an ISO14443A type cards (Mifare, etc.)
-  success = nfc->readPassiveTargetID(PN532_MIFARE_ISO14443A, uid, &uidLength, 100);
+  int16_t mask = channel < 0 ? 0 : 1 << channel;
+  if (mask == muxState[bus])
+    return true;
 
-  if (success)
+  reader.wire->beginTransmission(NFC_MUX_ADDRESS);
+  reader.wire->write((uint8_t)mask);
+  if (reader.wire->endTransmission() != 0)
   {
-    // Build hex string from UID
-    nfcCode = "";
-    for (uint8_t i = 0; i < uidLength; i++)
+    muxState[bus] = -1;
+    return false;
+  }
+  muxState[bus] = mask;
+  return true;
+}
+
+// RFConfiguration, item 1 (RF field): bit 0 = field on, bit 1 = auto RFCA off.
+// Returns whether the reader acknowledged.
+bool HardwareManager::setRFField(NfcReader &reader, bool on)
+{
+  uint8_t command[] = {PN532_COMMAND_RFCONFIGURATION, 0x01, (uint8_t)(on ? 0x01 : 0x00)};
+  uint8_t response[2];
+  if (!reader.nfc->sendCommandCheckAck(command, sizeof(command)))
+    return false;
+  readResponse(reader, PN532_COMMAND_RFCONFIGURATION, response, sizeof(response), NFC_COMMAND_TIMEOUT);
+  return true;
+}
+
+// In I2C mode the first byte the PN532 sends is its status; bit 0 is set
+// once a response frame is waiting
+bool HardwareManager::isReaderReady(NfcReader &reader)
+{
+  if (reader.wire->requestFrom((uint8_t)PN532_I2C_ADDRESS, (uint8_t)1) != 1)
+    return false;
+  return reader.wire->read() & 0x01;
+}
+
+// An ACK frame from the host aborts the command in progress (user manual 6.2.1.3)
+void HardwareManager::abortCommand(NfcReader &reader)
+{
+  static const uint8_t ack[] = {0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00};
+  reader.wire->beginTransmission(PN532_I2C_ADDRESS);
+  for (uint8_t b : ack)
+    reader.wire->write(b);
+  reader.wire->endTransmission();
+}
+
+// Waits for the reader to be ready, then reads its response frame:
+// status, 00 00 FF, LEN, LCS, D5, command + 1, data, DCS, 00.
+// Returns the data length, or -1 on a timeout or a malformed frame.
+int HardwareManager::readResponse(NfcReader &reader, uint8_t command, uint8_t *data, uint8_t size, uint16_t timeout)
+{
+  unsigned long start = clockMillis();
+  while (!isReaderReady(reader))
+  {
+    if (clockMillis() - start >= timeout)
+      return -1;
+    clockDelay(1);
+  }
+
+  uint8_t frame[NFC_FRAME_MAX + 10];
+  uint8_t wanted = min<size_t>(size + 10, sizeof(frame));
+  uint8_t received = reader.wire->requestFrom((uint8_t)PN532_I2C_ADDRESS, wanted);
+  for (uint8_t i = 0; i < received; i++)
+  {
+    frame[i] = reader.wire->read();
+  }
+
+  if (received < 8 || frame[1] != 0x00 || frame[2] != 0x00 || frame[3] != 0xFF)
+    return -1;
+
+  uint8_t length = frame[4];
+  if ((uint8_t)(length + frame[5]) != 0 || length < 2 || frame[6] != 0xD5 || frame[7] != command + 1)
+    return -1;
+
+  uint8_t dataLength = length - 2;
+  if (dataLength > size || 8 + dataLength > received)
+    return -1;
+  memcpy(data, frame + 8, dataLength);
+  return dataLength;
+}
+
+// Sends one APDU to the activated target through InDataExchange; returns the
+// response length including the status word, or -1. The read is sized to
+// the answer expected, at about 90 us per byte on a 100 kHz bus.
+int HardwareManager::exchangeApdu(NfcReader &reader, const uint8_t *apdu, uint8_t length, uint8_t *response,
+                                  uint8_t size)
+{
+  if (length > NFC_APDU_MAX || size > NFC_APDU_MAX)
+    return -1;
+
+  uint8_t command[2 + NFC_APDU_MAX];
+  command[0] = PN532_COMMAND_INDATAEXCHANGE;
+  command[1] = 1; // Logical number of the only listed target
+  memcpy(command + 2, apdu, length);
+  if (!reader.nfc->sendCommandCheckAck(command, length + 2))
+    return -1;
+
+  // Response data: status byte, then the target's answer
+  uint8_t data[NFC_APDU_MAX + 1];
+  int received = readResponse(reader, PN532_COMMAND_INDATAEXCHANGE, data, size + 1, NFC_APDU_TIMEOUT);
+  if (received < 1 || (data[0] & 0x3F) != 0 || received - 1 > size)
+    return -1;
+
+  memcpy(response, data + 1, received - 1);
+  return received - 1;
+}
+
+// Two round trips: SELECT, then the challenge, built up front so it follows
+// the SELECT answer without a gap. Verification runs after the field is no
+// longer needed.
+PhoneCredentials::Result HardwareManager::readPhoneCredential(NfcReader &reader, uint8_t *credentialId)
+{
+  PerfProbe probe(PERF_PHONE);
+  unsigned long start = clockMillis();
+
+  uint8_t select[NFC_APDU_MAX];
+  uint8_t challenge[NFC_APDU_MAX];
+  uint8_t selectLength = PhoneCredentials::buildSelect(select);
+  uint8_t challengeLength = phone->buildChallenge(challenge);
+
+  uint8_t response[NFC_APDU_MAX];
+  int length = exchangeApdu(reader, select, selectLength, response, PHONE_SELECT_RESPONSE_MAX);
+  if (!PhoneCredentials::isSelected(response, length))
+    return PhoneCredentials::PHONE_NO_APP;
+
+  length = exchangeApdu(reader, challenge, challengeLength, response, PHONE_RESPONSE_SIZE);
+  PhoneCredentials::Result result = phone->verify(response, length, credentialId);
+  phone->recordExchange(result, clockMillis() - start);
+  return result;
+}
+
+// Three round trips. The card's key comes from the cache, or is derived once
+// the card has confirmed it holds the NexLock application.
+CardAuthenticator::Result HardwareManager::authenticateCard(NfcReader &reader, const uint8_t *uid, uint8_t uidLength)
+{
+  PerfProbe probe(PERF_CARD_AUTH);
+  return cardAuth->authenticate(uid, uidLength,
+                                [this, &reader](const uint8_t *apdu, uint8_t length, uint8_t *response, uint8_t size)
+                                { return exchangeApdu(reader, apdu, length, response, size); });
+}
+
+// A card left on the reader is reported once, not on every poll
+bool HardwareManager::isRepeatTap(NfcReader &reader, const uint8_t *id, uint8_t length, unsigned long now)
+{
+  bool sameCard = length == reader.lastUidLength && memcmp(id, reader.lastUid, length) == 0;
+  bool repeat = sameCard && now - reader.lastSeen < params->get(PARAM_NFC_TIMEOUT);
+  reader.lastSeen = now;
+  reader.lastUidLength = length;
+  memcpy(reader.lastUid, id, length);
+  return repeat;
+}
+
+void HardwareManager::rejectTap(const __FlashStringHelper *title, const char *reason)
+{
+  Serial.print(title);
+  Serial.print(F(": "));
+  Serial.println(reason);
+  updateLCD(title, reason);
+  holdLCD(params->get(PARAM_LCD_ERROR_HOLD_TIME));
+}
+
+bool HardwareManager::readDetectedCard(NfcReader &reader, FixedString<NFC_CODE_SIZE> &nfcCode)
+{
+  // InListPassiveTarget: NbTg, Tg, SENS_RES (2), SEL_RES, NFCID length, NFCID, ATS
+  uint8_t target[NFC_TARGET_MAX];
+  int length = readResponse(reader, PN532_COMMAND_INLISTPASSIVETARGET, target, sizeof(target), 0);
+  if (length < 6 || target[0] != 1 || length < 6 + target[5])
+    return false;
+
+  uint8_t uid[MAX_UID_LENGTH];
+  uint8_t uidLength = min<uint8_t>(target[5], MAX_UID_LENGTH);
+  memcpy(uid, target + 6, uidLength);
+  CredentialKind kind = CREDENTIAL_UID;
+
+  // Checked on the UID before any exchange, so a card held on the reader
+  // costs no authentication per poll. Phones present a fresh random UID each
+  // time and are checked again on their credential id.
+  unsigned long now = clockMillis();
+  if (isRepeatTap(reader, uid, uidLength, now))
+    return false;
+
+  // A 10-byte UID does not fit. Cut to its first 7 bytes it would match any
+  // card sharing that prefix, so it is refused; the prefix above only keeps
+  // a held card from being refused on every poll.
+  if (target[5] > MAX_UID_LENGTH)
+  {
+    rejectTap(F("Card rejected"), "uid too long");
+    return false;
+  }
+
+  // SEL_RES bit 5: ISO-DEP, which is how phones and DESFire cards present themselves
+  bool isoDep = target[4] & 0x20;
+  if (isoDep && phone && phone->isProvisioned())
+  {
+    PhoneCredentials::Result result = readPhoneCredential(reader, uid);
+    if (result == PhoneCredentials::PHONE_OK)
     {
-      if (uid[i] < 0x10)
-        nfcCode += "0";
-      nfcCode += String(uid[i], HEX);
+      kind = CREDENTIAL_PHONE;
+      uidLength = MAX_UID_LENGTH;
+      if (isRepeatTap(reader, uid, uidLength, now))
+        return false;
+    }
+    else if (result != PhoneCredentials::PHONE_NO_APP)
+    {
+      rejectTap(F("Phone rejected"), PhoneCredentials::resultName(result));
+      return false;
     }
-    nfcCode.toUpperCase();
-    return true;
   }
 
-  return false;
+  if (kind == CREDENTIAL_UID && isoDep && cardAuth && cardAuth->isProvisioned())
+  {
+    CardAuthenticator::Result result = authenticateCard(reader, uid, uidLength);
+    if (result == CardAuthenticator::CARD_OK)
+    {
+      kind = CREDENTIAL_DESFIRE;
+    }
+    else if (result != CardAuthenticator::CARD_NO_APP)
+    {
+      rejectTap(F("Card rejected"), CardAuthenticator::resultName(result));
+      return false;
+    }
+  }
+
+  if (kind == CREDENTIAL_UID && params->get(PARAM_SECURE_CARDS))
+  {
+    rejectTap(F("Card rejected"), "not secure");
+    return false;
+  }
+
+  lastUidLength = uidLength;
+  memcpy(lastUid, uid, lastUidLength);
+  lastCredential = kind;
+
+  // Build hex string from UID
+  PerfProbe probe(PERF_NFC_UID);
+  nfcCode.clear();
+  for (uint8_t i = 0; i < lastUidLength; i++)
+  {
+    nfcCode.appendHex(uid[i]);
+  }
+  return true;
+}
+
+const char *HardwareManager::credentialName(CredentialKind kind)
+{
+  switch (kind)
+  {
+  case CREDENTIAL_UID:
+    return "uid";
+  case CREDENTIAL_PHONE:
+    return "phone";
+  case CREDENTIAL_DESFIRE:
+    return "desfire";
+  }
+  return "unknown";
 }
 
-void HardwareManager::setNFCValidationResult(bool valid, const String &message)
+void HardwareManager::setNFCValidationResult(bool valid, const char *message)
 {
   // This method is no longer used in the new server-driven flow
   // Keep for backward compatibility
@@ -189,92 +895,128 @@ void HardwareManager::setNFCValidationResult(bool valid, const String &message)
     updateLCD("Access Denied", message);
   }
 
-  delay(2000);
-  updateSystemStatus();
+  holdLCD(params->get(PARAM_LCD_ERROR_HOLD_TIME));
 }
 
 void HardwareManager::resetNFCValidation()
 {
   waitingForValidation = false;
-  currentNFCCode = "";
+  currentNFCCode.clear();
 }
 
-void HardwareManager::unlockLocker(const String &lockerId)
+void HardwareManager::unlockLocker(const char *lockerId)
 {
-  for (int i = 0; i < numLockers; i++)
-  {
-    if (lockers[i].lockerId == lockerId)
-    {
-      lockers[i].servo->write(OPEN_POSITION);
-      lockers[i].currentPosition = OPEN_POSITION;
+  int i = findLockerIndex(lockerId);
+  if (i < 0)
+    return;
 
-      updateLCD(F("Unlocked"), "L" + lockerId);
-      Serial.print(F("Unlocked: "));
-      Serial.println(lockerId);
+  noteActivity(); // Someone is likely at the cabinet
+  driveServo(i, OPEN_POSITION);
 
-      delay(1500);
-      updateSystemStatus();
-      break;
-    }
-  }
+  LcdLine line("L");
+  updateLCD(F("Unlocked"), line.append(lockerId).c_str());
+  Serial.print(F("Unlocked: "));
+  Serial.println(lockerId);
+
+  holdLCD(params->get(PARAM_LCD_HOLD_TIME));
 }
 
-void HardwareManager::lockLocker(const String &lockerId)
+void HardwareManager::lockLocker(const char *lockerId)
 {
-  for (int i = 0; i < numLockers; i++)
-  {
-    if (lockers[i].lockerId == lockerId)
-    {
-      lockers[i].servo->write(LOCK_POSITION);
-      lockers[i].currentPosition = LOCK_POSITION;
+  int i = findLockerIndex(lockerId);
+  if (i < 0)
+    return;
 
-      updateLCD(F("Locked"), "L" + lockerId);
-      Serial.print(F("Locked: "));
-      Serial.println(lockerId);
+  noteActivity();
+  driveServo(i, LOCK_POSITION);
 
-      delay(1500);
-      updateSystemStatus();
-      break;
-    }
+  LcdLine line("L");
+  updateLCD(F("Locked"), line.append(lockerId).c_str());
+  Serial.print(F("Locked: "));
+  Serial.println(lockerId);
+
+  holdLCD(params->get(PARAM_LCD_HOLD_TIME));
+}
+
+void HardwareManager::toggleLocker(const char *lockerId)
+{
+  int i = findLockerIndex(lockerId);
+  if (i < 0)
+    return;
+
+  noteActivity();
+
+  LcdLine line("Locker ");
+  line.append(lockerId);
+
+  if (lockers[i].currentPosition == LOCK_POSITION)
+  {
+    driveServo(i, OPEN_POSITION);
+    updateLCD("Opened", line.c_str());
+  }
+  else
+  {
+    driveServo(i, LOCK_POSITION);
+    updateLCD("Locked", line.c_str());
   }
+
+  Serial.print(F("Locker "));
+  Serial.print(lockerId);
+  Serial.println(F(" toggled"));
 }
 
-void HardwareManager::toggleLocker(const String &lockerId)
+// Only the servo command is held to the actuation budget; the LCD redraw
+// that follows has its own
+void HardwareManager::driveServo(int index, uint8_t position)
 {
+  WatchdogSection section(WD_ACTUATION);
+  lockers[index].servo->write(position);
+  lockers[index].currentPosition = position;
+}
+
+int HardwareManager::findLockerIndex(const char *lockerId) const
+{
+  PerfProbe probe(PERF_LOCKER_LOOKUP);
+  if (!lockerId || lockerId[0] == '\0')
+    return -1; // Never match a free slot
+
   for (int i = 0; i < numLockers; i++)
   {
     if (lockers[i].lockerId == lockerId)
-    {
-      if (lockers[i].currentPosition == LOCK_POSITION)
-      {
-        lockers[i].servo->write(OPEN_POSITION);
-        lockers[i].currentPosition = OPEN_POSITION;
-        updateLCD("Opened", "Locker " + lockerId);
-      }
-      else
-      {
-        lockers[i].servo->write(LOCK_POSITION);
-        lockers[i].currentPosition = LOCK_POSITION;
-        updateLCD("Locked", "Locker " + lockerId);
-      }
-
-      Serial.println("Locker " + lockerId + " toggled");
-      break;
-    }
+      return i;
   }
+  return -1;
+}
+
+void HardwareManager::updateLCD(const char *line1, const char *line2)
+{
+  PerfProbe probe(PERF_LCD);
+  WatchdogSection section(WD_DISPLAY);
+  lcdHoldDuration = 0; // A newer screen replaces a held one
+  lcd->clear();
+  lcd->setCursor(0, 0);
+  lcd->print(LcdLine(line1).c_str());
+  lcd->setCursor(0, 1);
+  lcd->print(LcdLine(line2).c_str());
 }
 
-void HardwareManager::updateLCD(const String &line1, const String &line2)
+void HardwareManager::updateLCD(const __FlashStringHelper *line1, const char *line2)
 {
+  PerfProbe probe(PERF_LCD);
+  WatchdogSection section(WD_DISPLAY);
+  lcdHoldDuration = 0; // A newer screen replaces a held one
   lcd->clear();
   lcd->setCursor(0, 0);
-  lcd->print(line1.substring(0, LCD_COLS));
+  lcd->print(line1);
   lcd->setCursor(0, 1);
-  lcd->print(line2.substring(0, LCD_COLS));
+  lcd->print(LcdLine(line2).c_str());
 }
 
 void HardwareManager::updateLCD(const __FlashStringHelper *line1, const __FlashStringHelper *line2)
 {
+  PerfProbe probe(PERF_LCD);
+  WatchdogSection section(WD_DISPLAY);
+  lcdHoldDuration = 0; // A newer screen replaces a held one
   lcd->clear();
   lcd->setCursor(0, 0);
   lcd->print(line1);
@@ -282,6 +1024,22 @@ void HardwareManager::updateLCD(const __FlashStringHelper *line1, const __FlashS
   lcd->print(line2);
 }
 
+// Keeps the current screen up for duration, then serviceLCD restores the
+// status screen. The loop keeps running meanwhile instead of blocking in delay().
+void HardwareManager::holdLCD(unsigned long duration)
+{
+  lcdHoldStart = clockMillis();
+  lcdHoldDuration = duration;
+}
+
+void HardwareManager::serviceLCD(unsigned long currentTime)
+{
+  if (lcdHoldDuration != 0 && currentTime - lcdHoldStart >= lcdHoldDuration)
+  {
+    updateSystemStatus(); // Clears the hold
+  }
+}
+
 void HardwareManager::updateSystemStatus()
 {
   if (!isConfigured)
@@ -297,7 +1055,8 @@ void HardwareManager::updateSystemStatus()
       openCount++;
   }
 
-  updateLCD("Open:" + String(openCount), F("Ready"));
+  LcdLine line("Open:");
+  updateLCD(line.append((long)openCount).c_str(), "Ready");
 }
 
 bool HardwareManager::checkConfigButton()
@@ -310,9 +1069,9 @@ bool HardwareManager::checkConfigButton()
     if (!buttonPressed)
     {
       buttonPressed = true;
-      pressStart = millis();
+      pressStart = clockMillis();
     }
-    else if (millis() - pressStart > CONFIG_BUTTON_HOLD_TIME)
+    else if (clockMillis() - pressStart > CONFIG_BUTTON_HOLD_TIME)
     {
       buttonPressed = false;
       return true; // Factory reset requested
@@ -325,8 +1084,3 @@ bool HardwareManager::checkConfigButton()
 
   return false;
 }
-
-String HardwareManager::getModuleId() const
-{
-  return preferences->getString("moduleId", "");
-}
\ No newline at end of file
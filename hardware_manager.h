@@ -6,63 +6,166 @@
 #include <ESP32Servo.h>
 #include <LiquidCrystal_I2C.h>
 #include <Preferences.h>
+#include <ArduinoJson.h>
 #include "config.h"
+#include "runtime_params.h"
+#include "phone_credentials.h"
+#include "card_auth.h"
+#include "virtual_clock.h"
+
+// One LCD row; longer text is cut at the display width
+typedef FixedString<LCD_COLS + 1> LcdLine;
+
+// A PN532 with its polling and health state. A poll arms the reader
+// (InListPassiveTarget) and later collects the result, so readers search in
+// parallel instead of blocking the loop one after another.
+struct NfcReader
+{
+  Adafruit_PN532 *nfc;
+  TwoWire *wire;
+  const NfcReaderWiring *wiring;
+  bool present; // Answered at boot or at the last recovery
+  bool armed;   // Detection outstanding; the RF field is on
+  unsigned long armedAt;
+  unsigned long lastPoll;
+  uint32_t polls;
+  uint32_t taps;
+  uint32_t fieldOnMs;
+
+  // A card left on the reader is reported once
+  uint8_t lastUid[MAX_UID_LENGTH];
+  uint8_t lastUidLength;
+  unsigned long lastSeen;
+
+  unsigned long lastProbe;
+  unsigned long faultSince; // First failed probe of the current fault, 0 = healthy
+  uint8_t faults;
+};
 
 class HardwareManager
 {
 private:
-  Adafruit_PN532 *nfc;
+  NfcReader readers[NFC_READER_COUNT];
+  uint8_t nextReader; // First reader serviced on the next pass
+  int8_t lastReader;  // Reader of the last reported tap
+  int16_t muxState[2]; // Mask last written to each bus's TCA9548A, -1 = unknown
+  bool busHasMux[2];
   LiquidCrystal_I2C *lcd;
   Preferences *preferences;
+  RuntimeParams *params;
+  PhoneCredentials *phone;
+  CardAuthenticator *cardAuth;
 
-  LockerConfig *lockers;
+  LockerConfig lockers[MAX_LOCKERS];
   int numLockers;
+  uint32_t configVersion;
   bool isConfigured;
-  String moduleId;
+  FixedString<MODULE_ID_SIZE> moduleId;
 
   // NFC validation state
   bool waitingForValidation;
-  String currentNFCCode;
-  unsigned long nfcScanTime;
+  FixedString<NFC_CODE_SIZE> currentNFCCode;
+  uint8_t lastUid[MAX_UID_LENGTH];
+  uint8_t lastUidLength;
+  CredentialKind lastCredential;
+
+  // Adaptive polling: fast after activity, slow when idle, RF off in between
+  unsigned long lastActivity;
+
+  // Reader recoveries, all readers together
+  uint32_t nfcRecoveries;
+  uint32_t busClears;
+  uint32_t lastRecoveryMs;
+  uint32_t maxRecoveryMs;
+
+  // A transient LCD message; the status screen returns once it expires
+  unsigned long lcdHoldStart;
+  unsigned long lcdHoldDuration; // 0 = nothing held
 
   // Servo instances
   Servo servo1, servo2, servo3;
 
   void initializeServos();
-  bool readNFCCard(String &nfcCode);
+  void assignLockerHardware(int index);
+  bool loadLegacyLockerSet(LockerSet &set);
+  bool serviceReader(int index, unsigned long currentTime, FixedString<NFC_CODE_SIZE> &nfcCode);
+  bool readDetectedCard(NfcReader &reader, FixedString<NFC_CODE_SIZE> &nfcCode);
+  PhoneCredentials::Result readPhoneCredential(NfcReader &reader, uint8_t *credentialId);
+  CardAuthenticator::Result authenticateCard(NfcReader &reader, const uint8_t *uid, uint8_t uidLength);
+  bool isRepeatTap(NfcReader &reader, const uint8_t *id, uint8_t length, unsigned long now);
+  void rejectTap(const __FlashStringHelper *title, const char *reason);
+  int exchangeApdu(NfcReader &reader, const uint8_t *apdu, uint8_t length, uint8_t *response, uint8_t size);
+  static int readResponse(NfcReader &reader, uint8_t command, uint8_t *data, uint8_t size, uint16_t timeout);
+  void disarmReader(NfcReader &reader, bool answered);
+  void checkNFCHealth(NfcReader &reader, unsigned long currentTime);
+  bool isPollDue(const NfcReader &reader, unsigned long currentTime) const;
+  bool selectReader(NfcReader &reader);
+  static bool setRFField(NfcReader &reader, bool on);
+  static bool isReaderReady(NfcReader &reader);
+  static void abortCommand(NfcReader &reader);
+  static bool isBusStuck(uint8_t bus);
+  static bool clearI2CBus(uint8_t bus);
+  void driveServo(int index, uint8_t position);
 
 public:
-  HardwareManager(Preferences *prefs);
+  HardwareManager(Preferences *prefs, RuntimeParams *runtimeParams);
   ~HardwareManager();
 
   bool initialize();
   void loadLockerConfiguration();
-  void saveLockerConfiguration(const String &moduleId, const String *lockerIds, int count);
+  bool saveLockerConfiguration(const char *moduleId, const char *const *lockerIds, int count, uint32_t version);
+
+  // Config patches: copy out the current set, edit it, then apply it in one step
+  void getLockerSet(LockerSet &set) const;
+  void applyLockerSet(const LockerSet &set);
+  static int findLockerIndex(const LockerSet &set, const char *lockerId);
 
   // NFC operations
-  bool scanNFC(String &nfcCode);
-  void setNFCValidationResult(bool valid, const String &message);
+  bool scanNFC(FixedString<NFC_CODE_SIZE> &nfcCode);
+  void noteActivity() { lastActivity = clockMillis(); }
+  bool isPollingFast() const;
+  int getLastReader() const { return lastReader; }
+  CredentialKind getLastCredential() const { return lastCredential; }
+  static const char *credentialName(CredentialKind kind);
+  void setPhoneCredentials(PhoneCredentials *credentials) { phone = credentials; }
+  void setCardAuthenticator(CardAuthenticator *authenticator) { cardAuth = authenticator; }
+  bool readerServesLocker(int reader, int lockerIndex) const;
+  void setNFCValidationResult(bool valid, const char *message);
   bool isWaitingForNFCValidation() const { return waitingForValidation; }
+  const uint8_t *getLastUid() const { return lastUid; }
+  uint8_t getLastUidLength() const { return lastUidLength; }
   void resetNFCValidation();
 
   // Locker operations
-  void unlockLocker(const String &lockerId);
-  void lockLocker(const String &lockerId);
-  void toggleLocker(const String &lockerId);
+  void unlockLocker(const char *lockerId);
+  void lockLocker(const char *lockerId);
+  void toggleLocker(const char *lockerId);
+  int findLockerIndex(const char *lockerId) const;
 
   // LCD operations
-  void updateLCD(const String &line1, const String &line2);
+  void updateLCD(const char *line1, const char *line2);
+  void updateLCD(const __FlashStringHelper *line1, const char *line2);
   void updateLCD(const __FlashStringHelper *line1, const __FlashStringHelper *line2);
   void updateSystemStatus();
+  void holdLCD(unsigned long duration);
+
+  // Watchdog recovery; each returns true if the device answers again
+  bool restartNFC(); // Also run on its own when a reader stops answering
+  bool restartLCD();
+  bool restartServos();
+  void serviceLCD(unsigned long currentTime);
 
   // Configuration button
   bool checkConfigButton();
 
   // Getters
   int getNumLockers() const { return numLockers; }
-  LockerConfig *getLockers() const { return lockers; }
+  LockerConfig *getLockers() { return lockers; }
+  const LockerConfig *getLockers() const { return lockers; }
+  uint32_t getConfigVersion() const { return configVersion; }
   bool getConfigurationStatus() const { return isConfigured; }
-  String getModuleId() const;
+  const char *getModuleId() const { return moduleId.c_str(); }
+  void nfcToJson(JsonObject out) const;
 };
 
 #endif
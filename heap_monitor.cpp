@@ -0,0 +1,121 @@
+#include "heap_monitor.h"
+#include <esp_heap_caps.h>
+
+HeapMonitor heapMonitor;
+
+HeapMonitor::HeapMonitor()
+    : freeBytes(0), largestBlock(0), freeBlocks(0), allocatedBlocks(0), head(0), count(0), windowFree(0),
+      windowLargest(0), lastSample(0), windowStart(0),
+      trendWindow(HEAP_TREND_WINDOW)
+{
+}
+
+// A soak run shortens the window so drift shows within minutes. Points taken
+// over a different window length are not comparable, so a change starts over.
+void HeapMonitor::loop(unsigned long currentTime, uint32_t window)
+{
+  if (window != trendWindow)
+  {
+    trendWindow = window;
+    head = 0;
+    count = 0;
+    windowFree = 0;
+    windowLargest = 0;
+    windowStart = 0;
+  }
+
+  if (lastSample != 0 && currentTime - lastSample < HEAP_SAMPLE_INTERVAL)
+    return;
+
+  lastSample = currentTime;
+  if (windowStart == 0)
+    windowStart = currentTime;
+
+  sample();
+
+  if (currentTime - windowStart >= trendWindow)
+  {
+    closeWindow();
+    windowStart = currentTime;
+  }
+}
+
+void HeapMonitor::sample()
+{
+  multi_heap_info_t info;
+  heap_caps_get_info(&info, MALLOC_CAP_8BIT);
+
+  freeBytes = info.total_free_bytes;
+  largestBlock = info.largest_free_block;
+  freeBlocks = info.free_blocks;
+  allocatedBlocks = info.allocated_blocks;
+
+  if (freeBytes > windowFree)
+    windowFree = freeBytes;
+  if (largestBlock > windowLargest)
+    windowLargest = largestBlock;
+}
+
+void HeapMonitor::closeWindow()
+{
+  uint8_t slot = (head + count) % HEAP_TREND_POINTS;
+  freeBaselines[slot] = windowFree;
+  largestBaselines[slot] = windowLargest;
+
+  if (count < HEAP_TREND_POINTS)
+    count++;
+  else
+    head = (head + 1) % HEAP_TREND_POINTS;
+
+  windowFree = 0;
+  windowLargest = 0;
+}
+
+// Least-squares slope over the stored baselines, in bytes per hour
+int32_t HeapMonitor::trendPerHour(const uint32_t *points) const
+{
+  if (count < 2)
+    return 0;
+
+  float meanX = (count - 1) / 2.0f;
+  float meanY = 0;
+  for (uint8_t i = 0; i < count; i++)
+    meanY += points[(head + i) % HEAP_TREND_POINTS];
+  meanY /= count;
+
+  float covariance = 0;
+  float variance = 0;
+  for (uint8_t i = 0; i < count; i++)
+  {
+    float dx = i - meanX;
+    covariance += dx * (points[(head + i) % HEAP_TREND_POINTS] - meanY);
+    variance += dx * dx;
+  }
+
+  float perWindow = covariance / variance;
+  return (int32_t)(perWindow * 3600000.0f / trendWindow);
+}
+
+uint32_t HeapMonitor::getFragmentation() const
+{
+  if (freeBytes == 0)
+    return 0;
+  return 1000 - (uint32_t)((uint64_t)largestBlock * 1000 / freeBytes);
+}
+
+bool HeapMonitor::isDrifting() const
+{
+  return count >= HEAP_TREND_MIN_POINTS &&
+         (getFreeTrend() <= -HEAP_DRIFT_BYTES_PER_HOUR || getLargestTrend() <= -HEAP_DRIFT_BYTES_PER_HOUR);
+}
+
+void HeapMonitor::toJson(JsonObject out) const
+{
+  out["fragPermille"] = getFragmentation();
+  out["freeBlocks"] = freeBlocks;
+  out["usedBlocks"] = allocatedBlocks;
+  out["points"] = count;
+  out["freeTrend"] = getFreeTrend();
+  out["largestTrend"] = getLargestTrend();
+  out["drifting"] = isDrifting();
+}
@@ -0,0 +1,53 @@
+#ifndef HEAP_MONITOR_H
+#define HEAP_MONITOR_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "config.h"
+
+// Watches for slow memory decay. The heap is sampled every
+// HEAP_SAMPLE_INTERVAL. The highest free figure seen in each trend window
+// (the heapTrendWindow runtime parameter, an hour by default) is
+// taken as that window's baseline, since transient buffers have been returned
+// by then. A leak shows up as a baseline that keeps falling; fragmentation as
+// a largest free block that keeps shrinking while free memory holds.
+class HeapMonitor
+{
+private:
+  // Latest sample
+  uint32_t freeBytes;
+  uint32_t largestBlock;
+  uint32_t freeBlocks;
+  uint32_t allocatedBlocks;
+
+  // Baselines, oldest first from head
+  uint32_t freeBaselines[HEAP_TREND_POINTS];
+  uint32_t largestBaselines[HEAP_TREND_POINTS];
+  uint8_t head;
+  uint8_t count;
+  uint32_t windowFree;
+  uint32_t windowLargest;
+
+  unsigned long lastSample;
+  unsigned long windowStart;
+  uint32_t trendWindow;
+
+  void sample();
+  void closeWindow();
+  int32_t trendPerHour(const uint32_t *points) const;
+
+public:
+  HeapMonitor();
+
+  void loop(unsigned long currentTime, uint32_t window);
+
+  uint32_t getFragmentation() const; // Per mille: 0 = one free block holds all free memory
+  int32_t getFreeTrend() const { return trendPerHour(freeBaselines); }
+  int32_t getLargestTrend() const { return trendPerHour(largestBaselines); }
+  bool isDrifting() const;
+  void toJson(JsonObject out) const;
+};
+
+extern HeapMonitor heapMonitor;
+
+#endif
@@ -0,0 +1,466 @@
+#include "mesh_manager.h"
+#include "virtual_clock.h"
+
+static const uint8_t BROADCAST_MAC[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+MeshManager *MeshManager::instance = nullptr;
+
+MeshManager::MeshManager(Preferences *prefs)
+    : preferences(prefs), rxQueue(nullptr), initialized(false), channel(0), nextSeq(1),
+      bootEpoch(0), lastBeacon(0), recentIndex(0), framesRelayed(0), framesDropped(0), duplicatesSeen(0),
+      peersEvicted(0), uplinkAvailable(false), channelPinned(false)
+{
+  memset(selfMac, 0, sizeof(selfMac));
+  memset(neighbors, 0, sizeof(neighbors));
+  memset(reverseRoutes, 0, sizeof(reverseRoutes));
+  memset(peers, 0, sizeof(peers));
+  memset(recentFrames, 0, sizeof(recentFrames));
+  instance = this;
+}
+
+MeshManager::~MeshManager()
+{
+  if (initialized)
+  {
+    esp_now_deinit();
+  }
+  if (rxQueue)
+  {
+    vQueueDelete(rxQueue);
+  }
+  instance = nullptr;
+}
+
+bool MeshManager::initialize()
+{
+  esp_wifi_get_mac(WIFI_IF_STA, selfMac);
+  channel = preferences->getUChar("meshChannel", 0);
+
+  // Sequence numbers restart at every boot; the epoch keeps neighbors from
+  // taking our first frames for ones they saw before the restart
+  bootEpoch = esp_random();
+
+  rxQueue = xQueueCreate(MESH_RX_QUEUE, sizeof(MeshPacket));
+  if (!rxQueue || esp_now_init() != ESP_OK)
+  {
+    Serial.println(F("Mesh: ESP-NOW init failed"));
+    return false;
+  }
+
+  esp_now_register_recv_cb(receiveCallback);
+  initialized = ensurePeer(BROADCAST_MAC);
+  return initialized;
+}
+
+#if ESP_IDF_VERSION_MAJOR >= 5
+void MeshManager::receiveCallback(const esp_now_recv_info_t *info, const uint8_t *data, int length)
+{
+  queuePacket(info->src_addr, data, length);
+}
+#else
+void MeshManager::receiveCallback(const uint8_t *sender, const uint8_t *data, int length)
+{
+  queuePacket(sender, data, length);
+}
+#endif
+
+void MeshManager::queuePacket(const uint8_t *sender, const uint8_t *data, int length)
+{
+  // Runs in the WiFi task; hand the frame to loop() and return immediately
+  if (!instance || !instance->rxQueue || length <= 0 || length > ESP_NOW_MAX_DATA_LEN)
+    return;
+
+  MeshPacket packet;
+  memcpy(packet.sender, sender, 6);
+  packet.length = length;
+  memcpy(packet.data, data, length);
+
+  if (xQueueSend(instance->rxQueue, &packet, 0) != pdTRUE)
+  {
+    instance->framesDropped++;
+  }
+}
+
+void MeshManager::loop(bool hasUplink, bool radioFree)
+{
+  if (!initialized)
+    return;
+
+  uplinkAvailable = hasUplink;
+  trackChannel(radioFree);
+
+  MeshPacket packet;
+  while (xQueueReceive(rxQueue, &packet, 0) == pdTRUE)
+  {
+    processPacket(packet);
+  }
+
+  unsigned long now = clockMillis();
+  for (int i = 0; i < MESH_MAX_NEIGHBORS; i++)
+  {
+    if (neighbors[i].lastSeen != 0 && now - neighbors[i].lastSeen > MESH_ROUTE_TIMEOUT)
+      memset(&neighbors[i], 0, sizeof(MeshNeighbor));
+  }
+  expirePeers(now);
+
+  if (now - lastBeacon >= MESH_BEACON_INTERVAL)
+  {
+    lastBeacon = now;
+
+    // Modules without their own uplink advertise the route they use, so
+    // coverage extends more than one hop from the nearest online module
+    const MeshNeighbor *best = bestNeighbor();
+    if (hasUplink)
+      sendFrame(BROADCAST_MAC, MESH_BEACON, 1, 0, selfMac, 0, bootEpoch, nullptr, 0);
+    else if (best && best->hops + 1 < MESH_DEFAULT_TTL)
+      sendFrame(BROADCAST_MAC, MESH_BEACON, 1, best->hops + 1, selfMac, 0, bootEpoch, nullptr, 0);
+  }
+}
+
+void MeshManager::trackChannel(bool radioFree)
+{
+  // ESP-NOW only reaches peers on the same channel: learn it from the AP while
+  // online, and hold it while offline unless a reconnect attempt owns the radio
+  if (WiFi.status() == WL_CONNECTED)
+  {
+    channelPinned = false;
+    uint8_t current = WiFi.channel();
+    if (current != channel)
+    {
+      channel = current;
+      preferences->putUChar("meshChannel", channel);
+    }
+  }
+  else if (!radioFree)
+  {
+    channelPinned = false;
+  }
+  else if (!channelPinned && channel != 0)
+  {
+    channelPinned = esp_wifi_set_channel(channel, WIFI_SECOND_CHAN_NONE) == ESP_OK;
+  }
+}
+
+void MeshManager::processPacket(const MeshPacket &packet)
+{
+  MeshHeader header;
+  if (packet.length < sizeof(MeshHeader))
+    return;
+
+  memcpy(&header, packet.data, sizeof(MeshHeader));
+  if (header.magic != MESH_MAGIC || sizeof(MeshHeader) + header.length > packet.length)
+    return;
+
+  const uint8_t *payload = packet.data + sizeof(MeshHeader);
+
+  if (header.kind == MESH_BEACON)
+  {
+    updateNeighbor(packet.sender, header.hops);
+    return;
+  }
+
+  char text[MESH_MAX_PAYLOAD + 1];
+  memcpy(text, payload, header.length);
+  text[header.length] = '\0';
+
+  // Mux frames are single hop and never relayed, so they stay out of the
+  // dedupe ring where they could collide with routed frames
+  if (header.kind == MESH_MUX_UP || header.kind == MESH_MUX_DOWN)
+  {
+    if (directHandler)
+      directHandler(packet.sender, (MeshFrameKind)header.kind, text);
+    return;
+  }
+
+  if (isDuplicate(header))
+  {
+    duplicatesSeen++;
+    return;
+  }
+
+  if (header.kind == MESH_UPLINK)
+  {
+    if (memcmp(header.origin, selfMac, 6) == 0)
+      return;
+
+    rememberReverseRoute(header.origin, packet.sender);
+
+    if (uplinkAvailable && uplinkHandler)
+    {
+      uplinkHandler(header.origin, header.hops + 1, text);
+      framesRelayed++;
+      return;
+    }
+
+    const MeshNeighbor *best = bestNeighbor();
+    if (header.ttl > 1 && best && memcmp(best->mac, packet.sender, 6) != 0 &&
+        sendFrame(best->mac, MESH_UPLINK, header.ttl - 1, header.hops + 1, header.origin,
+                  header.seq, header.epoch, payload, header.length))
+    {
+      framesRelayed++;
+    }
+    else
+    {
+      framesDropped++;
+    }
+  }
+  else if (header.kind == MESH_DOWNLINK)
+  {
+    if (memcmp(header.origin, selfMac, 6) == 0)
+    {
+      if (downlinkHandler)
+        downlinkHandler(text);
+      return;
+    }
+
+    if (header.ttl <= 1)
+    {
+      framesDropped++;
+      return;
+    }
+
+    const uint8_t *nextHop = findReverseRoute(header.origin);
+    if (sendFrame(nextHop ? nextHop : BROADCAST_MAC, MESH_DOWNLINK, header.ttl - 1, header.hops + 1,
+                  header.origin, header.seq, header.epoch, payload, header.length))
+      framesRelayed++;
+    else
+      framesDropped++;
+  }
+}
+
+bool MeshManager::isDuplicate(const MeshHeader &header)
+{
+  // FNV-1a over origin, sequence number, epoch and kind
+  uint32_t key = 2166136261UL;
+  for (int i = 0; i < 6; i++)
+  {
+    key = (key ^ header.origin[i]) * 16777619UL;
+  }
+  key = (key ^ (header.seq & 0xFF)) * 16777619UL;
+  key = (key ^ (header.seq >> 8)) * 16777619UL;
+  key = (key ^ (header.epoch & 0xFF)) * 16777619UL;
+  key = (key ^ (header.epoch >> 8)) * 16777619UL;
+  key = (key ^ header.kind) * 16777619UL;
+  key |= 1; // 0 marks an empty slot
+
+  for (int i = 0; i < MESH_DEDUPE_SIZE; i++)
+  {
+    if (recentFrames[i] == key)
+      return true;
+  }
+
+  recentFrames[recentIndex] = key;
+  recentIndex = (recentIndex + 1) % MESH_DEDUPE_SIZE;
+  return false;
+}
+
+void MeshManager::updateNeighbor(const uint8_t *mac, uint8_t hops)
+{
+  MeshNeighbor *slot = nullptr;
+  MeshNeighbor *oldest = &neighbors[0];
+
+  for (int i = 0; i < MESH_MAX_NEIGHBORS; i++)
+  {
+    if (neighbors[i].lastSeen != 0 && memcmp(neighbors[i].mac, mac, 6) == 0)
+    {
+      slot = &neighbors[i];
+      break;
+    }
+    if (!slot && neighbors[i].lastSeen == 0)
+      slot = &neighbors[i];
+    if (neighbors[i].lastSeen < oldest->lastSeen)
+      oldest = &neighbors[i];
+  }
+
+  if (!slot)
+    slot = oldest;
+
+  memcpy(slot->mac, mac, 6);
+  slot->hops = hops;
+  slot->lastSeen = clockMillis();
+}
+
+const MeshNeighbor *MeshManager::bestNeighbor() const
+{
+  const MeshNeighbor *best = nullptr;
+  for (int i = 0; i < MESH_MAX_NEIGHBORS; i++)
+  {
+    if (neighbors[i].lastSeen == 0)
+      continue;
+    if (!best || neighbors[i].hops < best->hops)
+      best = &neighbors[i];
+  }
+  return best;
+}
+
+void MeshManager::rememberReverseRoute(const uint8_t *origin, const uint8_t *nextHop)
+{
+  MeshReverseRoute *slot = &reverseRoutes[0];
+  for (int i = 0; i < MESH_MAX_REVERSE_ROUTES; i++)
+  {
+    if (memcmp(reverseRoutes[i].origin, origin, 6) == 0)
+    {
+      slot = &reverseRoutes[i];
+      break;
+    }
+    if (reverseRoutes[i].lastUsed < slot->lastUsed)
+      slot = &reverseRoutes[i];
+  }
+
+  memcpy(slot->origin, origin, 6);
+  memcpy(slot->nextHop, nextHop, 6);
+  slot->lastUsed = clockMillis();
+}
+
+const uint8_t *MeshManager::findReverseRoute(const uint8_t *origin) const
+{
+  for (int i = 0; i < MESH_MAX_REVERSE_ROUTES; i++)
+  {
+    if (reverseRoutes[i].lastUsed != 0 && memcmp(reverseRoutes[i].origin, origin, 6) == 0)
+      return reverseRoutes[i].nextHop;
+  }
+  return nullptr;
+}
+
+bool MeshManager::sendUplink(const char *payload, size_t length)
+{
+  const MeshNeighbor *best = bestNeighbor();
+  if (!initialized || !best || length > MESH_MAX_PAYLOAD)
+  {
+    framesDropped++;
+    return false;
+  }
+
+  return sendFrame(best->mac, MESH_UPLINK, MESH_DEFAULT_TTL, 0, selfMac, nextSeq++, bootEpoch,
+                   (const uint8_t *)payload, length);
+}
+
+bool MeshManager::sendDownlink(const uint8_t *destination, const char *payload, size_t length)
+{
+  if (!initialized || length > MESH_MAX_PAYLOAD)
+  {
+    framesDropped++;
+    return false;
+  }
+
+  const uint8_t *nextHop = findReverseRoute(destination);
+  return sendFrame(nextHop ? nextHop : BROADCAST_MAC, MESH_DOWNLINK, MESH_DEFAULT_TTL, 0, destination,
+                   nextSeq++, bootEpoch, (const uint8_t *)payload, length);
+}
+
+bool MeshManager::sendDirect(const uint8_t *to, MeshFrameKind kind, const char *payload, size_t length)
+{
+  if (!initialized || length > MESH_MAX_PAYLOAD)
+  {
+    framesDropped++;
+    return false;
+  }
+
+  return sendFrame(to, kind, 1, 0, selfMac, nextSeq++, bootEpoch, (const uint8_t *)payload, length);
+}
+
+bool MeshManager::sendFrame(const uint8_t *to, MeshFrameKind kind, uint8_t ttl, uint8_t hops, const uint8_t *origin,
+                            uint16_t seq, uint16_t epoch, const uint8_t *payload, size_t length)
+{
+  uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+  MeshHeader header;
+  header.magic = MESH_MAGIC;
+  header.kind = kind;
+  header.ttl = ttl;
+  header.hops = hops;
+  memcpy(header.origin, origin, 6);
+  header.seq = seq;
+  header.epoch = epoch;
+  header.length = length;
+
+  memcpy(frame, &header, sizeof(MeshHeader));
+  if (length > 0)
+    memcpy(frame + sizeof(MeshHeader), payload, length);
+
+  // Unicast gets link-layer acks and retries; broadcast is best effort
+  if (!ensurePeer(to))
+    return false;
+  return esp_now_send(to, frame, sizeof(MeshHeader) + length) == ESP_OK;
+}
+
+bool MeshManager::ensurePeer(const uint8_t *mac)
+{
+  // The broadcast peer is registered once at init and never evicted
+  if (memcmp(mac, BROADCAST_MAC, 6) != 0)
+    trackPeer(mac);
+
+  if (esp_now_is_peer_exist(mac))
+    return true;
+
+  esp_now_peer_info_t peer;
+  memset(&peer, 0, sizeof(peer));
+  memcpy(peer.peer_addr, mac, 6);
+  peer.channel = 0; // Follow the current radio channel
+  peer.ifidx = WIFI_IF_STA;
+  peer.encrypt = false;
+  return esp_now_add_peer(&peer) == ESP_OK;
+}
+
+// ESP-NOW holds at most 20 peers and every unicast destination takes one, so
+// the least recently used entry makes room for a new one
+void MeshManager::trackPeer(const uint8_t *mac)
+{
+  MeshPeer *slot = nullptr;
+  for (int i = 0; i < MESH_MAX_PEERS; i++)
+  {
+    if (peers[i].lastUsed != 0 && memcmp(peers[i].mac, mac, 6) == 0)
+    {
+      slot = &peers[i];
+      break;
+    }
+    if (!slot || peers[i].lastUsed < slot->lastUsed)
+      slot = &peers[i];
+  }
+
+  if (slot->lastUsed != 0 && memcmp(slot->mac, mac, 6) != 0)
+  {
+    esp_now_del_peer(slot->mac);
+    peersEvicted++;
+  }
+
+  memcpy(slot->mac, mac, 6);
+  slot->lastUsed = clockMillis();
+}
+
+void MeshManager::expirePeers(unsigned long now)
+{
+  for (int i = 0; i < MESH_MAX_PEERS; i++)
+  {
+    if (peers[i].lastUsed != 0 && now - peers[i].lastUsed > MESH_PEER_TIMEOUT)
+    {
+      esp_now_del_peer(peers[i].mac);
+      memset(&peers[i], 0, sizeof(MeshPeer));
+    }
+  }
+}
+
+bool MeshManager::parseMac(const char *hex, uint8_t *mac)
+{
+  if (!hex || strlen(hex) != 12)
+    return false;
+
+  for (int i = 0; i < 6; i++)
+  {
+    char pair[3] = {hex[i * 2], hex[i * 2 + 1], '\0'};
+    char *end;
+    mac[i] = strtoul(pair, &end, 16);
+    if (*end != '\0')
+      return false;
+  }
+  return true;
+}
+
+void MeshManager::formatMac(const uint8_t *mac, char *out)
+{
+  // Same format as WiFiManager's macAddress: 12 upper-case hex digits
+  for (int i = 0; i < 6; i++)
+  {
+    sprintf(out + i * 2, "%02X", mac[i]);
+  }
+  out[12] = '\0';
+}
@@ -0,0 +1,150 @@
+#ifndef MESH_MANAGER_H
+#define MESH_MANAGER_H
+
+#include <WiFi.h>
+#include <Preferences.h>
+#include <esp_now.h>
+#include <esp_idf_version.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <functional>
+#include "config.h"
+
+enum MeshFrameKind : uint8_t
+{
+  MESH_BEACON = 1,   // "I can reach the server in <hops> hops"
+  MESH_UPLINK = 2,   // Event frame travelling toward the server
+  MESH_DOWNLINK = 3, // Command frame travelling toward <origin>
+  MESH_MUX_UP = 4,   // Secondary to its gateway, single hop
+  MESH_MUX_DOWN = 5  // Gateway to one of its secondaries, single hop
+};
+
+struct __attribute__((packed)) MeshHeader
+{
+  uint8_t magic;
+  uint8_t kind;
+  uint8_t ttl;
+  uint8_t hops;
+  uint8_t origin[6]; // Source of an uplink, destination of a downlink
+  uint16_t seq;
+  uint16_t epoch; // Random per boot of the module that assigned seq
+  uint8_t length;
+};
+
+#define MESH_MAGIC 0x4F // Bumped with the epoch field, so older frames are ignored
+#define MESH_MAX_PAYLOAD (ESP_NOW_MAX_DATA_LEN - sizeof(MeshHeader))
+
+struct MeshPacket
+{
+  uint8_t sender[6];
+  uint8_t length;
+  uint8_t data[ESP_NOW_MAX_DATA_LEN];
+};
+
+struct MeshNeighbor
+{
+  uint8_t mac[6];
+  uint8_t hops;
+  unsigned long lastSeen;
+};
+
+struct MeshReverseRoute
+{
+  uint8_t origin[6];
+  uint8_t nextHop[6];
+  unsigned long lastUsed;
+};
+
+struct MeshPeer
+{
+  uint8_t mac[6];
+  unsigned long lastUsed; // 0 = free slot
+};
+
+// Keeps a module reachable when its own AP path is gone: compact JSON event
+// frames are relayed over ESP-NOW to a neighbor that still holds a WebSocket,
+// and commands come back along the reverse path.
+class MeshManager
+{
+public:
+  typedef std::function<void(const uint8_t *origin, uint8_t hops, const char *payload)> UplinkCallback;
+  typedef std::function<void(char *payload)> DownlinkCallback;
+  typedef std::function<void(const uint8_t *sender, MeshFrameKind kind, char *payload)> DirectCallback;
+
+private:
+  Preferences *preferences;
+  QueueHandle_t rxQueue;
+  bool initialized;
+  uint8_t selfMac[6];
+  uint8_t channel;
+  uint16_t nextSeq;
+  uint16_t bootEpoch;
+  unsigned long lastBeacon;
+
+  MeshNeighbor neighbors[MESH_MAX_NEIGHBORS];
+  MeshReverseRoute reverseRoutes[MESH_MAX_REVERSE_ROUTES];
+  MeshPeer peers[MESH_MAX_PEERS];
+  uint32_t recentFrames[MESH_DEDUPE_SIZE];
+  uint8_t recentIndex;
+
+  UplinkCallback uplinkHandler;
+  DownlinkCallback downlinkHandler;
+  DirectCallback directHandler;
+
+  // Counters for telemetry
+  uint32_t framesRelayed;
+  uint32_t framesDropped;
+  uint32_t duplicatesSeen;
+  uint32_t peersEvicted;
+
+  bool uplinkAvailable;
+  bool channelPinned;
+
+  static MeshManager *instance;
+#if ESP_IDF_VERSION_MAJOR >= 5
+  static void receiveCallback(const esp_now_recv_info_t *info, const uint8_t *data, int length);
+#else
+  static void receiveCallback(const uint8_t *sender, const uint8_t *data, int length);
+#endif
+  static void queuePacket(const uint8_t *sender, const uint8_t *data, int length);
+
+  void trackChannel(bool radioFree);
+  void processPacket(const MeshPacket &packet);
+  bool isDuplicate(const MeshHeader &header);
+  void updateNeighbor(const uint8_t *mac, uint8_t hops);
+  const MeshNeighbor *bestNeighbor() const;
+  void rememberReverseRoute(const uint8_t *origin, const uint8_t *nextHop);
+  const uint8_t *findReverseRoute(const uint8_t *origin) const;
+  bool sendFrame(const uint8_t *to, MeshFrameKind kind, uint8_t ttl, uint8_t hops, const uint8_t *origin,
+                 uint16_t seq, uint16_t epoch, const uint8_t *payload, size_t length);
+  bool ensurePeer(const uint8_t *mac);
+  void trackPeer(const uint8_t *mac);
+  void expirePeers(unsigned long now);
+
+public:
+  MeshManager(Preferences *prefs);
+  ~MeshManager();
+
+  bool initialize();
+  void loop(bool hasUplink, bool radioFree);
+
+  void onUplink(UplinkCallback callback) { uplinkHandler = callback; }
+  void onDownlink(DownlinkCallback callback) { downlinkHandler = callback; }
+  void onDirect(DirectCallback callback) { directHandler = callback; }
+
+  bool sendUplink(const char *payload, size_t length);
+  bool sendDownlink(const uint8_t *destination, const char *payload, size_t length);
+  bool sendDirect(const uint8_t *to, MeshFrameKind kind, const char *payload, size_t length);
+
+  bool hasRoute() const { return bestNeighbor() != nullptr; }
+  static bool parseMac(const char *hex, uint8_t *mac);
+  static void formatMac(const uint8_t *mac, char *out);
+
+  // Getters
+  uint32_t getFramesRelayed() const { return framesRelayed; }
+  uint32_t getFramesDropped() const { return framesDropped; }
+  uint32_t getDuplicatesSeen() const { return duplicatesSeen; }
+  uint32_t getPeersEvicted() const { return peersEvicted; }
+};
+
+#endif
@@ -3,15 +3,39 @@
 #include "wifi_manager.h"
 #include "hardware_manager.h"
 #include "server_manager.h"
+#include "command_auth.h"
+#include "phone_credentials.h"
+#include "card_auth.h"
+#include "access_rules.h"
+#include "runtime_params.h"
+#include "ota_manager.h"
+#include "mesh_manager.h"
+#include "gateway_manager.h"
+#include "bus_manager.h"
+#include "scratch_arena.h"
+#include "trace_recorder.h"
+#include "heap_monitor.h"
+#include "watchdog.h"
+#include "virtual_clock.h"
 
 // Global objects
 Preferences preferences;
+RuntimeParams runtimeParams(&preferences);
+OtaManager otaManager(&preferences);
 WiFiManager *wifiManager = nullptr;
 HardwareManager *hardwareManager = nullptr;
 ServerManager *serverManager = nullptr;
+CommandAuthenticator *commandAuth = nullptr;
+PhoneCredentials *phoneCredentials = nullptr;
+CardAuthenticator *cardAuth = nullptr;
+AccessRules *accessRules = nullptr;
+MeshManager *meshManager = nullptr;
+GatewayManager *gatewayManager = nullptr;
+BusManager *busManager = nullptr;
 
 // Timing variables
 unsigned long lastStatusCheck = 0;
+bool wifiOutage = false;
 
 void setup()
 {
@@ -24,15 +48,30 @@ void setup()
 
   // Initialize preferences
   preferences.begin("nexlock", false);
+  runtimeParams.load();
+  otaManager.initialize();
 
   // Initialize managers in order
   initializeManagers();
+  registerRecovery();
+
+  // Setup may block on WiFi; the loop is watched from here on
+  watchdog.begin(&runtimeParams);
 
   Serial.println(F("System initialization complete"));
 }
 
 void loop()
 {
+  // Nothing allocated from the arena outlives an iteration
+  scratchArena.reset();
+  traceRecorder.setEnabled(runtimeParams.get(PARAM_TRACE) != 0);
+
+  // Roll back an unconfirmed update even while offline
+  otaManager.loop();
+  heapMonitor.loop(clockMillis(), runtimeParams.get(PARAM_HEAP_TREND_WINDOW));
+  watchdog.loop();
+
   // Handle factory reset request (highest priority)
   if (hardwareManager && hardwareManager->checkConfigButton())
   {
@@ -48,7 +87,7 @@ void loop()
   }
 
   // Check WiFi connection status
-  if (wifiManager && !wifiManager->isConnected())
+  if (wifiManager && (!wifiManager->isConnected() || wifiOutage))
   {
     handleWiFiDisconnection();
     return;
@@ -57,13 +96,13 @@ void loop()
   // Main application loop
   runMainLoop();
 
-  delay(100); // Small delay to prevent excessive CPU usage
+  clockDelay(runtimeParams.get(PARAM_LOOP_DELAY)); // Small delay to prevent excessive CPU usage
 }
 
 void initializeManagers()
 {
   // Initialize hardware manager first
-  hardwareManager = new HardwareManager(&preferences);
+  hardwareManager = new HardwareManager(&preferences, &runtimeParams);
   if (!hardwareManager)
   {
     Serial.println(F("ERROR: Failed to create HardwareManager"));
@@ -74,6 +113,37 @@ void initializeManagers()
   Serial.print(F("Hardware: "));
   Serial.println(hardwareReady ? F("SUCCESS") : F("PENDING"));
 
+  // Remote locker boards on the RS-485 bus, if any are assigned
+  busManager = new BusManager(&preferences);
+  Serial.print(F("Bus: "));
+  Serial.println(busManager->initialize() ? F("RS-485") : F("NONE"));
+
+  // Load command signing key
+  commandAuth = new CommandAuthenticator(&preferences);
+  commandAuth->loadKey();
+  Serial.print(F("Command auth: "));
+  Serial.println(commandAuth->isProvisioned() ? F("HMAC-SHA256") : F("NONE"));
+
+  // Load the site key phone credentials are derived from
+  phoneCredentials = new PhoneCredentials(&preferences);
+  phoneCredentials->loadKey();
+  hardwareManager->setPhoneCredentials(phoneCredentials);
+  Serial.print(F("Phone credentials: "));
+  Serial.println(phoneCredentials->isProvisioned() ? F("HCE") : F("NONE"));
+
+  // Load the master key secure cards' keys are diversified from
+  cardAuth = new CardAuthenticator(&preferences);
+  cardAuth->loadKey();
+  hardwareManager->setCardAuthenticator(cardAuth);
+  Serial.print(F("Secure cards: "));
+  Serial.println(cardAuth->isProvisioned() ? F("DESFire AES") : F("NONE"));
+
+  // Load compiled access rules so taps are decided locally, even offline
+  accessRules = new AccessRules(&preferences);
+  accessRules->load();
+  Serial.print(F("Access rules: "));
+  Serial.println(accessRules->hasRules() ? F("LOADED") : F("NONE"));
+
   // Initialize WiFi manager
   wifiManager = new WiFiManager(&preferences);
   if (!wifiManager)
@@ -86,10 +156,28 @@ void initializeManagers()
   Serial.print(F("WiFi: "));
   Serial.println(wifiReady ? F("SUCCESS") : F("PROVISIONING"));
 
-  // Initialize server manager if WiFi is ready
-  if (wifiReady)
+  // The mesh needs the station interface up, which a provisioned module always has
+  if (wifiManager->getProvisioningStatus())
+  {
+    meshManager = new MeshManager(&preferences);
+    Serial.print(F("Mesh: "));
+    bool meshReady = meshManager->initialize();
+    Serial.println(meshReady ? F("ESP-NOW") : F("DISABLED"));
+
+    // Cabinet role: standalone, gateway for secondaries, or secondary
+    gatewayManager = new GatewayManager(&preferences, &runtimeParams, meshReady ? meshManager : nullptr);
+    gatewayManager->load();
+    Serial.print(F("Role: "));
+    Serial.println(GatewayManager::roleName(gatewayManager->getRole()));
+  }
+
+  // Initialize server manager once provisioned; a module that boots without
+  // WiFi keeps retrying and relays through the mesh meanwhile
+  if (wifiManager->getProvisioningStatus())
   {
-    serverManager = new ServerManager(hardwareManager, wifiManager->getMacAddress());
+    serverManager = new ServerManager(hardwareManager, commandAuth, phoneCredentials, cardAuth, accessRules,
+                                      &runtimeParams, &otaManager, meshManager, gatewayManager, busManager,
+                                      wifiManager->getMacAddress().c_str());
     if (serverManager)
     {
       bool serverReady = serverManager->initialize(wifiManager->getServerIP(), wifiManager->getServerPort());
@@ -99,14 +187,43 @@ void initializeManagers()
   }
 }
 
+// What the watchdog does when a subsystem keeps missing its budget
+void registerRecovery()
+{
+  watchdog.onRecover(WD_NETWORK, []()
+                     { return !serverManager || serverManager->dropConnection(); });
+
+  if (!hardwareManager)
+    return;
+
+  watchdog.onRecover(WD_NFC, []()
+                     { return hardwareManager->restartNFC(); });
+  watchdog.onRecover(WD_DISPLAY, []()
+                     { return hardwareManager->restartLCD(); });
+  watchdog.onRecover(WD_ACTUATION, []()
+                     { return hardwareManager->restartServos(); });
+}
+
 void runMainLoop()
 {
+  // Relay neighbors' frames while we hold a server connection
+  if (meshManager)
+  {
+    meshManager->loop(serverManager && serverManager->getConnectionStatus(), true);
+  }
+
   // Handle server communication
   if (serverManager)
   {
+    WatchdogSection section(WD_NETWORK);
     serverManager->loop();
   }
 
+  if (busManager)
+  {
+    busManager->loop();
+  }
+
   // Handle manual operations (for testing/maintenance)
   handleManualOperations();
 }
@@ -116,25 +233,70 @@ void handleManualOperations()
   if (!hardwareManager)
     return;
 
-  // NFC scanning for informational purposes only
-  String nfcCode;
+  hardwareManager->serviceLCD(clockMillis());
+
+  FixedString<NFC_CODE_SIZE> nfcCode;
   if (hardwareManager->scanNFC(nfcCode))
   {
-    if (hardwareManager->getConfigurationStatus())
+    char tap[8];
+    snprintf(tap, sizeof(tap), "r%d", hardwareManager->getLastReader()); // The UID stays out of the log
+    traceRecorder.record("tap", tap);
+    if (hardwareManager->getConfigurationStatus() && accessRules && accessRules->hasRules())
+    {
+      handleAccessTap(nfcCode.c_str());
+    }
+    else if (hardwareManager->getConfigurationStatus())
     {
+      // Without pushed rules the tap is informational only
       hardwareManager->updateLCD(F("NFC Detected"), F("Check app"));
-      delay(1500);
-      hardwareManager->updateSystemStatus();
+      hardwareManager->holdLCD(runtimeParams.get(PARAM_LCD_HOLD_TIME));
     }
     else
     {
       hardwareManager->updateLCD(F("Not Configured"), F("Contact admin"));
-      delay(1500);
-      hardwareManager->updateSystemStatus();
+      hardwareManager->holdLCD(runtimeParams.get(PARAM_LCD_HOLD_TIME));
     }
   }
 }
 
+void handleAccessTap(const char *nfcCode)
+{
+  int lockerIndex;
+  AccessRules::Decision decision = accessRules->check(hardwareManager->getLastUid(), hardwareManager->getLastUidLength(),
+                                                      hardwareManager->getLastCredential(), lockerIndex);
+
+  // With several readers, a credential only opens lockers its reader serves
+  if (decision == AccessRules::ACCESS_GRANTED &&
+      !hardwareManager->readerServesLocker(hardwareManager->getLastReader(), lockerIndex))
+    decision = AccessRules::ACCESS_WRONG_READER;
+
+  const char *lockerId = lockerIndex >= 0 ? hardwareManager->getLockers()[lockerIndex].lockerId.c_str() : "";
+
+  Serial.print(F("Access "));
+  Serial.print(AccessRules::decisionName(decision));
+  Serial.print(F(" for locker: "));
+  Serial.println(lockerId);
+
+  if (decision == AccessRules::ACCESS_GRANTED)
+  {
+    hardwareManager->unlockLocker(lockerId);
+  }
+  else
+  {
+    hardwareManager->updateLCD(F("Access Denied"), AccessRules::decisionName(decision));
+    hardwareManager->holdLCD(runtimeParams.get(PARAM_LCD_HOLD_TIME));
+  }
+
+  if (serverManager)
+  {
+    serverManager->sendAccessEvent(lockerId, nfcCode, AccessRules::decisionName(decision),
+                                   hardwareManager->getLastReader(),
+                                   HardwareManager::credentialName(hardwareManager->getLastCredential()));
+    if (decision == AccessRules::ACCESS_GRANTED)
+      serverManager->sendStatusUpdate(lockerId, "unlocked");
+  }
+}
+
 void sendLockerStatusUpdates(unsigned long currentTime)
 {
   if (!hardwareManager || !serverManager || !hardwareManager->getConfigurationStatus())
@@ -145,7 +307,7 @@ void sendLockerStatusUpdates(unsigned long currentTime)
 
   for (int i = 0; i < numLockers; i++)
   {
-    if (currentTime - lockers[i].lastStatusUpdate > STATUS_CHECK_INTERVAL)
+    if (currentTime - lockers[i].lastStatusUpdate > runtimeParams.get(PARAM_STATUS_CHECK_INTERVAL))
     {
       lockers[i].lastStatusUpdate = currentTime;
     }
@@ -154,25 +316,47 @@ void sendLockerStatusUpdates(unsigned long currentTime)
 
 void handleWiFiDisconnection()
 {
-  if (hardwareManager)
+  if (!wifiOutage)
   {
-    hardwareManager->updateLCD(F("WiFi Lost"), F("Reconnecting..."));
+    wifiOutage = true;
+    Serial.println(F("WiFi disconnected, reconnecting..."));
+    if (hardwareManager)
+    {
+      hardwareManager->updateLCD(F("WiFi Lost"), F("Reconnecting..."));
+    }
   }
 
-  Serial.println(F("WiFi disconnected, reconnecting..."));
-
-  if (wifiManager && wifiManager->connectToWiFi())
+  if (wifiManager->serviceReconnect(runtimeParams.get(PARAM_WIFI_RETRY_DELAY)))
   {
-    Serial.println(F("WiFi reconnected"));
+    wifiOutage = false;
     if (hardwareManager)
     {
       hardwareManager->updateLCD(F("WiFi Connected"), F("System Ready"));
     }
+    return;
   }
-  else
+
+  // Taps are still decided locally; events go out through mesh neighbors.
+  // The radio only holds the mesh channel between reconnect attempts.
+  if (meshManager)
+  {
+    meshManager->loop(false, !wifiManager->isReconnecting());
+  }
+
+  if (serverManager)
+  {
+    WatchdogSection section(WD_NETWORK);
+    serverManager->loop();
+  }
+
+  if (busManager)
   {
-    delay(3000); // Reduced delay
+    busManager->loop();
   }
+
+  handleManualOperations();
+
+  clockDelay(runtimeParams.get(PARAM_LOOP_DELAY));
 }
 
 void performFactoryReset()
@@ -213,5 +397,47 @@ void cleanup()
     wifiManager = nullptr;
   }
 
+  if (commandAuth)
+  {
+    delete commandAuth;
+    commandAuth = nullptr;
+  }
+
+  if (phoneCredentials)
+  {
+    delete phoneCredentials;
+    phoneCredentials = nullptr;
+  }
+
+  if (cardAuth)
+  {
+    delete cardAuth;
+    cardAuth = nullptr;
+  }
+
+  if (accessRules)
+  {
+    delete accessRules;
+    accessRules = nullptr;
+  }
+
+  if (busManager)
+  {
+    delete busManager;
+    busManager = nullptr;
+  }
+
+  if (gatewayManager)
+  {
+    delete gatewayManager;
+    gatewayManager = nullptr;
+  }
+
+  if (meshManager)
+  {
+    delete meshManager;
+    meshManager = nullptr;
+  }
+
   preferences.end();
 }
\ No newline at end of file
@@ -0,0 +1,707 @@
+#include "ota_manager.h"
+#include "virtual_clock.h"
+#include <HTTPClient.h>
+
+// Arduino marks every image valid at startup unless this returns true;
+// we only confirm once the new firmware has registered with the server.
+extern "C" bool verifyRollbackLater()
+{
+  return true;
+}
+
+static bool parseSha256Hex(const char *hex, uint8_t *out)
+{
+  if (!hex || strlen(hex) != 64)
+    return false;
+
+  for (int i = 0; i < 32; i++)
+  {
+    uint8_t value = 0;
+    for (int j = 0; j < 2; j++)
+    {
+      char c = hex[i * 2 + j];
+      value <<= 4;
+      if (c >= '0' && c <= '9')
+        value |= c - '0';
+      else if (c >= 'a' && c <= 'f')
+        value |= c - 'a' + 10;
+      else if (c >= 'A' && c <= 'F')
+        value |= c - 'A' + 10;
+      else
+        return false;
+    }
+    out[i] = value;
+  }
+  return true;
+}
+
+OtaManager::OtaManager(Preferences *prefs)
+    : preferences(prefs), target(nullptr), state(OTA_IDLE), lastError(nullptr),
+      erasedUpTo(0), lastAckOffset(0), lastCheckpoint(0),
+      transferStart(0), sessionBytes(0), minFreeHeap(0),
+      pendingConfirm(false), confirmDeadline(0),
+      peerServer(nullptr), serveSize(0), peerFailures(0), peerBytes(0),
+      peerStream(nullptr), peerRemaining(0), peerLastData(0),
+      peerOpen(PEER_OPEN_IDLE), peerOpenStale(false), peerOpenFrom(0), peerOpenTo(0), peerOpenLength(-1),
+      serveOffset(0), serveRemaining(0),
+      serveCheckSize(0), serveCheckOffset(0), serveChecking(false)
+{
+  memset(&progress, 0, sizeof(OtaProgress));
+  mbedtls_sha256_init(&shaCtx);
+  mbedtls_sha256_init(&serveShaCtx);
+}
+
+OtaManager::~OtaManager()
+{
+  closePeerSpan();
+  stopServing();
+  mbedtls_sha256_free(&shaCtx);
+  mbedtls_sha256_free(&serveShaCtx);
+}
+
+void OtaManager::initialize()
+{
+  if (preferences->getBytesLength("otaProgress") != sizeof(OtaProgress) ||
+      preferences->getBytes("otaProgress", &progress, sizeof(OtaProgress)) != sizeof(OtaProgress))
+  {
+    memset(&progress, 0, sizeof(OtaProgress));
+  }
+
+  // First boots of a new image: count attempts so a crash loop rolls back
+  // without waiting for the confirmation deadline.
+  if (preferences->isKey("otaPrev"))
+  {
+    pendingConfirm = true;
+    uint8_t boots = preferences->getUChar("otaBoots", 0) + 1;
+    preferences->putUChar("otaBoots", boots);
+
+    Serial.print(F("OTA: unconfirmed image, boot "));
+    Serial.println(boots);
+
+    if (boots > OTA_MAX_BOOT_ATTEMPTS)
+    {
+      rollback();
+    }
+    confirmDeadline = clockMillis() + OTA_CONFIRM_TIMEOUT;
+  }
+}
+
+void OtaManager::loop()
+{
+  if (pendingConfirm && (long)(clockMillis() - confirmDeadline) >= 0)
+  {
+    rollback();
+  }
+
+  // A range opened for a transfer that has since ended
+  if (peerOpen == PEER_OPEN_DONE && peerOpenStale)
+  {
+    peerHttp.end();
+    peerOpenStale = false;
+    peerOpen = PEER_OPEN_IDLE;
+  }
+
+  if (peerServer)
+  {
+    peerServer->handleClient();
+    pushServeRange();
+  }
+}
+
+bool OtaManager::begin(uint32_t size, const char *sha256Hex, const char *version, const char *source)
+{
+  // A source URL means pull from a peer on the LAN instead of waiting for chunks
+  closePeerSpan();
+  peerSource = source ? source : "";
+  peerFailures = 0;
+  peerBytes = 0;
+
+  uint8_t sha256[32];
+  if (!parseSha256Hex(sha256Hex, sha256))
+  {
+    fail("bad_sha256");
+    return false;
+  }
+
+  target = esp_ota_get_next_update_partition(nullptr);
+  if (!target)
+  {
+    fail("no_ota_partition");
+    return false;
+  }
+
+  if (size == 0 || size > target->size)
+  {
+    fail("bad_size");
+    return false;
+  }
+
+  bool sameImage = progress.size == size && memcmp(progress.sha256, sha256, 32) == 0 &&
+                   strncmp(progress.partition, target->label, sizeof(progress.partition)) == 0;
+
+  transferStart = clockMillis();
+  sessionBytes = 0;
+  minFreeHeap = ESP.getFreeHeap();
+  lastError = nullptr;
+
+  if (sameImage && state == OTA_RECEIVING)
+  {
+    // Reconnected mid-transfer; hash context is still live
+    lastAckOffset = progress.written;
+    return true;
+  }
+
+  if (sameImage && progress.written > 0 && progress.written <= size && restoreHash())
+  {
+    Serial.print(F("OTA: resuming at "));
+    Serial.println(progress.written);
+  }
+  else
+  {
+    memset(&progress, 0, sizeof(OtaProgress));
+    memcpy(progress.sha256, sha256, 32);
+    progress.size = size;
+    strncpy(progress.version, version ? version : "", sizeof(progress.version) - 1);
+    strncpy(progress.partition, target->label, sizeof(progress.partition) - 1);
+
+    mbedtls_sha256_starts(&shaCtx, 0);
+    erasedUpTo = 0;
+    saveProgress();
+  }
+
+  lastAckOffset = progress.written;
+  lastCheckpoint = progress.written;
+  state = OTA_RECEIVING;
+
+  Serial.print(F("OTA: receiving "));
+  Serial.print(size);
+  Serial.print(F(" bytes into "));
+  Serial.println(target->label);
+  return true;
+}
+
+bool OtaManager::restoreHash()
+{
+  // Re-hash what is already in flash instead of persisting the SHA state
+  uint8_t buffer[1024];
+  mbedtls_sha256_starts(&shaCtx, 0);
+
+  for (uint32_t offset = 0; offset < progress.written; offset += sizeof(buffer))
+  {
+    size_t length = min<uint32_t>(sizeof(buffer), progress.written - offset);
+    if (esp_partition_read(target, offset, buffer, length) != ESP_OK)
+      return false;
+    mbedtls_sha256_update(&shaCtx, buffer, length);
+  }
+
+  erasedUpTo = (progress.written + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+  return true;
+}
+
+OtaManager::ChunkResult OtaManager::writeChunk(const uint8_t *data, size_t length)
+{
+  if (state != OTA_RECEIVING)
+    return CHUNK_IGNORED;
+
+  if (length <= OTA_CHUNK_HEADER_SIZE)
+    return CHUNK_OUT_OF_ORDER;
+
+  uint32_t offset = (uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+                    ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+  data += OTA_CHUNK_HEADER_SIZE;
+  length -= OTA_CHUNK_HEADER_SIZE;
+
+  // Duplicates and gaps are dropped; the ack tells the server where to resume
+  if (offset != progress.written)
+    return CHUNK_OUT_OF_ORDER;
+
+  return appendData(data, length);
+}
+
+OtaManager::ChunkResult OtaManager::appendData(const uint8_t *data, size_t length)
+{
+  if (progress.written + length > progress.size)
+    return fail("overrun");
+
+  // Erase lazily, one sector ahead of the write position
+  while (erasedUpTo < progress.written + length)
+  {
+    if (esp_partition_erase_range(target, erasedUpTo, SPI_FLASH_SEC_SIZE) != ESP_OK)
+      return fail("erase_failed");
+    erasedUpTo += SPI_FLASH_SEC_SIZE;
+  }
+
+  if (esp_partition_write(target, progress.written, data, length) != ESP_OK)
+    return fail("write_failed");
+
+  mbedtls_sha256_update(&shaCtx, data, length);
+  progress.written += length;
+  sessionBytes += length;
+
+  uint32_t freeHeap = ESP.getFreeHeap();
+  if (freeHeap < minFreeHeap)
+    minFreeHeap = freeHeap;
+
+  if (progress.written == progress.size)
+    return finish();
+
+  if (progress.written - lastCheckpoint >= OTA_CHECKPOINT_BYTES)
+  {
+    saveProgress();
+    lastCheckpoint = progress.written;
+  }
+
+  if (progress.written - lastAckOffset >= OTA_ACK_BYTES)
+  {
+    lastAckOffset = progress.written;
+    return CHUNK_ACK_DUE;
+  }
+  return CHUNK_OK;
+}
+
+OtaManager::ChunkResult OtaManager::pollPeer()
+{
+  if (!isPullingFromPeer())
+    return CHUNK_IGNORED;
+
+  // Pull within a time budget so the rest of the loop keeps running; a range
+  // that is not done when the budget runs out continues on the next call
+  ChunkResult result = CHUNK_OK;
+  unsigned long start = clockMillis();
+  while (state == OTA_RECEIVING && clockMillis() - start < OTA_PEER_POLL_BUDGET)
+  {
+    ChunkResult span = pullPeerSpan(start);
+    if (span == CHUNK_COMPLETE || span == CHUNK_FAILED)
+      return span;
+    if (span == CHUNK_PEER_RETRY)
+      break;
+    if (span == CHUNK_ACK_DUE)
+      result = CHUNK_ACK_DUE;
+    if (!peerStream || peerStream->available() == 0)
+      break; // Waiting on the peer
+  }
+  return result;
+}
+
+OtaManager::ChunkResult OtaManager::pullPeerSpan(unsigned long start)
+{
+  if (!peerStream)
+  {
+    ChunkResult opened = openPeerSpan();
+    if (!peerStream)
+      return opened;
+  }
+
+  // Only what has already arrived is read, so a slow peer costs no waiting
+  uint8_t buffer[1024];
+  ChunkResult result = CHUNK_OK;
+  while (peerRemaining > 0 && clockMillis() - start < OTA_PEER_POLL_BUDGET)
+  {
+    size_t available = peerStream->available();
+    if (available == 0)
+    {
+      if (!peerStream->connected() || clockMillis() - peerLastData >= OTA_PEER_TIMEOUT)
+      {
+        closePeerSpan();
+        return peerError(); // Next poll resumes from the bytes that did arrive
+      }
+      return result;
+    }
+
+    int received = peerStream->read(buffer, min<size_t>(sizeof(buffer), min<size_t>(available, peerRemaining)));
+    if (received <= 0)
+      return result;
+    peerLastData = clockMillis();
+
+    ChunkResult appended = appendData(buffer, received);
+    if (appended == CHUNK_COMPLETE || appended == CHUNK_FAILED)
+    {
+      closePeerSpan();
+      return appended;
+    }
+    if (appended == CHUNK_ACK_DUE)
+      result = CHUNK_ACK_DUE;
+
+    peerRemaining -= received;
+    peerBytes += received;
+  }
+
+  if (peerRemaining == 0)
+  {
+    closePeerSpan();
+    peerFailures = 0;
+  }
+  return result;
+}
+
+// Connecting and waiting for the response headers would hold the loop for up
+// to the connect and read timeouts, so that part runs on its own task and the
+// loop checks back on each poll
+OtaManager::ChunkResult OtaManager::openPeerSpan()
+{
+  if (peerOpen == PEER_OPEN_RUNNING || peerOpenStale)
+    return CHUNK_OK;
+
+  if (peerOpen == PEER_OPEN_IDLE)
+  {
+    peerOpenUrl = peerSource;
+    peerOpenFrom = progress.written;
+    peerOpenTo = min<uint32_t>(progress.size, peerOpenFrom + OTA_PEER_SPAN) - 1;
+    peerOpenLength = -1;
+    peerOpen = PEER_OPEN_RUNNING;
+    if (xTaskCreate(peerOpenEntry, "ota_peer_open", OTA_PEER_OPEN_STACK, this, 1, nullptr) == pdPASS)
+      return CHUNK_OK;
+    peerOpen = PEER_OPEN_IDLE;
+    return peerError();
+  }
+
+  peerOpen = PEER_OPEN_IDLE;
+  int length = peerOpenLength;
+  if (length <= 0 || (uint32_t)length > peerOpenTo - peerOpenFrom + 1)
+  {
+    peerHttp.end();
+    return peerError();
+  }
+
+  peerStream = peerHttp.getStreamPtr();
+  peerRemaining = length;
+  peerLastData = clockMillis();
+  return CHUNK_OK;
+}
+
+void OtaManager::peerOpenEntry(void *arg)
+{
+  OtaManager *self = (OtaManager *)arg;
+  HTTPClient &http = self->peerHttp;
+
+  http.setConnectTimeout(OTA_PEER_CONNECT_TIMEOUT);
+  http.setTimeout(OTA_PEER_TIMEOUT);
+  http.begin(self->peerOpenUrl);
+  http.addHeader("Range", "bytes=" + String(self->peerOpenFrom) + "-" + String(self->peerOpenTo));
+
+  self->peerOpenLength = http.GET() == HTTP_CODE_PARTIAL_CONTENT ? http.getSize() : -1;
+  self->peerOpen = PEER_OPEN_DONE;
+  vTaskDelete(nullptr);
+}
+
+void OtaManager::closePeerSpan()
+{
+  if (peerOpen == PEER_OPEN_RUNNING)
+  {
+    peerOpenStale = true; // The open task still owns peerHttp; loop() ends it once done
+  }
+  else if (peerStream || peerOpen == PEER_OPEN_DONE)
+  {
+    peerHttp.end();
+    peerOpen = PEER_OPEN_IDLE;
+  }
+  peerStream = nullptr;
+  peerRemaining = 0;
+}
+
+OtaManager::ChunkResult OtaManager::peerError()
+{
+  if (++peerFailures >= OTA_PEER_MAX_FAILURES)
+    return fail("peer_unreachable");
+  return CHUNK_PEER_RETRY;
+}
+
+bool OtaManager::startServing(uint32_t size, const char *sha256Hex)
+{
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  if (!parseSha256Hex(sha256Hex, serveExpected) || !running || size == 0 || size > running->size)
+  {
+    lastError = "bad_image";
+    return false;
+  }
+
+  // Only seed an image we are actually running. Hashing all of it at once
+  // would hold the loop for seconds, so pollServeCheck does it in slices.
+  mbedtls_sha256_starts(&serveShaCtx, 0);
+  serveCheckSize = size;
+  serveCheckOffset = 0;
+  serveChecking = true;
+  return true;
+}
+
+OtaManager::ServeCheck OtaManager::pollServeCheck()
+{
+  if (!serveChecking)
+    return SERVE_IDLE;
+
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  uint32_t sliceEnd = min<uint32_t>(serveCheckSize, serveCheckOffset + OTA_SERVE_HASH_SLICE);
+  uint8_t buffer[1024];
+  while (serveCheckOffset < sliceEnd)
+  {
+    size_t length = min<uint32_t>(sizeof(buffer), sliceEnd - serveCheckOffset);
+    if (esp_partition_read(running, serveCheckOffset, buffer, length) != ESP_OK)
+    {
+      serveChecking = false;
+      lastError = "read_failed";
+      return SERVE_REJECTED;
+    }
+    mbedtls_sha256_update(&serveShaCtx, buffer, length);
+    serveCheckOffset += length;
+  }
+
+  if (serveCheckOffset < serveCheckSize)
+    return SERVE_CHECKING;
+
+  serveChecking = false;
+  uint8_t digest[32];
+  mbedtls_sha256_finish(&serveShaCtx, digest);
+  if (memcmp(digest, serveExpected, 32) != 0)
+  {
+    lastError = "not_running_image";
+    return SERVE_REJECTED;
+  }
+
+  beginServing(serveCheckSize);
+  return SERVE_STARTED;
+}
+
+void OtaManager::beginServing(uint32_t size)
+{
+  stopServing();
+  serveSize = size;
+  peerServer = new WebServer(OTA_PEER_PORT);
+
+  static const char *headerKeys[] = {"Range"};
+  peerServer->collectHeaders(headerKeys, 1);
+  peerServer->on("/ota/image", HTTP_GET, [this]()
+                 { handleImageRequest(); });
+  peerServer->begin();
+
+  Serial.print(F("OTA: serving image at "));
+  Serial.println(getServeUrl());
+}
+
+void OtaManager::stopServing()
+{
+  serveChecking = false;
+  serveClient.stop();
+  serveRemaining = 0;
+  if (peerServer)
+  {
+    peerServer->stop();
+    delete peerServer;
+    peerServer = nullptr;
+  }
+  serveSize = 0;
+}
+
+String OtaManager::getServeUrl() const
+{
+  return "http://" + WiFi.localIP().toString() + ":" + String(OTA_PEER_PORT) + "/ota/image";
+}
+
+// Accepts the three single-range forms: "first-last", "first-" and the
+// suffix "-length". Anything else, including multiple ranges, is refused.
+bool OtaManager::parseRange(const char *spec, uint32_t size, uint32_t &from, uint32_t &to)
+{
+  char *end;
+  if (spec[0] == '-')
+  {
+    if (!isdigit((unsigned char)spec[1]))
+      return false;
+    unsigned long suffix = strtoul(spec + 1, &end, 10);
+    if (*end != '\0' || suffix == 0)
+      return false;
+
+    from = suffix >= size ? 0 : size - suffix;
+    to = size - 1;
+    return true;
+  }
+
+  if (!isdigit((unsigned char)spec[0]))
+    return false;
+  unsigned long first = strtoul(spec, &end, 10);
+  if (*end != '-')
+    return false;
+
+  unsigned long last = size - 1;
+  spec = end + 1;
+  if (*spec != '\0')
+  {
+    if (!isdigit((unsigned char)*spec))
+      return false;
+    last = strtoul(spec, &end, 10);
+    if (*end != '\0')
+      return false;
+  }
+
+  if (first >= size || last < first)
+    return false;
+
+  from = first;
+  to = min<unsigned long>(last, size - 1);
+  return true;
+}
+
+void OtaManager::handleImageRequest()
+{
+  uint32_t from = 0;
+  uint32_t to = serveSize - 1;
+
+  String range = peerServer->header("Range");
+  if (range.length() > 0 && (!range.startsWith("bytes=") || !parseRange(range.c_str() + 6, serveSize, from, to)))
+  {
+    peerServer->sendHeader("Content-Range", "bytes */" + String(serveSize));
+    peerServer->send(416);
+    return;
+  }
+
+  // Cap each response so one peer cannot hold the seed for a whole image
+  to = min<uint32_t>(to, from + OTA_PEER_SPAN - 1);
+
+  peerServer->sendHeader("Content-Range", "bytes " + String(from) + "-" + String(to) + "/" + String(serveSize));
+  peerServer->setContentLength(to - from + 1);
+  peerServer->send(206, "application/octet-stream", "");
+
+  // The body follows from loop(), within the poll budget each time.
+  // A newer request replaces a range still in flight.
+  serveClient = peerServer->client();
+  serveOffset = from;
+  serveRemaining = to - from + 1;
+}
+
+void OtaManager::pushServeRange()
+{
+  if (serveRemaining == 0)
+    return;
+
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  uint8_t buffer[1024];
+  unsigned long start = clockMillis();
+  while (serveRemaining > 0 && clockMillis() - start < OTA_PEER_POLL_BUDGET)
+  {
+    size_t length = min<uint32_t>(sizeof(buffer), serveRemaining);
+    size_t written = 0;
+    if (serveClient.connected() && esp_partition_read(running, serveOffset, buffer, length) == ESP_OK)
+      written = serveClient.write(buffer, length);
+
+    if (written == 0)
+    {
+      serveClient.stop(); // The peer resumes from what it got
+      serveRemaining = 0;
+      return;
+    }
+    serveOffset += written;
+    serveRemaining -= written;
+  }
+
+  if (serveRemaining == 0)
+    serveClient = WiFiClient(); // Closed once the server lets go of it too
+}
+
+OtaManager::ChunkResult OtaManager::finish()
+{
+  uint8_t digest[32];
+  mbedtls_sha256_finish(&shaCtx, digest);
+
+  if (memcmp(digest, progress.sha256, 32) != 0)
+    return fail("sha_mismatch");
+
+  // Also validates the image header and checksum
+  esp_err_t err = esp_ota_set_boot_partition(target);
+  if (err != ESP_OK)
+    return fail("invalid_image");
+
+  preferences->putString("otaPrev", esp_ota_get_running_partition()->label);
+  preferences->putUChar("otaBoots", 0);
+
+  Serial.print(F("OTA: image verified, "));
+  Serial.print(getBytesPerSecond());
+  Serial.print(F(" B/s, min free heap "));
+  Serial.println(minFreeHeap);
+
+  clearProgress();
+  state = OTA_APPLIED;
+  return CHUNK_COMPLETE;
+}
+
+OtaManager::ChunkResult OtaManager::fail(const char *error)
+{
+  Serial.print(F("OTA failed: "));
+  Serial.println(error);
+
+  lastError = error;
+  state = OTA_FAILED;
+  closePeerSpan();
+  clearProgress();
+  return CHUNK_FAILED;
+}
+
+void OtaManager::abort()
+{
+  if (state == OTA_RECEIVING)
+  {
+    Serial.println(F("OTA aborted"));
+  }
+  closePeerSpan();
+  state = OTA_IDLE;
+  clearProgress();
+}
+
+void OtaManager::saveProgress()
+{
+  preferences->putBytes("otaProgress", &progress, sizeof(OtaProgress));
+}
+
+void OtaManager::clearProgress()
+{
+  uint32_t size = progress.size;
+  uint32_t written = progress.written;
+  memset(&progress, 0, sizeof(OtaProgress));
+
+  // Keep the counters readable for the final status report
+  progress.size = size;
+  progress.written = written;
+  preferences->remove("otaProgress");
+}
+
+void OtaManager::confirmBoot()
+{
+  if (!pendingConfirm)
+    return;
+
+  esp_ota_mark_app_valid_cancel_rollback();
+  preferences->remove("otaPrev");
+  preferences->remove("otaBoots");
+  pendingConfirm = false;
+
+  Serial.println(F("OTA: new image confirmed"));
+}
+
+void OtaManager::rollback()
+{
+  Serial.println(F("OTA: image not confirmed, rolling back"));
+
+  char previous[17] = {0};
+  preferences->getString("otaPrev", previous, sizeof(previous));
+  preferences->remove("otaPrev");
+  preferences->remove("otaBoots");
+
+  // Prefer the bootloader's rollback when the build enables it
+  esp_ota_img_states_t imageState;
+  if (esp_ota_get_state_partition(esp_ota_get_running_partition(), &imageState) == ESP_OK &&
+      imageState == ESP_OTA_IMG_PENDING_VERIFY)
+  {
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+  }
+
+  const esp_partition_t *partition =
+      esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, previous);
+  if (partition)
+  {
+    esp_ota_set_boot_partition(partition);
+  }
+  ESP.restart();
+}
+
+uint32_t OtaManager::getBytesPerSecond() const
+{
+  unsigned long elapsed = clockMillis() - transferStart;
+  return elapsed > 0 ? (uint32_t)((uint64_t)sessionBytes * 1000 / elapsed) : 0;
+}
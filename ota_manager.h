@@ -0,0 +1,167 @@
+#ifndef OTA_MANAGER_H
+#define OTA_MANAGER_H
+
+#include <Preferences.h>
+#include <WebServer.h>
+#include <HTTPClient.h>
+#include <esp_ota_ops.h>
+#include <mbedtls/sha256.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "config.h"
+
+// Persisted at checkpoints so a transfer resumes after disconnects and reboots
+struct OtaProgress
+{
+  uint8_t sha256[32];
+  uint32_t size;
+  uint32_t written;
+  char version[16];
+  char partition[17];
+};
+
+// Streams an image straight into the inactive OTA partition as chunks arrive,
+// hashing on the fly. Nothing larger than one chunk is ever buffered.
+//
+// On a LAN, one module that already runs the new image can serve it to its
+// peers over HTTP range requests, so the image crosses the WAN once per site.
+// The server decides who seeds and who pulls from where.
+class OtaManager
+{
+public:
+  enum State
+  {
+    OTA_IDLE,
+    OTA_RECEIVING,
+    OTA_APPLIED,
+    OTA_FAILED
+  };
+
+  enum ChunkResult
+  {
+    CHUNK_OK,
+    CHUNK_ACK_DUE,
+    CHUNK_OUT_OF_ORDER,
+    CHUNK_COMPLETE,
+    CHUNK_FAILED,
+    CHUNK_IGNORED,
+    CHUNK_PEER_RETRY
+  };
+
+  // Opening a range blocks on connect and headers, so it runs on its own task
+  enum PeerOpen
+  {
+    PEER_OPEN_IDLE,
+    PEER_OPEN_RUNNING,
+    PEER_OPEN_DONE
+  };
+
+  enum ServeCheck
+  {
+    SERVE_IDLE,     // No check pending
+    SERVE_CHECKING, // Still hashing the running image
+    SERVE_STARTED,
+    SERVE_REJECTED
+  };
+
+private:
+  Preferences *preferences;
+  const esp_partition_t *target;
+  mbedtls_sha256_context shaCtx;
+  OtaProgress progress;
+  State state;
+  const char *lastError;
+
+  uint32_t erasedUpTo;
+  uint32_t lastAckOffset;
+  uint32_t lastCheckpoint;
+
+  // Transfer metrics
+  unsigned long transferStart;
+  uint32_t sessionBytes;
+  uint32_t minFreeHeap;
+
+  // Rollback guard for a freshly booted image
+  bool pendingConfirm;
+  unsigned long confirmDeadline;
+
+  // Peer distribution
+  WebServer *peerServer;
+  uint32_t serveSize;
+  String peerSource;
+  uint8_t peerFailures;
+  uint32_t peerBytes;
+
+  // Range being pulled; kept open across loop iterations
+  HTTPClient peerHttp;
+  WiFiClient *peerStream;
+  uint32_t peerRemaining;
+  unsigned long peerLastData;
+  volatile PeerOpen peerOpen; // Written by the open task, read by loop()
+  bool peerOpenStale;         // The transfer ended while the open was running
+  String peerOpenUrl;
+  uint32_t peerOpenFrom;
+  uint32_t peerOpenTo;
+  volatile int peerOpenLength; // Range length the peer answered with, or -1
+
+  // Range being served, written a piece per loop iteration
+  WiFiClient serveClient;
+  uint32_t serveOffset;
+  uint32_t serveRemaining;
+
+  // Running-image check before seeding, hashed a slice per loop iteration
+  mbedtls_sha256_context serveShaCtx;
+  uint8_t serveExpected[32];
+  uint32_t serveCheckSize;
+  uint32_t serveCheckOffset;
+  bool serveChecking;
+
+  bool restoreHash();
+  void saveProgress();
+  void clearProgress();
+  ChunkResult appendData(const uint8_t *data, size_t length);
+  ChunkResult pullPeerSpan(unsigned long start);
+  ChunkResult openPeerSpan();
+  static void peerOpenEntry(void *arg);
+  ChunkResult peerError();
+  void closePeerSpan();
+  void beginServing(uint32_t size);
+  void handleImageRequest();
+  void pushServeRange();
+  static bool parseRange(const char *spec, uint32_t size, uint32_t &from, uint32_t &to);
+  ChunkResult fail(const char *error);
+  ChunkResult finish();
+  void rollback();
+
+public:
+  OtaManager(Preferences *prefs);
+  ~OtaManager();
+
+  void initialize();
+  void loop();
+
+  bool begin(uint32_t size, const char *sha256Hex, const char *version, const char *source = nullptr);
+  ChunkResult writeChunk(const uint8_t *data, size_t length);
+  ChunkResult pollPeer();
+
+  bool startServing(uint32_t size, const char *sha256Hex);
+  ServeCheck pollServeCheck();
+  void stopServing();
+  String getServeUrl() const;
+  void abort();
+  void confirmBoot();
+
+  // Getters
+  State getState() const { return state; }
+  const char *getLastError() const { return lastError; }
+  uint32_t getOffset() const { return progress.written; }
+  uint32_t getSize() const { return progress.size; }
+  uint32_t getBytesPerSecond() const;
+  uint32_t getMinFreeHeap() const { return minFreeHeap; }
+  bool isPendingConfirm() const { return pendingConfirm; }
+  bool isServing() const { return peerServer != nullptr; }
+  bool isPullingFromPeer() const { return state == OTA_RECEIVING && peerSource.length() > 0; }
+  uint32_t getPeerBytes() const { return peerBytes; }
+};
+
+#endif
@@ -0,0 +1,67 @@
+#include "perf_counters.h"
+
+PerfCounters perfCounters;
+
+static const char *const SITE_NAMES[PERF_SITE_COUNT] = {"encode",     "nfcUid",     "lockerLookup",  "lcd",
+                                                        "configLoad", "configSave", "phoneExchange", "cardAuth"};
+
+PerfCounters::PerfCounters()
+{
+  reset();
+}
+
+void PerfCounters::reset()
+{
+  memset(sites, 0, sizeof(sites));
+  memset(dispatch, 0, sizeof(dispatch));
+  for (int i = 0; i < PERF_SITE_COUNT; i++)
+    sites[i].name = SITE_NAMES[i];
+  for (size_t i = 0; i < PROTOCOL_INBOUND_TYPE_COUNT; i++)
+    dispatch[i].name = PROTOCOL_INBOUND_TYPES[i];
+  dispatch[PROTOCOL_INBOUND_TYPE_COUNT].name = "other";
+}
+
+// Slots are fixed by the schema, so unknown types cannot use them up
+PerfStats *PerfCounters::forMessage(const char *type)
+{
+  for (size_t i = 0; i < PROTOCOL_INBOUND_TYPE_COUNT; i++)
+  {
+    if (strcmp(PROTOCOL_INBOUND_TYPES[i], type) == 0)
+      return &dispatch[i];
+  }
+  return &dispatch[PROTOCOL_INBOUND_TYPE_COUNT];
+}
+
+static void statsToJson(const PerfStats &stats, JsonArray out)
+{
+  if (stats.calls == 0)
+    return;
+
+  JsonObject entry = out.createNestedObject();
+  entry["name"] = stats.name;
+  entry["calls"] = stats.calls;
+  entry["totalUs"] = stats.totalMicros;
+  entry["maxUs"] = stats.maxMicros;
+  entry["heapBytes"] = stats.heapBytes;
+}
+
+void PerfCounters::toJson(JsonArray siteStats, JsonArray dispatchStats) const
+{
+  for (int i = 0; i < PERF_SITE_COUNT; i++)
+    statsToJson(sites[i], siteStats);
+  for (size_t i = 0; i <= PROTOCOL_INBOUND_TYPE_COUNT; i++)
+    statsToJson(dispatch[i], dispatchStats);
+}
+
+PerfProbe::~PerfProbe()
+{
+  uint32_t elapsed = micros() - start;
+  uint32_t heapNow = ESP.getFreeHeap();
+
+  stats->calls++;
+  stats->totalMicros += elapsed;
+  if (elapsed > stats->maxMicros)
+    stats->maxMicros = elapsed;
+  if (heapNow < freeHeap && freeHeap - heapNow > stats->heapBytes)
+    stats->heapBytes = freeHeap - heapNow;
+}
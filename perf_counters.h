@@ -0,0 +1,67 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "config.h"
+#include "protocol_messages.h"
+
+// Instrumented hot paths, reported in this order
+enum PerfSite
+{
+  PERF_ENCODE,        // Serializing an outbound document
+  PERF_NFC_UID,       // Formatting a card UID
+  PERF_LOCKER_LOOKUP, // Finding a locker by id
+  PERF_LCD,           // Redrawing both LCD lines
+  PERF_CONFIG_LOAD,   // Reading the locker set from NVS
+  PERF_CONFIG_SAVE,   // Writing the locker set to NVS
+  PERF_PHONE,         // SELECT and challenge APDUs with a phone
+  PERF_CARD_AUTH,     // DESFire application select and AES authentication
+  PERF_SITE_COUNT
+};
+
+struct PerfStats
+{
+  const char *name;
+  uint32_t calls;
+  uint32_t totalMicros;
+  uint32_t maxMicros;
+  uint32_t heapBytes; // Largest drop in free heap across one call
+};
+
+// Call counts, time and heap growth per hot path, so a change to one of them
+// can be measured on the device it runs on. Loop task only.
+class PerfCounters
+{
+private:
+  PerfStats sites[PERF_SITE_COUNT];
+  PerfStats dispatch[PROTOCOL_INBOUND_TYPE_COUNT + 1]; // One per inbound type, then "other"
+
+public:
+  PerfCounters();
+
+  PerfStats *forSite(PerfSite site) { return &sites[site]; }
+  PerfStats *forMessage(const char *type);
+  void reset();
+  void toJson(JsonArray siteStats, JsonArray dispatchStats) const;
+};
+
+extern PerfCounters perfCounters;
+
+// Charges the enclosing block to one entry. The heap figure is the net drop
+// in free memory, so allocations freed before the block ends do not count,
+// and other tasks allocating meanwhile can inflate it.
+class PerfProbe
+{
+private:
+  PerfStats *stats;
+  unsigned long start;
+  uint32_t freeHeap;
+
+public:
+  explicit PerfProbe(PerfStats *target) : stats(target), start(micros()), freeHeap(ESP.getFreeHeap()) {}
+  explicit PerfProbe(PerfSite site) : PerfProbe(perfCounters.forSite(site)) {}
+  ~PerfProbe();
+};
+
+#endif
@@ -0,0 +1,154 @@
+#include "phone_credentials.h"
+#include "command_auth.h"
+#include <mbedtls/md.h>
+
+// Proprietary AID (category F): "NXLK", protocol version 1
+static const uint8_t NEXLOCK_AID[] = {0xF0, 0x4E, 0x58, 0x4C, 0x4B, 0x01};
+
+#define PHONE_INS_CHALLENGE 0x10
+
+PhoneCredentials::PhoneCredentials(Preferences *prefs)
+    : preferences(prefs), hasKey(false), verifiedCount(0), rejectedCount(0), overBudget(0),
+      lastExchangeMs(0), maxExchangeMs(0)
+{
+  memset(siteKey, 0, sizeof(siteKey));
+  memset(challenge, 0, sizeof(challenge));
+}
+
+PhoneCredentials::~PhoneCredentials()
+{
+  memset(siteKey, 0, sizeof(siteKey));
+}
+
+void PhoneCredentials::loadKey()
+{
+  hasKey = preferences->getBytesLength("phoneKey") == PHONE_KEY_SIZE &&
+           preferences->getBytes("phoneKey", siteKey, PHONE_KEY_SIZE) == PHONE_KEY_SIZE;
+}
+
+bool PhoneCredentials::saveKey(const char *hexKey)
+{
+  uint8_t key[PHONE_KEY_SIZE];
+  if (!hexKey || strlen(hexKey) != PHONE_KEY_SIZE * 2 || !CommandAuthenticator::parseHex(hexKey, key, PHONE_KEY_SIZE))
+  {
+    Serial.println(F("Phone key rejected: expected 64 hex chars"));
+    return false;
+  }
+
+  preferences->putBytes("phoneKey", key, PHONE_KEY_SIZE);
+  memcpy(siteKey, key, PHONE_KEY_SIZE);
+  memset(key, 0, sizeof(key));
+  hasKey = true;
+  return true;
+}
+
+// SELECT by name: 00 A4 04 00 Lc AID Le
+uint8_t PhoneCredentials::buildSelect(uint8_t *apdu)
+{
+  uint8_t length = 0;
+  apdu[length++] = 0x00;
+  apdu[length++] = 0xA4;
+  apdu[length++] = 0x04;
+  apdu[length++] = 0x00;
+  apdu[length++] = sizeof(NEXLOCK_AID);
+  memcpy(apdu + length, NEXLOCK_AID, sizeof(NEXLOCK_AID));
+  length += sizeof(NEXLOCK_AID);
+  apdu[length++] = 0x00;
+  return length;
+}
+
+// 80 10 00 00 Lc challenge Le, with a fresh challenge from the hardware RNG
+uint8_t PhoneCredentials::buildChallenge(uint8_t *apdu)
+{
+  for (size_t i = 0; i < PHONE_CHALLENGE_SIZE; i += 4)
+  {
+    uint32_t random = esp_random();
+    memcpy(challenge + i, &random, min<size_t>(4, PHONE_CHALLENGE_SIZE - i));
+  }
+
+  uint8_t length = 0;
+  apdu[length++] = 0x80;
+  apdu[length++] = PHONE_INS_CHALLENGE;
+  apdu[length++] = 0x00;
+  apdu[length++] = 0x00;
+  apdu[length++] = PHONE_CHALLENGE_SIZE;
+  memcpy(apdu + length, challenge, PHONE_CHALLENGE_SIZE);
+  length += PHONE_CHALLENGE_SIZE;
+  apdu[length++] = 0x00;
+  return length;
+}
+
+bool PhoneCredentials::isSelected(const uint8_t *response, int length)
+{
+  return length >= 2 && response[length - 2] == 0x90 && response[length - 1] == 0x00;
+}
+
+// Expected answer: credentialId (MAX_UID_LENGTH) || MAC (PHONE_MAC_SIZE) || 90 00
+PhoneCredentials::Result PhoneCredentials::verify(const uint8_t *response, int length, uint8_t *credentialId) const
+{
+  if (length != PHONE_RESPONSE_SIZE || !isSelected(response, length))
+    return PHONE_BAD_RESPONSE;
+
+  const mbedtls_md_info_t *sha256 = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+  uint8_t credentialKey[32];
+  uint8_t expected[32];
+  mbedtls_md_hmac(sha256, siteKey, PHONE_KEY_SIZE, response, MAX_UID_LENGTH, credentialKey);
+  mbedtls_md_hmac(sha256, credentialKey, sizeof(credentialKey), challenge, PHONE_CHALLENGE_SIZE, expected);
+  memset(credentialKey, 0, sizeof(credentialKey));
+
+  // Constant-time compare of the truncated MAC
+  const uint8_t *mac = response + MAX_UID_LENGTH;
+  uint8_t diff = 0;
+  for (size_t i = 0; i < PHONE_MAC_SIZE; i++)
+  {
+    diff |= expected[i] ^ mac[i];
+  }
+  if (diff != 0)
+    return PHONE_BAD_MAC;
+
+  memcpy(credentialId, response, MAX_UID_LENGTH);
+  return PHONE_OK;
+}
+
+void PhoneCredentials::recordExchange(Result result, unsigned long elapsedMs)
+{
+  if (result == PHONE_NO_APP)
+    return; // A card, or a phone without the app
+
+  if (result == PHONE_OK)
+    verifiedCount++;
+  else
+    rejectedCount++;
+
+  lastExchangeMs = elapsedMs;
+  if (elapsedMs > maxExchangeMs)
+    maxExchangeMs = elapsedMs;
+  if (elapsedMs > PHONE_TAP_BUDGET_MS)
+    overBudget++;
+}
+
+void PhoneCredentials::toJson(JsonObject out) const
+{
+  out["provisioned"] = hasKey;
+  out["verified"] = verifiedCount;
+  out["rejected"] = rejectedCount;
+  out["lastMs"] = lastExchangeMs;
+  out["maxMs"] = maxExchangeMs;
+  out["overBudget"] = overBudget;
+}
+
+const char *PhoneCredentials::resultName(Result result)
+{
+  switch (result)
+  {
+  case PHONE_OK:
+    return "ok";
+  case PHONE_NO_APP:
+    return "no_app";
+  case PHONE_BAD_RESPONSE:
+    return "bad_response";
+  case PHONE_BAD_MAC:
+    return "bad_mac";
+  }
+  return "unknown";
+}
@@ -0,0 +1,60 @@
+#ifndef PHONE_CREDENTIALS_H
+#define PHONE_CREDENTIALS_H
+
+#include <Preferences.h>
+#include <ArduinoJson.h>
+#include "config.h"
+
+// Phone credentials over host card emulation. Once the PN532 has activated
+// a phone as an ISO-DEP target, the module selects the NexLock AID and sends
+// one challenge APDU. The app answers with its credential id and
+// HMAC-SHA256(credentialKey, challenge), where credentialKey is
+// HMAC-SHA256(siteKey, credentialId). The module derives the same key, so
+// each phone holds only its own. The phone's randomized UID is ignored, and
+// the credential id takes its place in access rules.
+class PhoneCredentials
+{
+public:
+  enum Result
+  {
+    PHONE_OK,
+    PHONE_NO_APP,       // SELECT refused or unanswered; treated as a plain card
+    PHONE_BAD_RESPONSE, // Wrong length or status word
+    PHONE_BAD_MAC
+  };
+
+private:
+  Preferences *preferences;
+  uint8_t siteKey[PHONE_KEY_SIZE];
+  bool hasKey;
+  uint8_t challenge[PHONE_CHALLENGE_SIZE];
+
+  // Exchange counters for telemetry
+  uint32_t verifiedCount;
+  uint32_t rejectedCount;
+  uint32_t overBudget;
+  unsigned long lastExchangeMs;
+  unsigned long maxExchangeMs;
+
+public:
+  PhoneCredentials(Preferences *prefs);
+  ~PhoneCredentials();
+
+  void loadKey();
+  bool saveKey(const char *hexKey);
+  bool isProvisioned() const { return hasKey; }
+
+  // Both APDUs are built before the first exchange, so the challenge goes out
+  // as soon as the SELECT is answered. Each returns the APDU length.
+  static uint8_t buildSelect(uint8_t *apdu);
+  uint8_t buildChallenge(uint8_t *apdu);
+
+  static bool isSelected(const uint8_t *response, int length);
+  Result verify(const uint8_t *response, int length, uint8_t *credentialId) const;
+  void recordExchange(Result result, unsigned long elapsedMs);
+
+  void toJson(JsonObject out) const;
+  static const char *resultName(Result result);
+};
+
+#endif
@@ -0,0 +1,594 @@
+// Generated by tools/gen_protocol.py from tools/protocol.json; do not edit.
+// Change the schema and run: python3 tools/gen_protocol.py
+#ifndef PROTOCOL_MESSAGES_H
+#define PROTOCOL_MESSAGES_H
+
+#include <ArduinoJson.h>
+
+// Top-level fields of every server-to-module message; the parser skips
+// everything else instead of spending document slots on it
+static const char *const PROTOCOL_INBOUND_KEYS[] = {
+    "type", "deflate", "bulkPath", "lockerId", "nonce", "sig", "moduleId", "lockerIds",
+    "configVersion", "authKey", "phoneKey", "cardKey", "version", "tzOffset", "rules",
+    "credentials", "baseVersion", "ops", "params", "size", "sha256", "source", "to", "payload",
+    "ch", "role", "gateway", "doors", "reset"};
+
+// Every server-to-module message type, in schema order
+static const char *const PROTOCOL_INBOUND_TYPES[] = {
+    "connected", "registered", "pong", "lock", "unlock", "module_configured", "access_rules",
+    "config_patch", "set_params", "ota_begin", "ota_serve", "ota_serve_stop", "ota_abort", "relay",
+    "mux", "set_role", "bus_configure", "perf_query"};
+static constexpr size_t PROTOCOL_INBOUND_TYPE_COUNT = sizeof(PROTOCOL_INBOUND_TYPES) / sizeof(const char *);
+
+// Module to server. Encoders are filled in field by field; their empty
+// constructors rule out positional brace initialization, which a schema
+// change would silently shift.
+
+// Sent on every connect once configured
+struct RegisterMessage
+{
+  static constexpr const char *TYPE = "register";
+  const char *moduleId = nullptr;
+  const char *auth = nullptr; // "hmac-sha256" or "none"
+  uint32_t configVersion = 0;
+  uint32_t deflate = 0;       // Longest back-reference; offers compressed frames
+  bool bulk = false;          // Can open a transfer socket
+  const char *role = nullptr; // standalone | gateway | secondary; omitted when nullptr
+
+  RegisterMessage() {}
+
+  void toJson(JsonDocument &doc) const
+  {
+    doc["type"] = TYPE;
+    doc["moduleId"] = moduleId;
+    doc["auth"] = auth;
+    doc["configVersion"] = configVersion;
+    doc["deflate"] = deflate;
+    doc["bulk"] = bulk;
+    if (role)
+      doc["role"] = role;
+  }
+};
+
+// Repeated until the module is configured
+struct ModuleAvailableMessage
+{
+  static constexpr const char *TYPE = "module_available";
+  const char *macAddress = nullptr;
+  const char *deviceInfo = nullptr;
+  const char *version = nullptr;
+  uint32_t capabilities = 0; // Servo-driven locker slots
+  uint32_t timestamp = 0;
+
+  ModuleAvailableMessage() {}
+
+  void toJson(JsonDocument &doc) const
+  {
+    doc["type"] = TYPE;
+    doc["macAddress"] = macAddress;
+    doc["deviceInfo"] = deviceInfo;
+    doc["version"] = version;
+    doc["capabilities"] = capabilities;
+    doc["timestamp"] = timestamp;
+  }
+};
+
+// Heartbeat
+struct PingMessage
+{
+  static constexpr const char *TYPE = "ping";
+  const char *moduleId = nullptr;
+  // Filled in by the caller after toJson: channels
+
+  PingMessage() {}
+
+  void toJson(JsonDocument &doc) const
+  {
+    doc["type"] = TYPE;
+    doc["moduleId"] = moduleId;
+  }
+};
+
+struct StatusUpdateMessage
+{
+  static constexpr const char *TYPE = "status_update";
+  const char *moduleId = nullptr;
+  const char *lockerId = nullptr;
+  const char *status = nullptr; // locked | unlocked | offline
+  uint32_t timestamp = 0;
+
+  StatusUpdateMessage() {}
+
+  void toJson(JsonDocument &doc) const
+  {
+    doc["type"] = TYPE;
+    doc["moduleId"] = moduleId;
+    doc["lockerId"] = lockerId;
+    doc["status"] = status;
+    doc["timestamp"] = timestamp;
+  }
+};
+
+// Every tap decided against local rules
+struct AccessEventMessage
+{
+  static constexpr const char *TYPE = "access_event";
+  const char *moduleId = nullptr;
+  const char *lockerId = nullptr;
+  const char *nfcCode = nullptr;
+  const char *decision = nullptr;
+  uint32_t timestamp = 0;
+  int32_t reader = 0;               // Index of the reader the card was tapped on
+  const char *credential = nullptr; // uid, phone when nfcCode is a verified phone credential id, or desfire when the card passed AES authentication
+
+  AccessEventMessage() {}
+
+  void toJson(JsonDocument &doc) const
+  {
+    doc["type"] = TYPE;
+    doc["moduleId"] = moduleId;
+    doc["lockerId"] = lockerId;
+    doc["nfcCode"] = nfcCode;
+    doc["decision"] = decision;
+    doc["timestamp"] = timestamp;
+    doc["reader"] = reader;
+    doc["credential"] = credential;
+  }
+};
+
+struct CommandRejectedMessage
+{
+  static constexpr const char *TYPE = "command_rejected";
+  const char *moduleId = nullptr;
+  const char *lockerId = nullptr; // For lock/unlock; omitted when nullptr
+  const char *reason = nullptr;
+  const char *command = nullptr;  // Rejected signed frame's type; omitted when nullptr
+
+  CommandRejectedMessage() {}
+
+  void toJson(JsonDocument &doc) const
+  {
+    doc["type"] = TYPE;
+    doc["moduleId"] = moduleId;
+    if (lockerId)
+      doc["lockerId"] = lockerId;
+    doc["reason"] = reason;
+    if (command)
+      doc["command"] = command;
+  }
+};
+
+struct ConfigAckMessage
+{
+  static constexpr const char *TYPE = "config_ack";
+  const char *moduleId = nullptr;
+  bool success = false;
+  uint32_t version = 0;
+  const char *error = nullptr; // omitted when nullptr
+
+  ConfigAckMessage() {}
+
+  void toJson(JsonDocument &doc) const
+  {
+    doc["type"] = TYPE;
+    doc["moduleId"] = moduleId;
+    doc["success"] = success;
+    doc["version"] = version;
+    if (error)
+      doc["error"] = error;
+  }
+};
+
+struct AccessRulesAppliedMessage
+{
+  static constexpr const char *TYPE = "access_rules_applied";
+  const char *moduleId = nullptr;
+  bool success = false;
+  uint32_t version = 0;
+  uint32_t credentials = 0;
+
+  AccessRulesAppliedMessage() {}
+
+  void toJson(JsonDocument &doc) const
+  {
+    doc["type"] = TYPE;
+    doc["moduleId"] = moduleId;
+    doc["success"] = success;
+    doc["version"] = version;
+    doc["credentials"] = credentials;
+  }
+};
+
+struct BusConfiguredMessage
+{
+  static constexpr const char *TYPE = "bus_configured";
+  const char *moduleId = nullptr;
+  bool success = false;
+  uint32_t version = 0; // Applied door map; absent without a bus; omitted unless hasVersion
+  uint32_t doors = 0;   // omitted unless hasDoors
+  bool hasVersion = false;
+  bool hasDoors = false;
+
+  BusConfiguredMessage() {}
+
+  void toJson(JsonDocument &doc) const
+  {
+    doc["type"] = TYPE;
+    doc["moduleId"] = moduleId;
+    doc["success"] = success;
+    if (hasVersion)
+      doc["version"] = version;
+    if (hasDoors)
+      doc["doors"] = doors;
+  }
+};
+
+struct OtaStatusMessage
+{
+  static constexpr const char *TYPE = "ota_status";
+  const char *moduleId = nullptr;
+  const char *state = nullptr; // idle | receiving | applied | failed
+  uint32_t offset = 0;
+  uint32_t size = 0;
+  uint32_t window = 0;
+  uint32_t bytesPerSec = 0;
+  uint32_t minFreeHeap = 0;
+  uint32_t peerBytes = 0;
+  const char *error = nullptr; // omitted when nullptr
+
+  OtaStatusMessage() {}
+
+  void toJson(JsonDocument &doc) const
+  {
+    doc["type"] = TYPE;
+    doc["moduleId"] = moduleId;
+    doc["state"] = state;
+    doc["offset"] = offset;
+    doc["size"] = size;
+    doc["window"] = window;
+    doc["bytesPerSec"] = bytesPerSec;
+    doc["minFreeHeap"] = minFreeHeap;
+    doc["peerBytes"] = peerBytes;
+    if (error)
+      doc["error"] = error;
+  }
+};
+
+struct OtaServingMessage
+{
+  static constexpr const char *TYPE = "ota_serving";
+  const char *moduleId = nullptr;
+  bool success = false;
+  const char *url = nullptr;   // omitted when nullptr
+  const char *error = nullptr; // omitted when nullptr
+
+  OtaServingMessage() {}
+
+  void toJson(JsonDocument &doc) const
+  {
+    doc["type"] = TYPE;
+    doc["moduleId"] = moduleId;
+    doc["success"] = success;
+    if (url)
+      doc["url"] = url;
+    if (error)
+      doc["error"] = error;
+  }
+};
+
+// Periodic and after set_params
+struct TelemetryMessage
+{
+  static constexpr const char *TYPE = "telemetry";
+  const char *moduleId = nullptr;
+  const char *firmware = nullptr;
+  uint32_t uptime = 0;
+  uint32_t freeHeap = 0;
+  uint32_t minFreeHeap = 0;
+  uint32_t maxAllocHeap = 0;
+  uint32_t configVersion = 0;
+  uint32_t rulesVersion = 0;
+  // Filled in by the caller after toJson: auth, params, mesh, bus, deflate, rx, scratch, nfc, phone, card, heap, watchdog, sendQueue, bulk, gateway
+
+  TelemetryMessage() {}
+
+  void toJson(JsonDocument &doc) const
+  {
+    doc["type"] = TYPE;
+    doc["moduleId"] = moduleId;
+    doc["firmware"] = firmware;
+    doc["uptime"] = uptime;
+    doc["freeHeap"] = freeHeap;
+    doc["minFreeHeap"] = minFreeHeap;
+    doc["maxAllocHeap"] = maxAllocHeap;
+    doc["configVersion"] = configVersion;
+    doc["rulesVersion"] = rulesVersion;
+  }
+};
+
+// A mesh neighbor's frame, forwarded
+struct RelayUpMessage
+{
+  static constexpr const char *TYPE = "relay";
+  const char *from = nullptr;
+  const char *via = nullptr;
+  uint32_t hops = 0;
+  const char *payload = nullptr; // Serialized JSON, embedded as is
+
+  RelayUpMessage() {}
+
+  void toJson(JsonDocument &doc) const
+  {
+    doc["type"] = TYPE;
+    doc["from"] = from;
+    doc["via"] = via;
+    doc["hops"] = hops;
+    doc["payload"] = serialized(payload);
+  }
+};
+
+// A secondary's frame, forwarded by its gateway
+struct MuxUpMessage
+{
+  static constexpr const char *TYPE = "mux";
+  uint32_t ch = 0;
+  const char *payload = nullptr; // Serialized JSON, embedded as is
+
+  MuxUpMessage() {}
+
+  void toJson(JsonDocument &doc) const
+  {
+    doc["type"] = TYPE;
+    doc["ch"] = ch;
+    doc["payload"] = serialized(payload);
+  }
+};
+
+struct MuxAttachMessage
+{
+  static constexpr const char *TYPE = "mux_attach";
+  const char *moduleId = nullptr;
+  uint32_t ch = 0;
+  const char *mac = nullptr;
+
+  MuxAttachMessage() {}
+
+  void toJson(JsonDocument &doc) const
+  {
+    doc["type"] = TYPE;
+    doc["moduleId"] = moduleId;
+    doc["ch"] = ch;
+    doc["mac"] = mac;
+  }
+};
+
+// First frame on the bulk socket
+struct BulkAttachMessage
+{
+  static constexpr const char *TYPE = "bulk_attach";
+  const char *moduleId = nullptr;
+
+  BulkAttachMessage() {}
+
+  void toJson(JsonDocument &doc) const
+  {
+    doc["type"] = TYPE;
+    doc["moduleId"] = moduleId;
+  }
+};
+
+// Reply to perf_query
+struct PerfReportMessage
+{
+  static constexpr const char *TYPE = "perf_report";
+  const char *moduleId = nullptr;
+  uint32_t uptime = 0;
+  // Filled in by the caller after toJson: sites, dispatch
+
+  PerfReportMessage() {}
+
+  void toJson(JsonDocument &doc) const
+  {
+    doc["type"] = TYPE;
+    doc["moduleId"] = moduleId;
+    doc["uptime"] = uptime;
+  }
+};
+
+// Server to module. Decoders hold views into the parsed document and are
+// valid for as long as it is.
+
+struct ConnectedMessage
+{
+  static constexpr const char *TYPE = "connected";
+};
+
+struct RegisteredMessage
+{
+  static constexpr const char *TYPE = "registered";
+  bool deflate;
+  const char *bulkPath; // nullptr when absent
+
+  explicit RegisteredMessage(const JsonDocument &doc)
+      : deflate(doc["deflate"] | false), bulkPath(doc["bulkPath"].as<const char *>())
+  {
+  }
+};
+
+struct PongMessage
+{
+  static constexpr const char *TYPE = "pong";
+};
+
+struct LockCommandMessage
+{
+  static constexpr const char *LOCK = "lock";
+  static constexpr const char *UNLOCK = "unlock";
+  const char *type;
+  const char *lockerId;
+  uint32_t nonce;
+  const char *sig; // Hex HMAC-SHA256, required once keyed; nullptr when absent
+
+  explicit LockCommandMessage(const JsonDocument &doc)
+      : type(doc["type"] | ""), lockerId(doc["lockerId"] | ""), nonce(doc["nonce"] | 0UL),
+        sig(doc["sig"].as<const char *>())
+  {
+  }
+};
+
+struct ModuleConfiguredMessage
+{
+  static constexpr const char *TYPE = "module_configured";
+  const char *moduleId;
+  JsonArrayConst lockerIds;
+  uint32_t configVersion;
+  const char *authKey;  // nullptr when absent
+  const char *phoneKey; // Site key for phone credentials, 64 hex chars; nullptr when absent
+  const char *cardKey;  // Master key for secure cards, 32 hex chars; nullptr when absent
+
+  explicit ModuleConfiguredMessage(const JsonDocument &doc)
+      : moduleId(doc["moduleId"] | ""), lockerIds(doc["lockerIds"].as<JsonArrayConst>()),
+        configVersion(doc["configVersion"] | 0UL), authKey(doc["authKey"].as<const char *>()),
+        phoneKey(doc["phoneKey"].as<const char *>()), cardKey(doc["cardKey"].as<const char *>())
+  {
+  }
+};
+
+struct AccessRulesMessage
+{
+  static constexpr const char *TYPE = "access_rules";
+  uint32_t version;
+  int32_t tzOffset;
+  JsonArrayConst rules;
+  JsonArrayConst credentials;
+
+  explicit AccessRulesMessage(const JsonDocument &doc)
+      : version(doc["version"] | 0UL), tzOffset(doc["tzOffset"] | 0),
+        rules(doc["rules"].as<JsonArrayConst>()), credentials(doc["credentials"].as<JsonArrayConst>())
+  {
+  }
+};
+
+struct ConfigPatchMessage
+{
+  static constexpr const char *TYPE = "config_patch";
+  uint32_t baseVersion;
+  uint32_t version;
+  JsonArrayConst ops;
+
+  explicit ConfigPatchMessage(const JsonDocument &doc)
+      : baseVersion(doc["baseVersion"] | 0UL), version(doc["version"] | 0UL),
+        ops(doc["ops"].as<JsonArrayConst>())
+  {
+  }
+};
+
+struct SetParamsMessage
+{
+  static constexpr const char *TYPE = "set_params";
+  JsonObjectConst params;
+
+  explicit SetParamsMessage(const JsonDocument &doc)
+      : params(doc["params"].as<JsonObjectConst>())
+  {
+  }
+};
+
+struct OtaBeginMessage
+{
+  static constexpr const char *TYPE = "ota_begin";
+  uint32_t size;
+  const char *sha256;
+  const char *version;
+  const char *source; // nullptr when absent
+
+  explicit OtaBeginMessage(const JsonDocument &doc)
+      : size(doc["size"] | 0UL), sha256(doc["sha256"] | ""), version(doc["version"] | ""),
+        source(doc["source"].as<const char *>())
+  {
+  }
+};
+
+struct OtaServeMessage
+{
+  static constexpr const char *TYPE = "ota_serve";
+  uint32_t size;
+  const char *sha256;
+
+  explicit OtaServeMessage(const JsonDocument &doc)
+      : size(doc["size"] | 0UL), sha256(doc["sha256"] | "")
+  {
+  }
+};
+
+struct OtaServeStopMessage
+{
+  static constexpr const char *TYPE = "ota_serve_stop";
+};
+
+struct OtaAbortMessage
+{
+  static constexpr const char *TYPE = "ota_abort";
+};
+
+struct RelayDownMessage
+{
+  static constexpr const char *TYPE = "relay";
+  const char *to;
+  JsonVariantConst payload;
+
+  explicit RelayDownMessage(const JsonDocument &doc)
+      : to(doc["to"] | ""), payload(doc["payload"])
+  {
+  }
+};
+
+struct MuxDownMessage
+{
+  static constexpr const char *TYPE = "mux";
+  uint32_t ch;
+  JsonVariantConst payload;
+
+  explicit MuxDownMessage(const JsonDocument &doc)
+      : ch(doc["ch"] | 0UL), payload(doc["payload"])
+  {
+  }
+};
+
+struct SetRoleMessage
+{
+  static constexpr const char *TYPE = "set_role";
+  const char *role;
+  const char *gateway; // nullptr when absent
+
+  explicit SetRoleMessage(const JsonDocument &doc)
+      : role(doc["role"] | ""), gateway(doc["gateway"].as<const char *>())
+  {
+  }
+};
+
+struct BusConfigureMessage
+{
+  static constexpr const char *TYPE = "bus_configure";
+  uint32_t version;
+  JsonArrayConst doors;
+
+  explicit BusConfigureMessage(const JsonDocument &doc)
+      : version(doc["version"] | 0UL), doors(doc["doors"].as<JsonArrayConst>())
+  {
+  }
+};
+
+// Asks for a perf_report
+struct PerfQueryMessage
+{
+  static constexpr const char *TYPE = "perf_query";
+  bool reset; // Zero the counters after reporting; needs a signed frame
+
+  explicit PerfQueryMessage(const JsonDocument &doc)
+      : reset(doc["reset"] | false)
+  {
+  }
+};
+
+#endif
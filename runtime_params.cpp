@@ -0,0 +1,95 @@
+#include "runtime_params.h"
+
+const ParamSpec RuntimeParams::specs[PARAM_COUNT] = {
+    {"pingInterval", "pPing", PING_INTERVAL, 5000, 600000},
+    {"statusCheckInterval", "pStatus", STATUS_CHECK_INTERVAL, 500, 600000},
+    {"availableBroadcastInterval", "pAvail", AVAILABLE_BROADCAST_INTERVAL, 1000, 600000},
+    {"nfcTimeout", "pNfcTimeout", NFC_TIMEOUT, 0, 60000},
+    {"nfcPollTimeout", "pNfcPoll", NFC_POLL_TIMEOUT, 10, 1000},
+    {"nfcFastInterval", "pNfcFast", NFC_FAST_INTERVAL, 0, 5000},
+    {"nfcIdleInterval", "pNfcIdle", NFC_IDLE_INTERVAL, 0, 10000},
+    {"nfcActiveWindow", "pNfcActive", NFC_ACTIVE_WINDOW, 0, 600000},
+    {"lcdHoldTime", "pLcdHold", LCD_HOLD_TIME, 0, 10000},
+    {"lcdErrorHoldTime", "pLcdErrHold", LCD_ERROR_HOLD_TIME, 0, 10000},
+    {"reconnectInterval", "pReconnect", RECONNECT_INTERVAL, 1000, 300000},
+    {"wifiRetryDelay", "pWifiRetry", WIFI_RETRY_DELAY, 0, 60000},
+    {"loopDelay", "pLoopDelay", LOOP_DELAY, 0, 1000},
+    {"telemetryInterval", "pTelemetry", TELEMETRY_INTERVAL, 10000, 3600000},
+    {"trace", "pTrace", TRACE_ENABLED, 0, 1},
+    {"secureCards", "pSecure", SECURE_CARDS_ONLY, 0, 1},
+    {"heapTrendWindow", "pHeapWindow", HEAP_TREND_WINDOW, 30000, 21600000},
+    {"sloNetworkMs", "pSloNet", SLO_NETWORK_MS, 100, WATCHDOG_TIMEOUT},
+    {"sloNfcMs", "pSloNfc", SLO_NFC_MS, 50, WATCHDOG_TIMEOUT},
+    {"sloActuationMs", "pSloAct", SLO_ACTUATION_MS, 5, WATCHDOG_TIMEOUT},
+    {"sloDisplayMs", "pSloDisp", SLO_DISPLAY_MS, 10, WATCHDOG_TIMEOUT},
+};
+
+RuntimeParams::RuntimeParams(Preferences *prefs) : preferences(prefs)
+{
+  for (int i = 0; i < PARAM_COUNT; i++)
+  {
+    values[i] = specs[i].defaultValue;
+  }
+}
+
+void RuntimeParams::load()
+{
+  for (int i = 0; i < PARAM_COUNT; i++)
+  {
+    uint32_t stored = preferences->getUInt(specs[i].nvsKey, specs[i].defaultValue);
+    values[i] = isValid((ParamId)i, stored) ? stored : specs[i].defaultValue;
+  }
+}
+
+int RuntimeParams::find(const char *name)
+{
+  if (!name)
+    return -1;
+
+  for (int i = 0; i < PARAM_COUNT; i++)
+  {
+    if (strcmp(specs[i].name, name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+bool RuntimeParams::isValid(ParamId id, uint32_t value)
+{
+  return value >= specs[id].minValue && value <= specs[id].maxValue;
+}
+
+bool RuntimeParams::set(ParamId id, uint32_t value)
+{
+  if (!isValid(id, value))
+    return false;
+
+  if (values[id] != value)
+  {
+    values[id] = value;
+
+    // Only overrides are stored, so changing a default in config.h still
+    // reaches modules that were never tuned
+    if (value == specs[id].defaultValue)
+      preferences->remove(specs[id].nvsKey);
+    else
+      preferences->putUInt(specs[id].nvsKey, value);
+  }
+  return true;
+}
+
+void RuntimeParams::resetToDefaults()
+{
+  for (int i = 0; i < PARAM_COUNT; i++)
+  {
+    set((ParamId)i, specs[i].defaultValue);
+  }
+}
+
+void RuntimeParams::toJson(JsonObject out) const
+{
+  for (int i = 0; i < PARAM_COUNT; i++)
+  {
+    out[specs[i].name] = values[i];
+  }
+}
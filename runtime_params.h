@@ -0,0 +1,68 @@
+#ifndef RUNTIME_PARAMS_H
+#define RUNTIME_PARAMS_H
+
+#include <Preferences.h>
+#include <ArduinoJson.h>
+#include "config.h"
+
+enum ParamId
+{
+  PARAM_PING_INTERVAL,
+  PARAM_STATUS_CHECK_INTERVAL,
+  PARAM_AVAILABLE_BROADCAST_INTERVAL,
+  PARAM_NFC_TIMEOUT,
+  PARAM_NFC_POLL_TIMEOUT,
+  PARAM_NFC_FAST_INTERVAL,
+  PARAM_NFC_IDLE_INTERVAL,
+  PARAM_NFC_ACTIVE_WINDOW,
+  PARAM_LCD_HOLD_TIME,
+  PARAM_LCD_ERROR_HOLD_TIME,
+  PARAM_RECONNECT_INTERVAL,
+  PARAM_WIFI_RETRY_DELAY,
+  PARAM_LOOP_DELAY,
+  PARAM_TELEMETRY_INTERVAL,
+  PARAM_TRACE,
+  PARAM_SECURE_CARDS,
+  PARAM_HEAP_TREND_WINDOW,
+  PARAM_SLO_NETWORK,
+  PARAM_SLO_NFC,
+  PARAM_SLO_ACTUATION,
+  PARAM_SLO_DISPLAY,
+  PARAM_COUNT
+};
+
+struct ParamSpec
+{
+  const char *name;   // Wire name used by set_params and telemetry
+  const char *nvsKey; // Max 15 chars
+  uint32_t defaultValue;
+  uint32_t minValue;
+  uint32_t maxValue;
+};
+
+// Timing parameters with compile-time defaults from config.h and per-site
+// overrides kept in NVS. Lookups are a plain array index.
+class RuntimeParams
+{
+private:
+  Preferences *preferences;
+  uint32_t values[PARAM_COUNT];
+
+  static const ParamSpec specs[PARAM_COUNT];
+
+public:
+  RuntimeParams(Preferences *prefs);
+
+  void load();
+  uint32_t get(ParamId id) const { return values[id]; }
+
+  static int find(const char *name);
+  static bool isValid(ParamId id, uint32_t value);
+  static const ParamSpec &spec(ParamId id) { return specs[id]; }
+
+  bool set(ParamId id, uint32_t value);
+  void resetToDefaults();
+  void toJson(JsonObject out) const;
+};
+
+#endif
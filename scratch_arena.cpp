@@ -0,0 +1,28 @@
+#include "scratch_arena.h"
+
+ScratchArena scratchArena;
+
+ScratchArena::ScratchArena() : used(0), highWater(0), failures(0)
+{
+}
+
+void *ScratchArena::allocate(size_t size)
+{
+  size_t start = (used + 7) & ~(size_t)7;
+  if (size == 0 || start + size > SCRATCH_ARENA_SIZE)
+  {
+    failures++;
+    return nullptr;
+  }
+
+  used = start + size;
+  if (used > highWater)
+    highWater = used;
+  return buffer + start;
+}
+
+void ScratchArena::release(size_t position)
+{
+  if (position < used)
+    used = position;
+}
@@ -0,0 +1,58 @@
+#ifndef SCRATCH_ARENA_H
+#define SCRATCH_ARENA_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "config.h"
+
+// Bump-pointer memory for data that dies within one loop iteration: parse
+// documents, serialized frames, compression output. Nothing is freed one by
+// one; a ScratchScope rewinds on exit and loop() resets the whole arena.
+// Only the Arduino loop task may use it.
+class ScratchArena
+{
+private:
+  uint8_t buffer[SCRATCH_ARENA_SIZE] __attribute__((aligned(8)));
+  size_t used;
+  size_t highWater;
+  uint32_t failures;
+
+public:
+  ScratchArena();
+
+  void *allocate(size_t size);
+  char *allocateText(size_t length) { return (char *)allocate(length + 1); }
+  size_t mark() const { return used; }
+  void release(size_t position);
+  void reset() { used = 0; }
+
+  // Getters
+  size_t getUsed() const { return used; }
+  size_t getHighWater() const { return highWater; }
+  uint32_t getFailures() const { return failures; }
+};
+
+extern ScratchArena scratchArena;
+
+// Everything allocated while a scope is alive is released when it ends
+class ScratchScope
+{
+private:
+  size_t position;
+
+public:
+  ScratchScope() : position(scratchArena.mark()) {}
+  ~ScratchScope() { scratchArena.release(position); }
+};
+
+// Lets ArduinoJson place a document's pool in the arena
+struct ScratchAllocator
+{
+  void *allocate(size_t size) { return scratchArena.allocate(size); }
+  void deallocate(void *) {}                           // Reclaimed with the enclosing scope
+  void *reallocate(void *, size_t) { return nullptr; } // Arena documents are never resized
+};
+
+typedef BasicJsonDocument<ScratchAllocator> ScratchJsonDocument;
+
+#endif
@@ -0,0 +1,181 @@
+#include "send_queue.h"
+#include "virtual_clock.h"
+
+static const char *const LANE_NAMES[LANE_COUNT] = {"control", "telemetry", "bulk"};
+
+SendQueue::SendQueue()
+{
+  memset(lanes, 0, sizeof(lanes));
+  spillInUse = false;
+  lanes[LANE_CONTROL].storage = controlStorage;
+  lanes[LANE_CONTROL].slots = controlSlots;
+  lanes[LANE_CONTROL].capacity = SEND_CONTROL_SLOTS;
+  lanes[LANE_CONTROL].slotSize = SEND_CONTROL_SLOT_SIZE;
+
+  lanes[LANE_TELEMETRY].storage = telemetryStorage;
+  lanes[LANE_TELEMETRY].slots = &telemetrySlot;
+  lanes[LANE_TELEMETRY].capacity = 1;
+  lanes[LANE_TELEMETRY].slotSize = SEND_TELEMETRY_SLOT_SIZE;
+
+  lanes[LANE_BULK].storage = bulkStorage;
+  lanes[LANE_BULK].slots = bulkSlots;
+  lanes[LANE_BULK].capacity = SEND_BULK_SLOTS;
+  lanes[LANE_BULK].slotSize = SEND_BULK_SLOT_SIZE;
+}
+
+bool SendQueue::enqueue(SendLane lane, const char *frame, size_t length, bool compress)
+{
+  SendLaneState &state = lanes[lane];
+
+  // A control frame too large for a slot waits in the spill buffer, in
+  // order with the rest; there is room for one at a time
+  bool spill = length > state.slotSize;
+  if (spill && (lane != LANE_CONTROL || spillInUse || length > SEND_CONTROL_SPILL_SIZE))
+    return refuse(state, lane, length);
+
+  if (state.count == state.capacity)
+  {
+    if (lane == LANE_CONTROL)
+    {
+      transmitOldest(lane); // Make room by writing the oldest frame now
+    }
+    else if (lane == LANE_TELEMETRY)
+    {
+      popOldest(state); // Only the latest report matters
+      state.coalesced++;
+    }
+    else
+    {
+      state.dropped++;
+      return false;
+    }
+  }
+
+  uint8_t index = (state.head + state.count) % state.capacity;
+  if (spill)
+  {
+    memcpy(controlSpill, frame, length);
+    spillInUse = true;
+  }
+  else
+  {
+    memcpy(state.storage + index * state.slotSize, frame, length);
+  }
+  state.slots[index].length = length;
+  state.slots[index].compress = compress;
+  state.slots[index].spilled = spill;
+  state.slots[index].queuedAt = clockMillis();
+  state.count++;
+  return true;
+}
+
+bool SendQueue::refuse(SendLaneState &state, SendLane lane, size_t length)
+{
+  state.dropped++;
+  state.oversized++;
+  Serial.print(F("Frame too large for "));
+  Serial.print(LANE_NAMES[lane]);
+  Serial.print(F(" lane: "));
+  Serial.println(length);
+  return false;
+}
+
+// Control frames go out in full; telemetry and bulk share a byte budget
+void SendQueue::pump()
+{
+  while (lanes[LANE_CONTROL].count > 0)
+  {
+    if (!transmitOldest(LANE_CONTROL))
+      return; // Socket failed; the close event clears the rest
+  }
+
+  size_t budget = SEND_PUMP_BUDGET;
+  for (int lane = LANE_TELEMETRY; lane < LANE_COUNT; lane++)
+  {
+    SendLaneState &state = lanes[lane];
+    while (state.count > 0 && budget > 0)
+    {
+      size_t length = state.slots[state.head].length;
+      if (!transmitOldest((SendLane)lane))
+        return;
+      budget -= min(budget, length);
+    }
+  }
+}
+
+bool SendQueue::transmitOldest(SendLane lane)
+{
+  SendLaneState &state = lanes[lane];
+  const SendSlot &slot = state.slots[state.head];
+
+  uint32_t waited = clockMillis() - slot.queuedAt;
+  const char *frame = slot.spilled ? controlSpill : state.storage + state.head * state.slotSize;
+  bool sent = transmitHandler && transmitHandler(lane, frame, slot.length, slot.compress);
+  if (sent)
+  {
+    state.sent++;
+    if (waited > state.maxWaitMs)
+      state.maxWaitMs = waited;
+  }
+  else
+  {
+    state.dropped++;
+  }
+
+  popOldest(state);
+  return sent;
+}
+
+void SendQueue::popOldest(SendLaneState &state)
+{
+  if (state.slots[state.head].spilled)
+    spillInUse = false;
+  state.head = (state.head + 1) % state.capacity;
+  state.count--;
+}
+
+// Frames queued for a closed socket are stale by the time it reopens, and
+// registration has to be the first frame on the new one
+void SendQueue::clear()
+{
+  for (int lane = 0; lane < LANE_COUNT; lane++)
+  {
+    lanes[lane].dropped += lanes[lane].count;
+    lanes[lane].head = 0;
+    lanes[lane].count = 0;
+  }
+  spillInUse = false;
+}
+
+// Backed up once fewer than a quarter of the slots (at least one) are free
+bool SendQueue::isBackedUp(SendLane lane) const
+{
+  const SendLaneState &state = lanes[lane];
+  int reserve = max(1, state.capacity / 4);
+  return state.capacity - state.count < reserve;
+}
+
+bool SendQueue::isEmpty() const
+{
+  for (int lane = 0; lane < LANE_COUNT; lane++)
+  {
+    if (lanes[lane].count > 0)
+      return false;
+  }
+  return true;
+}
+
+void SendQueue::toJson(JsonObject out) const
+{
+  for (int lane = 0; lane < LANE_COUNT; lane++)
+  {
+    const SendLaneState &state = lanes[lane];
+    JsonObject entry = out.createNestedObject(LANE_NAMES[lane]);
+    entry["queued"] = state.count;
+    entry["sent"] = state.sent;
+    entry["dropped"] = state.dropped;
+    entry["oversized"] = state.oversized;
+    entry["coalesced"] = state.coalesced;
+    entry["maxWaitMs"] = state.maxWaitMs;
+  }
+}
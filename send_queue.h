@@ -0,0 +1,83 @@
+#ifndef SEND_QUEUE_H
+#define SEND_QUEUE_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <functional>
+#include "config.h"
+
+enum SendLane : uint8_t
+{
+  LANE_CONTROL = 0,   // Acks, status and events; never dropped
+  LANE_TELEMETRY = 1, // Periodic reports; a newer one replaces a queued one
+  LANE_BULK = 2,      // Uploads; refused when full so the producer backs off
+  LANE_COUNT
+};
+
+struct SendSlot
+{
+  uint16_t length;
+  bool compress; // False for frames relayed on another module's behalf
+  bool spilled;  // Held in the control spill buffer instead of the slot
+  unsigned long queuedAt;
+};
+
+struct SendLaneState
+{
+  char *storage; // slots * slotSize bytes
+  SendSlot *slots;
+  uint8_t capacity;
+  uint16_t slotSize;
+  uint8_t head;
+  uint8_t count;
+
+  // Counters for telemetry
+  uint32_t sent;
+  uint32_t dropped;
+  uint32_t oversized; // Dropped because they fit neither a slot nor the spill buffer
+  uint32_t coalesced;
+  uint32_t maxWaitMs;
+};
+
+// Outbound frames wait here instead of being written from inside handlers.
+// The loop pumps control frames out in full, then telemetry and bulk frames
+// up to a byte budget, so an ack never queues behind an upload. Storage is
+// fixed slots per lane, plus one spill buffer for an oversized control frame.
+class SendQueue
+{
+public:
+  typedef std::function<bool(SendLane lane, const char *frame, size_t length, bool compress)> TransmitCallback;
+
+private:
+  char controlStorage[SEND_CONTROL_SLOTS * SEND_CONTROL_SLOT_SIZE];
+  char controlSpill[SEND_CONTROL_SPILL_SIZE];
+  bool spillInUse;
+  char telemetryStorage[SEND_TELEMETRY_SLOT_SIZE];
+  char bulkStorage[SEND_BULK_SLOTS * SEND_BULK_SLOT_SIZE];
+  SendSlot controlSlots[SEND_CONTROL_SLOTS];
+  SendSlot telemetrySlot;
+  SendSlot bulkSlots[SEND_BULK_SLOTS];
+  SendLaneState lanes[LANE_COUNT];
+
+  TransmitCallback transmitHandler;
+
+  bool refuse(SendLaneState &state, SendLane lane, size_t length);
+  bool transmitOldest(SendLane lane);
+  void popOldest(SendLaneState &state);
+
+public:
+  SendQueue();
+
+  void onTransmit(TransmitCallback callback) { transmitHandler = callback; }
+
+  bool enqueue(SendLane lane, const char *frame, size_t length, bool compress = true);
+  void pump();
+  void clear();
+
+  // Producers of optional traffic check this before building a frame
+  bool isBackedUp(SendLane lane) const;
+  bool isEmpty() const;
+  void toJson(JsonObject out) const;
+};
+
+#endif
@@ -1,14 +1,49 @@
 #include "server_manager.h"
+#include "virtual_clock.h"
 #include "hardware_manager.h"
+#include "command_auth.h"
+#include "phone_credentials.h"
+#include "card_auth.h"
+#include "access_rules.h"
+#include "runtime_params.h"
+#include "ota_manager.h"
+#include "mesh_manager.h"
+#include "gateway_manager.h"
+#include "bus_manager.h"
+#include "scratch_arena.h"
+#include "perf_counters.h"
+#include "trace_recorder.h"
+#include "heap_monitor.h"
+#include "watchdog.h"
+#include "protocol_messages.h"
 
 ServerManager *ServerManager::instance = nullptr;
 
-ServerManager::ServerManager(HardwareManager *hw, const String &mac)
-    : hardware(hw), macAddress(mac), isConnected(false), isConfigured(false),
-      lastPing(0), lastReconnectAttempt(0), lastAvailableBroadcast(0)
+ServerManager::ServerManager(HardwareManager *hw, CommandAuthenticator *authenticator,
+                             PhoneCredentials *phoneCredentials, CardAuthenticator *cardAuthenticator, AccessRules *rules,
+                             RuntimeParams *runtimeParams, OtaManager *otaManager, MeshManager *meshManager,
+                             GatewayManager *gatewayManager, BusManager *busManager, const char *mac)
+    : hardware(hw), auth(authenticator), phone(phoneCredentials), cardAuth(cardAuthenticator), accessRules(rules),
+      params(runtimeParams), ota(otaManager),
+      mesh(meshManager), gateway(gatewayManager), bus(busManager), macAddress(mac),
+      isConnected(false), isConfigured(false), isRegistered(false),
+      deflateAccepted(false), bulkConnected(false), bulkConnect(BULK_CONNECT_IDLE), bulkBackoff(0),
+      frameAuth(CommandAuthenticator::AUTH_MISSING_SIGNATURE),
+      frameSource(SOURCE_SERVER), rxFrames(0), rxBytes(0), rxParseMicros(0),
+      rxMaxParseMicros(0), rxMaxPoolBytes(0), bulkFramesIn(0), bulkBytesIn(0),
+      lastPing(0), lastReconnectAttempt(0), lastBulkAttempt(0), lastAvailableBroadcast(0), lastTelemetry(0)
 {
   webSocket = new WebsocketsClient();
+  bulkSocket = new WebsocketsClient();
   instance = this;
+
+  sendQueue.onTransmit([this](SendLane lane, const char *frame, size_t length, bool compress)
+                       { return transmitFrame(lane, frame, length, compress); });
+
+  for (const char *key : PROTOCOL_INBOUND_KEYS)
+  {
+    inboundFilter[key] = true;
+  }
 }
 
 ServerManager::~ServerManager()
@@ -18,6 +53,11 @@ ServerManager::~ServerManager()
     webSocket->close();
     delete webSocket;
   }
+  if (bulkSocket)
+  {
+    bulkSocket->close();
+    delete bulkSocket;
+  }
   instance = nullptr;
 }
 
@@ -27,17 +67,19 @@ bool ServerManager::initialize(const String &serverIP, int serverPort)
   isConfigured = hardware->getConfigurationStatus();
 
   // Construct WebSocket URL for raw WebSocket connection (not Socket.IO)
-  serverURL = "ws://" + serverIP + ":" + String(serverPort) + "/ws";
+  serverHost = "ws://" + serverIP + ":" + String(serverPort);
+  serverURL = serverHost + "/ws";
 
   // Set up WebSocket event handlers
   webSocket->onMessage([this](WebsocketsMessage message)
-                       { handleMessage(message.data()); });
+                       { handleSocketMessage(message); });
 
   webSocket->onEvent([this](WebsocketsEvent event, String data)
                      {
     switch(event) {
       case WebsocketsEvent::ConnectionOpened:
         Serial.println("WebSocket Connected to server");
+        traceRecorder.record("open", serverURL.c_str());
         isConnected = true;
         if (isConfigured) {
           registerModule();
@@ -49,7 +91,11 @@ bool ServerManager::initialize(const String &serverIP, int serverPort)
         
       case WebsocketsEvent::ConnectionClosed:
         Serial.println("WebSocket Disconnected from server");
+        traceRecorder.record("close", "");
         isConnected = false;
+        deflateAccepted = false;
+        sendQueue.clear();
+        closeBulk();
         if (isConfigured) {
           hardware->updateLCD("Disconnected", "Reconnecting...");
         }
@@ -63,6 +109,70 @@ bool ServerManager::initialize(const String &serverIP, int serverPort)
         break;
     } });
 
+  // The server routes OTA chunks and large pushes here once it is open;
+  // both sockets feed the same handlers
+  bulkSocket->onMessage([this](WebsocketsMessage message)
+                        {
+    bulkFramesIn++;
+    bulkBytesIn += message.length();
+    handleSocketMessage(message); });
+
+  bulkSocket->onEvent([this](WebsocketsEvent event, String data)
+                      {
+    switch(event) {
+      case WebsocketsEvent::ConnectionOpened:
+        break; // Raised on the connect task; reconnectBulk() takes it from there
+
+      case WebsocketsEvent::ConnectionClosed:
+        bulkConnected = false;
+        break;
+
+      case WebsocketsEvent::GotPing:
+        bulkSocket->pong();
+        break;
+
+      default:
+        break;
+    } });
+
+  // Neighbors without an AP path hand us their frames; commands for this
+  // module can arrive the same way while our own socket is down. Any radio
+  // can send those, so they go through the relayed-frame checks.
+  if (mesh)
+  {
+    mesh->onUplink([this](const uint8_t *origin, uint8_t hops, const char *payload)
+                   { relayUplink(origin, hops, payload); });
+    mesh->onDownlink([this](char *payload)
+                     { handleMessage(payload, strlen(payload), SOURCE_MESH); });
+  }
+
+  // Remote boards report once they have actually moved
+  if (bus)
+  {
+    bus->onDoorState([this](const char *lockerId, const char *status)
+                     { sendStatusUpdate(lockerId, status); });
+    bus->onActuationFailed([this](const char *lockerId)
+                           { sendCommandRejected(lockerId, "bus_offline"); });
+  }
+
+  if (gateway && gateway->isGateway())
+  {
+    gateway->onUpstream([this](uint8_t channel, const char *payload)
+                        { relayMux(channel, payload); });
+    gateway->onAttach([this](uint8_t channel, const uint8_t *mac)
+                      { sendMuxAttach(channel, mac); });
+  }
+  else if (gateway && gateway->isSecondary())
+  {
+    // A secondary never opens its own socket. Its gateway's MAC is easy to
+    // spoof, so commands arriving this way must be signed.
+    gateway->onDownstream([this](char *payload)
+                          { handleMessage(payload, strlen(payload), SOURCE_GATEWAY); });
+    hardware->updateLCD(F("Secondary"), F("Via gateway"));
+    registerModule();
+    return true;
+  }
+
   // Attempt initial connection
   return reconnect();
 }
@@ -72,15 +182,16 @@ bool ServerManager::reconnect()
   if (isConnected)
     return true;
 
-  unsigned long currentTime = millis();
-  if (currentTime - lastReconnectAttempt < 5000)
+  unsigned long currentTime = clockMillis();
+  if (currentTime - lastReconnectAttempt < params->get(PARAM_RECONNECT_INTERVAL))
   {
     return false; // Don't try to reconnect too frequently
   }
 
   lastReconnectAttempt = currentTime;
 
-  Serial.println("Attempting to connect to: " + serverURL);
+  Serial.print(F("Attempting to connect to: "));
+  Serial.println(serverURL);
 
   if (webSocket->connect(serverURL))
   {
@@ -94,184 +205,1319 @@ bool ServerManager::reconnect()
   }
 }
 
+// The TCP connect and handshake block, so they run on a short-lived task and
+// loop() leaves the bulk socket alone until it finishes. Failed attempts back
+// off exponentially; transfers stay on the main socket meanwhile.
+void ServerManager::reconnectBulk(unsigned long currentTime)
+{
+  unsigned long interval = max(bulkBackoff, (unsigned long)params->get(PARAM_RECONNECT_INTERVAL));
+  BulkConnect state = bulkConnect;
+
+  if (state == BULK_CONNECT_RUNNING)
+    return;
+
+  if (state != BULK_CONNECT_IDLE)
+  {
+    bulkConnect = BULK_CONNECT_IDLE;
+    if (state == BULK_CONNECT_FAILED)
+    {
+      bulkBackoff = min(interval * 2, (unsigned long)BULK_RECONNECT_MAX);
+      Serial.println(F("Bulk socket connection failed"));
+    }
+    else if (bulkPath.isEmpty())
+    {
+      bulkSocket->close(); // The main socket closed while this one was opening
+    }
+    else
+    {
+      Serial.println(F("Bulk socket connected"));
+      bulkConnected = true;
+      bulkBackoff = 0;
+      sendBulkAttach();
+    }
+    return;
+  }
+
+  if (!isRegistered || bulkPath.isEmpty() || currentTime - lastBulkAttempt < interval)
+    return;
+
+  lastBulkAttempt = currentTime;
+  bulkUrl = serverHost + bulkPath.c_str();
+  bulkConnect = BULK_CONNECT_RUNNING;
+  if (xTaskCreate(bulkConnectEntry, "bulk_connect", BULK_CONNECT_STACK, this, 1, nullptr) != pdPASS)
+    bulkConnect = BULK_CONNECT_FAILED;
+}
+
+void ServerManager::bulkConnectEntry(void *arg)
+{
+  ServerManager *self = (ServerManager *)arg;
+  bool opened = self->bulkSocket->connect(self->bulkUrl);
+  self->bulkConnect = opened ? BULK_CONNECT_OPENED : BULK_CONNECT_FAILED;
+  vTaskDelete(nullptr);
+}
+
+void ServerManager::closeBulk()
+{
+  bulkPath.clear(); // Reopened only once the next registration offers it
+  if (bulkConnected)
+    bulkSocket->close();
+  bulkConnected = false;
+}
+
+// Binds the socket to this module's session; sent directly since the
+// queue only carries frames for an established channel
+void ServerManager::sendBulkAttach()
+{
+  StaticJsonDocument<SMALL_JSON_SIZE> doc;
+  BulkAttachMessage attach;
+  attach.moduleId = moduleId.c_str();
+  attach.toJson(doc);
+
+  char message[SMALL_JSON_SIZE];
+  size_t length = serializeJson(doc, message, sizeof(message));
+  bulkSocket->send(message, length);
+}
+
+// Binary frames carry firmware chunks; everything else is JSON
+void ServerManager::handleSocketMessage(WebsocketsMessage &message)
+{
+  if (message.isBinary())
+  {
+    handleBinaryMessage(message.rawData());
+  }
+  else
+  {
+    // The message's buffer is read-only, so the text is copied into the
+    // arena and parsed in place there
+    ScratchScope scope;
+    size_t length = message.length();
+    char *json = length <= BULK_JSON_SIZE ? scratchArena.allocateText(length) : nullptr;
+    if (!json)
+    {
+      Serial.println(F("Inbound frame too large, dropped"));
+      return;
+    }
+    memcpy(json, message.c_str(), length + 1);
+    handleMessage(json, length);
+  }
+}
+
 void ServerManager::loop()
 {
+  unsigned long currentTime = clockMillis();
+
+  if (gateway && gateway->isSecondary())
+  {
+    secondaryLoop(currentTime);
+    return;
+  }
+
+  // A lost AP leaves the TCP socket looking open until it times out
+  if (isConnected && WiFi.status() != WL_CONNECTED)
+  {
+    webSocket->close();
+    isConnected = false;
+    sendQueue.clear();
+    closeBulk();
+  }
+
   if (!isConnected)
   {
-    reconnect();
+    if (WiFi.status() == WL_CONNECTED)
+    {
+      reconnect();
+    }
+    else if (isOnline() && isConfigured && currentTime - lastPing >= params->get(PARAM_PING_INTERVAL))
+    {
+      // Keep the server's presence view current through a neighbor
+      sendPing();
+      lastPing = currentTime;
+    }
     return;
   }
 
   webSocket->poll();
 
-  unsigned long currentTime = millis();
+  // After the main socket, so a command waiting there is handled first
+  if (bulkConnected)
+    bulkSocket->poll();
+  else
+    reconnectBulk(currentTime);
 
-  if (isConfigured && currentTime - lastPing >= PING_INTERVAL)
+  // Peer-sourced OTA pulls and the seed's image check are driven from here
+  // rather than by inbound frames
+  handleOtaProgress(ota->pollPeer());
+  OtaManager::ServeCheck serveCheck = ota->pollServeCheck();
+  if (serveCheck == OtaManager::SERVE_STARTED || serveCheck == OtaManager::SERVE_REJECTED)
+    sendOtaServing(serveCheck == OtaManager::SERVE_STARTED);
+
+  if (isConfigured && currentTime - lastPing >= params->get(PARAM_PING_INTERVAL))
   {
     sendPing();
     lastPing = currentTime;
   }
 
+  if (isConfigured && currentTime - lastTelemetry >= params->get(PARAM_TELEMETRY_INTERVAL) &&
+      !sendQueue.isBackedUp(LANE_TELEMETRY))
+  {
+    sendTelemetry();
+    lastTelemetry = currentTime;
+  }
+
   // Send available module broadcast if not configured
-  if (!isConfigured && currentTime - lastAvailableBroadcast >= AVAILABLE_BROADCAST_INTERVAL)
+  if (!isConfigured && currentTime - lastAvailableBroadcast >= params->get(PARAM_AVAILABLE_BROADCAST_INTERVAL))
   {
     sendAvailableModuleBroadcast();
     lastAvailableBroadcast = currentTime;
   }
+
+  // Everything queued during this iteration, acks first
+  sendQueue.pump();
+}
+
+// Pings end at the gateway, so they double as a liveness signal for its
+// channel table; registration repeats until the server has answered
+void ServerManager::secondaryLoop(unsigned long currentTime)
+{
+  if (!isConfigured)
+  {
+    if (currentTime - lastAvailableBroadcast >= params->get(PARAM_AVAILABLE_BROADCAST_INTERVAL))
+    {
+      sendAvailableModuleBroadcast();
+      lastAvailableBroadcast = currentTime;
+    }
+    return;
+  }
+
+  if (currentTime - lastPing >= params->get(PARAM_PING_INTERVAL))
+  {
+    if (isRegistered)
+      sendPing();
+    else
+      registerModule();
+    lastPing = currentTime;
+  }
 }
 
 void ServerManager::sendAvailableModuleBroadcast()
 {
-  if (isConfigured || !isConnected)
+  if (isConfigured || !isOnline())
     return;
 
   StaticJsonDocument<MEDIUM_JSON_SIZE> doc;
-  doc["type"] = "module_available";
-  doc["macAddress"] = macAddress;
-  doc["deviceInfo"] = String(DEVICE_NAME) + " v" + String(FIRMWARE_VERSION);
-  doc["version"] = FIRMWARE_VERSION;
-  doc["capabilities"] = MAX_LOCKERS;
-  doc["timestamp"] = millis();
-
-  String message;
-  message.reserve(300);
-  serializeJson(doc, message);
-
-  webSocket->send(message);
+  ModuleAvailableMessage available;
+  available.macAddress = macAddress.c_str();
+  available.deviceInfo = DEVICE_NAME " v" FIRMWARE_VERSION;
+  available.version = FIRMWARE_VERSION;
+  available.capabilities = MAX_LOCKERS;
+  available.timestamp = clockMillis();
+  available.toJson(doc);
+
+  sendDocument(doc, LANE_TELEMETRY);
   Serial.println(F("Sent available module broadcast"));
 }
 
-void ServerManager::handleMessage(const String &message)
+// Parses in place: string values in the document point into json, which the
+// handlers read directly and which must outlive dispatch
+void ServerManager::handleMessage(char *json, size_t length, FrameSource source)
 {
-  StaticJsonDocument<LARGE_JSON_SIZE> doc;
-  DeserializationError error = deserializeJson(doc, message);
+  DeserializationError error;
+  traceRecorder.record("rx", json, length); // Before parsing rewrites the buffer
+  frameAuth = auth->checkFrame(json, length, moduleId.c_str());
+  frameSource = source;
+  unsigned long start = micros();
+
+  // Rule and credential pushes outgrow the stack document; their pool comes
+  // from the scratch arena and is handed back once dispatch returns
+  if (length > LARGE_JSON_SIZE / 2)
+  {
+    ScratchScope scope;
+    ScratchJsonDocument doc(BULK_JSON_SIZE);
+    error = deserializeJson(doc, json, length, DeserializationOption::Filter(inboundFilter));
+    recordParse(start, length, doc.memoryUsage());
+    if (!error)
+      dispatchMessage(doc);
+  }
+  else
+  {
+    StaticJsonDocument<LARGE_JSON_SIZE> doc;
+    error = deserializeJson(doc, json, length, DeserializationOption::Filter(inboundFilter));
+    recordParse(start, length, doc.memoryUsage());
+    if (!error)
+      dispatchMessage(doc);
+  }
 
   if (error)
   {
     Serial.print(F("Parse error: "));
     Serial.println(error.c_str());
+  }
+}
+
+// Parse time only; the handler is timed per message type by the dispatch probe
+void ServerManager::recordParse(unsigned long start, size_t length, size_t poolBytes)
+{
+  uint32_t elapsed = micros() - start;
+  rxFrames++;
+  rxBytes += length;
+  rxParseMicros += elapsed;
+  if (elapsed > rxMaxParseMicros)
+    rxMaxParseMicros = elapsed;
+  if (poolBytes > rxMaxPoolBytes)
+    rxMaxPoolBytes = poolBytes;
+}
+
+void ServerManager::dispatchMessage(const JsonDocument &doc)
+{
+  const char *messageType = doc["type"] | "";
+  if (!isAcceptedFrom(frameSource, messageType))
+  {
+    Serial.print(F("Dropped forwarded "));
+    Serial.println(messageType);
     return;
   }
 
-  const char *messageType = doc["type"];
+  PerfProbe probe(perfCounters.forMessage(messageType));
 
-  if (strcmp(messageType, "connected") == 0)
+  if (strcmp(messageType, ConnectedMessage::TYPE) == 0)
   {
     Serial.println(F("Server acknowledged connection"));
   }
-  else if (strcmp(messageType, "registered") == 0)
+  else if (strcmp(messageType, RegisteredMessage::TYPE) == 0)
   {
     Serial.println(F("Module registered successfully"));
+    RegisteredMessage registered(doc);
+    isRegistered = true;
+    deflateAccepted = registered.deflate;
+    // A path that does not fit is refused rather than cut short
+    bulkPath.clear();
+    if (registered.bulkPath && strlen(registered.bulkPath) <= bulkPath.capacity())
+      bulkPath = registered.bulkPath;
+    else if (registered.bulkPath)
+      Serial.println(F("Bulk path too long, bulk socket not used"));
     hardware->updateLCD(F("Registered"), F("System Ready"));
+    ota->confirmBoot();
   }
-  else if (strcmp(messageType, "pong") == 0)
+  else if (strcmp(messageType, PongMessage::TYPE) == 0)
   {
     // Server responded to our ping
   }
-  else if (strcmp(messageType, "lock") == 0 || strcmp(messageType, "unlock") == 0)
+  else if (strcmp(messageType, LockCommandMessage::LOCK) == 0 || strcmp(messageType, LockCommandMessage::UNLOCK) == 0)
   {
     handleLockUnlockCommand(doc);
   }
-  else if (strcmp(messageType, "module_configured") == 0)
+  else if (strcmp(messageType, ModuleConfiguredMessage::TYPE) == 0)
   {
     handleModuleConfiguration(doc);
   }
+  else if (strcmp(messageType, AccessRulesMessage::TYPE) == 0)
+  {
+    handleAccessRules(doc);
+  }
+  else if (strcmp(messageType, ConfigPatchMessage::TYPE) == 0)
+  {
+    handleConfigPatch(doc);
+  }
+  else if (strcmp(messageType, SetParamsMessage::TYPE) == 0)
+  {
+    handleSetParams(doc);
+  }
+  else if (strcmp(messageType, OtaBeginMessage::TYPE) == 0)
+  {
+    handleOtaBegin(doc);
+  }
+  else if (strcmp(messageType, OtaServeMessage::TYPE) == 0)
+  {
+    handleOtaServe(doc);
+  }
+  else if (strcmp(messageType, OtaServeStopMessage::TYPE) == 0)
+  {
+    if (authorizeFrame(doc, false))
+      ota->stopServing();
+  }
+  else if (strcmp(messageType, RelayDownMessage::TYPE) == 0)
+  {
+    handleRelay(doc);
+  }
+  else if (strcmp(messageType, MuxDownMessage::TYPE) == 0)
+  {
+    handleMux(doc);
+  }
+  else if (strcmp(messageType, SetRoleMessage::TYPE) == 0)
+  {
+    handleSetRole(doc);
+  }
+  else if (strcmp(messageType, BusConfigureMessage::TYPE) == 0)
+  {
+    handleBusConfigure(doc);
+  }
+  else if (strcmp(messageType, PerfQueryMessage::TYPE) == 0)
+  {
+    // Reading is harmless; wiping someone else's measurement window is not
+    PerfQueryMessage query(doc);
+    if (!query.reset || authorizeFrame(doc, true))
+      sendPerfReport(query.reset);
+  }
+  else if (strcmp(messageType, OtaAbortMessage::TYPE) == 0)
+  {
+    handleOtaAbort(doc);
+  }
 }
 
-void ServerManager::registerModule()
+// Frames that arrive over ESP-NOW are never trusted for the link they came
+// over. Mesh downlinks are limited to a few command types; a secondary takes
+// anything but the envelopes only the server's own socket carries.
+bool ServerManager::isAcceptedFrom(FrameSource source, const char *type)
+{
+  static const char *const meshTypes[] = {LockCommandMessage::LOCK, LockCommandMessage::UNLOCK, AccessRulesMessage::TYPE,
+                                          ConfigPatchMessage::TYPE, SetParamsMessage::TYPE};
+
+  if (source == SOURCE_SERVER)
+    return true;
+  if (source == SOURCE_GATEWAY)
+    return strcmp(type, RelayDownMessage::TYPE) != 0 && strcmp(type, MuxDownMessage::TYPE) != 0;
+
+  for (const char *allowed : meshTypes)
+  {
+    if (strcmp(type, allowed) == 0)
+      return true;
+  }
+  return false;
+}
+
+// Frames other than lock/unlock that change the module are signed whole once
+// it holds a key; `required` marks messages that must never run unsigned.
+// The nonce is persisted here, before the handler acts on the frame.
+bool ServerManager::authorizeFrame(const JsonDocument &doc, bool required)
+{
+  const char *type = doc["type"] | "";
+  CommandAuthenticator::Result result = CommandAuthenticator::AUTH_NO_KEY;
+  required = required || frameSource != SOURCE_SERVER;
+
+  if (auth->isProvisioned())
+    result = auth->acceptFrame(frameAuth, doc["nonce"] | 0UL);
+  else if (!required)
+    return true; // Modules configured before keys were issued keep accepting plain frames
+
+  if (result == CommandAuthenticator::AUTH_OK)
+  {
+    auth->persistReplayState();
+    return true;
+  }
+
+  Serial.print(F("Rejected "));
+  Serial.print(type);
+  Serial.print(F(": "));
+  Serial.println(CommandAuthenticator::resultName(result));
+  sendCommandRejected(nullptr, CommandAuthenticator::resultName(result), type);
+  return false;
+}
+
+// { "size": 1572864, "sha256": "<64 hex>", "version": "1.1.0", "source": "http://peer/ota/image" }
+// Sending the same image again after a disconnect or reboot resumes it; the
+// reply's offset tells the server where to continue. With a source the module
+// pulls the image from that peer instead of waiting for binary frames.
+// The frame must be signed even on an unkeyed module: the signature is what
+// vouches for the sha256 every chunk is checked against.
+void ServerManager::handleOtaBegin(const JsonDocument &doc)
+{
+  if (!authorizeFrame(doc, true))
+    return;
+
+  OtaBeginMessage request(doc);
+  if (ota->begin(request.size, request.sha256, request.version, request.source))
+  {
+    hardware->updateLCD(F("Updating..."), F("Do not unplug"));
+  }
+  sendOtaStatus();
+}
+
+// Cancelling discards the resume progress, so like ota_begin it must be signed
+void ServerManager::handleOtaAbort(const JsonDocument &doc)
+{
+  if (!authorizeFrame(doc, true))
+    return;
+
+  ota->abort();
+  hardware->updateSystemStatus();
+  sendOtaStatus();
+}
+
+// Binary frame: 4-byte little-endian image offset followed by image data.
+// The server keeps at most OTA_WINDOW_BYTES past the last acknowledged offset.
+// Frames tagged DEFLATE_MAGIC instead carry a compressed JSON message.
+void ServerManager::handleBinaryMessage(const WSString &data)
+{
+  const uint8_t *bytes = (const uint8_t *)data.data();
+  if (FrameCompressor::isCompressed(bytes, data.size()))
+  {
+    size_t length;
+    char *json = compressor.inflate(bytes + DEFLATE_MAGIC_SIZE, data.size() - DEFLATE_MAGIC_SIZE, length);
+    if (json)
+      handleMessage(json, length);
+    else
+      Serial.println(F("Inflate failed"));
+    return;
+  }
+
+  traceRecorder.recordLength("rxbin", data.size());
+  handleOtaProgress(ota->writeChunk((const uint8_t *)data.data(), data.size()));
+}
+
+void ServerManager::handleOtaProgress(int result)
+{
+  switch (result)
+  {
+  case OtaManager::CHUNK_ACK_DUE:
+  case OtaManager::CHUNK_OUT_OF_ORDER:
+  case OtaManager::CHUNK_FAILED:
+    sendOtaStatus();
+    break;
+
+  case OtaManager::CHUNK_COMPLETE:
+    sendOtaStatus();
+    sendQueue.pump(); // Nothing queued survives the restart
+    hardware->updateLCD(F("Update done"), F("Restarting..."));
+    clockDelay(2000);
+    ESP.restart();
+    break;
+
+  default:
+    break;
+  }
+}
+
+// Seeding stage: { "size": ..., "sha256": ... } describing the image this
+// module now runs. Once the loop has checked the image, the reply carries the
+// URL peers should use as their source.
+void ServerManager::handleOtaServe(const JsonDocument &doc)
+{
+  if (!authorizeFrame(doc, true))
+    return;
+
+  OtaServeMessage request(doc);
+  if (!ota->startServing(request.size, request.sha256))
+    sendOtaServing(false);
+}
+
+void ServerManager::sendOtaServing(bool serving)
+{
+  String url = serving ? ota->getServeUrl() : String();
+
+  StaticJsonDocument<SMALL_JSON_SIZE> reply;
+  OtaServingMessage result;
+  result.moduleId = moduleId.c_str();
+  result.success = serving;
+  result.url = serving ? url.c_str() : nullptr;
+  result.error = serving ? nullptr : ota->getLastError();
+  result.toJson(reply);
+
+  sendDocument(reply);
+}
+
+void ServerManager::sendOtaStatus()
+{
+  if (!isConnected)
+    return;
+
+  static const char *const stateNames[] = {"idle", "receiving", "applied", "failed"};
+
+  OtaStatusMessage status;
+  status.moduleId = moduleId.c_str();
+  status.state = stateNames[ota->getState()];
+  status.offset = ota->getOffset();
+  status.size = ota->getSize();
+  status.window = OTA_WINDOW_BYTES;
+  status.bytesPerSec = ota->getBytesPerSecond();
+  status.minFreeHeap = ota->getMinFreeHeap();
+  status.peerBytes = ota->getPeerBytes();
+  status.error = ota->getLastError();
+
+  StaticJsonDocument<MEDIUM_JSON_SIZE> doc;
+  status.toJson(doc);
+
+  sendDocument(doc);
+}
+
+// { "params": { "pingInterval": 30000, ... } } - values are type- and range-checked
+// and applied together; the reply is a telemetry frame carrying the live values.
+void ServerManager::handleSetParams(const JsonDocument &doc)
+{
+  // Tracing copies frames to Serial, so changing it always takes a signed frame
+  JsonObjectConst changes = SetParamsMessage(doc).params;
+  if (!authorizeFrame(doc, changes.containsKey("trace")))
+    return;
+
+  // Strings, bools and null would read as 0, which is in range for some params
+  for (JsonPairConst change : changes)
+  {
+    int id = RuntimeParams::find(change.key().c_str());
+    if (id < 0 || !change.value().is<uint32_t>() || !RuntimeParams::isValid((ParamId)id, change.value()))
+    {
+      Serial.print(F("Rejected param: "));
+      Serial.println(change.key().c_str());
+      sendTelemetry();
+      return;
+    }
+  }
+
+  for (JsonPairConst change : changes)
+  {
+    params->set((ParamId)RuntimeParams::find(change.key().c_str()), change.value().as<uint32_t>());
+  }
+
+  Serial.print(F("Updated params: "));
+  Serial.println(changes.size());
+  sendTelemetry();
+}
+
+// Applies an incremental config change without restarting:
+// { "baseVersion": 4, "version": 5, "ops": [{ "op": "add_locker", "lockerId": "A4" }, ...] }
+// All ops are validated against staged copies first; nothing is written unless every op applies.
+void ServerManager::handleConfigPatch(const JsonDocument &doc)
+{
+  ConfigPatchMessage patch(doc);
+
+  // As in set_params, a patch that changes tracing must be signed
+  bool setsTrace = false;
+  for (JsonVariantConst op : patch.ops)
+  {
+    if (strcmp(op["op"] | "", "set_param") == 0 && strcmp(op["name"] | "", "trace") == 0)
+      setsTrace = true;
+  }
+  if (!authorizeFrame(doc, setsTrace))
+    return;
+  uint32_t baseVersion = patch.baseVersion;
+  uint32_t targetVersion = patch.version;
+
+  if (!isConfigured || baseVersion != hardware->getConfigVersion() || targetVersion <= baseVersion)
+  {
+    // Server falls back to a full module_configured on mismatch
+    sendConfigAck(false, "version_mismatch");
+    return;
+  }
+
+  LockerSet lockerSet;
+  hardware->getLockerSet(lockerSet);
+  AccessTable *stagedRules = nullptr;
+  uint32_t stagedParams[PARAM_COUNT];
+  bool paramChanged[PARAM_COUNT] = {};
+  const char *error = nullptr;
+
+  for (JsonVariantConst op : patch.ops)
+  {
+    const char *name = op["op"] | "";
+    const char *lockerId = op["lockerId"] | "";
+    int index = HardwareManager::findLockerIndex(lockerSet, lockerId);
+
+    if (strcmp(name, "add_locker") == 0)
+    {
+      if (index >= 0 || lockerId[0] == '\0' || strlen(lockerId) >= LOCKER_ID_SIZE)
+      {
+        error = "bad_locker_id";
+        break;
+      }
+
+      int slot = 0;
+      while (slot < lockerSet.count && lockerSet.ids[slot][0] != '\0')
+        slot++;
+      if (slot >= MAX_LOCKERS)
+      {
+        error = "no_free_slot";
+        break;
+      }
+
+      strncpy(lockerSet.ids[slot], lockerId, LOCKER_ID_SIZE - 1);
+      if (slot >= lockerSet.count)
+        lockerSet.count = slot + 1;
+    }
+    else if (strcmp(name, "remove_locker") == 0)
+    {
+      if (index < 0)
+      {
+        error = "unknown_locker";
+        break;
+      }
+
+      memset(lockerSet.ids[index], 0, LOCKER_ID_SIZE);
+      if (accessRules->hasRules())
+      {
+        if (!stagedRules)
+          stagedRules = accessRules->beginPatch();
+        AccessRules::patchClearLocker(*stagedRules, index);
+      }
+    }
+    else if (strcmp(name, "rename_locker") == 0)
+    {
+      const char *newId = op["newId"] | "";
+      if (index < 0 || newId[0] == '\0' || strlen(newId) >= LOCKER_ID_SIZE ||
+          HardwareManager::findLockerIndex(lockerSet, newId) >= 0)
+      {
+        error = "bad_locker_id";
+        break;
+      }
+
+      // Rules are compiled by slot, so they follow the locker through a rename
+      memset(lockerSet.ids[index], 0, LOCKER_ID_SIZE);
+      strncpy(lockerSet.ids[index], newId, LOCKER_ID_SIZE - 1);
+    }
+    else if (strcmp(name, "add_credential") == 0 || strcmp(name, "remove_credential") == 0)
+    {
+      bool adding = strcmp(name, "add_credential") == 0;
+      if (!op["uid"].is<const char *>() || (!op["kind"].isNull() && !op["kind"].is<const char *>()) ||
+          (adding && !op["group"].is<uint8_t>()))
+      {
+        error = "bad_op";
+        break;
+      }
+
+      if (!stagedRules)
+        stagedRules = accessRules->beginPatch();
+
+      bool ok = adding ? index >= 0 && AccessRules::patchAddCredential(*stagedRules, op["uid"], op["kind"], op["group"], index)
+                       : AccessRules::patchRemoveCredential(*stagedRules, op["uid"], op["kind"]);
+      if (!ok)
+      {
+        error = "bad_credential";
+        break;
+      }
+    }
+    else if (strcmp(name, "set_param") == 0)
+    {
+      if (!op["name"].is<const char *>() || !op["value"].is<uint32_t>())
+      {
+        error = "bad_op";
+        break;
+      }
+
+      int id = RuntimeParams::find(op["name"]);
+      uint32_t value = op["value"];
+      if (id < 0 || !RuntimeParams::isValid((ParamId)id, value))
+      {
+        error = "bad_param";
+        break;
+      }
+
+      stagedParams[id] = value;
+      paramChanged[id] = true;
+    }
+    else
+    {
+      error = "unknown_op";
+      break;
+    }
+  }
+
+  if (error)
+  {
+    delete stagedRules;
+    Serial.print(F("Config patch rejected: "));
+    Serial.println(error);
+    sendConfigAck(false, error);
+    return;
+  }
+
+  // Credential ops are idempotent, so committing them first is safe: if power
+  // fails before the locker set lands, the server simply replays the patch.
+  if (stagedRules)
+    accessRules->commitPatch(stagedRules);
+
+  for (int i = 0; i < PARAM_COUNT; i++)
+  {
+    if (paramChanged[i])
+      params->set((ParamId)i, stagedParams[i]);
+  }
+
+  lockerSet.version = targetVersion;
+  hardware->applyLockerSet(lockerSet);
+
+  Serial.print(F("Config patched to v"));
+  Serial.println(targetVersion);
+  hardware->updateSystemStatus();
+  sendConfigAck(true, nullptr);
+}
+
+void ServerManager::sendConfigAck(bool success, const char *error)
 {
-  if (!isConfigured || !isConnected)
+  if (!isOnline())
     return;
 
   StaticJsonDocument<SMALL_JSON_SIZE> doc;
-  doc["type"] = "register";
-  doc["moduleId"] = moduleId;
+  ConfigAckMessage ack;
+  ack.moduleId = moduleId.c_str();
+  ack.success = success;
+  ack.version = hardware->getConfigVersion();
+  ack.error = error;
+  ack.toJson(doc);
 
-  String message;
-  message.reserve(150);
-  serializeJson(doc, message);
+  sendDocument(doc);
+}
 
-  webSocket->send(message);
+void ServerManager::handleAccessRules(const JsonDocument &doc)
+{
+  if (!authorizeFrame(doc, false))
+    return;
+
+  bool applied = accessRules->compile(doc, hardware);
+
+  StaticJsonDocument<SMALL_JSON_SIZE> reply;
+  AccessRulesAppliedMessage result;
+  result.moduleId = moduleId.c_str();
+  result.success = applied;
+  result.version = accessRules->getVersion();
+  result.credentials = accessRules->getCredentialCount();
+  result.toJson(reply);
+
+  sendDocument(reply);
+}
+
+void ServerManager::registerModule()
+{
+  if (!isConfigured || !isOnline())
+    return;
+
+  RegisterMessage registration;
+  registration.moduleId = moduleId.c_str();
+  registration.auth = auth->isProvisioned() ? "hmac-sha256" : "none";
+  registration.configVersion = hardware->getConfigVersion();
+  registration.deflate = DEFLATE_WINDOW; // Offer compressed frames; "registered" accepts
+  registration.bulk = true;              // Can open a transfer socket; "registered" names its path
+  registration.role = gateway ? GatewayManager::roleName(gateway->getRole()) : nullptr;
+
+  StaticJsonDocument<SMALL_JSON_SIZE> doc;
+  registration.toJson(doc);
+
+  sendDocument(doc);
   Serial.print(F("Registered module: "));
-  Serial.println(moduleId);
+  Serial.println(moduleId.c_str());
+
+  // The server's channel map does not survive our reconnect
+  if (gateway && gateway->isGateway())
+    gateway->announceChannels();
 }
 
 void ServerManager::handleLockUnlockCommand(const JsonDocument &doc)
 {
-  String lockerId = doc["lockerId"].as<String>();
-  const char *action = doc["type"];
+  LockCommandMessage command(doc);
+  const char *lockerId = command.lockerId;
+  const char *action = command.type;
 
   Serial.print(F("Command "));
   Serial.print(action);
   Serial.print(F(" for locker: "));
   Serial.println(lockerId);
 
-  if (strcmp(action, "unlock") == 0)
+  // Modules configured before keys were issued keep accepting plain commands,
+  // but only from the server's own socket
+  if (auth->isProvisioned() || frameSource != SOURCE_SERVER)
+  {
+    CommandAuthenticator::Result result =
+        auth->verify(action, moduleId.c_str(), lockerId, command.nonce, command.sig);
+
+    Serial.print(F("Auth "));
+    Serial.print(CommandAuthenticator::resultName(result));
+    Serial.print(F(" in "));
+    Serial.print(auth->getLastVerifyMicros());
+    Serial.println(F("us"));
+
+    if (result != CommandAuthenticator::AUTH_OK)
+    {
+      sendCommandRejected(lockerId, CommandAuthenticator::resultName(result));
+      return;
+    }
+    auth->persistReplayState();
+  }
+
+  if (bus && bus->findDoor(lockerId) >= 0)
+  {
+    // Queued for the bus task; the status update follows the board's reply
+    if (!bus->actuate(lockerId, strcmp(action, LockCommandMessage::UNLOCK) == 0))
+      sendCommandRejected(lockerId, "bus_busy");
+  }
+  else if (strcmp(action, LockCommandMessage::UNLOCK) == 0)
   {
     hardware->unlockLocker(lockerId);
     sendStatusUpdate(lockerId, "unlocked");
   }
-  else if (strcmp(action, "lock") == 0)
+  else if (strcmp(action, LockCommandMessage::LOCK) == 0)
   {
     hardware->lockLocker(lockerId);
     sendStatusUpdate(lockerId, "locked");
   }
 }
 
-void ServerManager::sendStatusUpdate(const String &lockerId, const String &status)
+void ServerManager::sendCommandRejected(const char *lockerId, const char *reason, const char *command)
+{
+  if (!isConfigured || !isOnline())
+    return;
+
+  StaticJsonDocument<SMALL_JSON_SIZE> doc;
+  CommandRejectedMessage rejected;
+  rejected.moduleId = moduleId.c_str();
+  rejected.lockerId = lockerId;
+  rejected.reason = reason;
+  rejected.command = command;
+  rejected.toJson(doc);
+
+  sendDocument(doc);
+}
+
+void ServerManager::sendStatusUpdate(const char *lockerId, const char *status)
 {
-  if (!isConfigured || !isConnected)
+  if (!isConfigured || !isOnline())
     return;
 
   StaticJsonDocument<MEDIUM_JSON_SIZE> doc;
-  doc["type"] = "status_update";
-  doc["moduleId"] = moduleId;
-  doc["lockerId"] = lockerId;
-  doc["status"] = status;
-  doc["timestamp"] = millis();
+  StatusUpdateMessage update;
+  update.moduleId = moduleId.c_str();
+  update.lockerId = lockerId;
+  update.status = status;
+  update.timestamp = clockMillis();
+  update.toJson(doc);
+
+  sendDocument(doc);
+}
 
-  String message;
-  message.reserve(200);
-  serializeJson(doc, message);
+void ServerManager::sendAccessEvent(const char *lockerId, const char *nfcCode, const char *decision, int reader,
+                                    const char *credential)
+{
+  if (!isConfigured || !isOnline())
+    return;
+
+  StaticJsonDocument<MEDIUM_JSON_SIZE> doc;
+  AccessEventMessage event;
+  event.moduleId = moduleId.c_str();
+  event.lockerId = lockerId;
+  event.nfcCode = nfcCode;
+  event.decision = decision;
+  event.timestamp = clockMillis();
+  event.reader = reader;
+  event.credential = credential;
+  event.toJson(doc);
 
-  webSocket->send(message);
+  sendDocument(doc);
 }
 
 void ServerManager::sendPing()
 {
-  if (!isConfigured || !isConnected)
+  if (!isConfigured || !isOnline())
     return;
 
   StaticJsonDocument<SMALL_JSON_SIZE> doc;
-  doc["type"] = "ping";
-  doc["moduleId"] = moduleId;
+  PingMessage ping;
+  ping.moduleId = moduleId.c_str();
+  ping.toJson(doc);
 
-  String message;
-  message.reserve(100);
-  serializeJson(doc, message);
+  // One heartbeat covers every secondary that has pinged us recently
+  if (gateway && gateway->isGateway())
+    gateway->liveChannels(doc.createNestedArray("channels"));
 
-  webSocket->send(message);
+  sendDocument(doc);
+}
+
+void ServerManager::sendTelemetry()
+{
+  if (!isConnected)
+    return;
+
+  ScratchScope scope;
+  ScratchJsonDocument doc(TELEMETRY_JSON_SIZE);
+  TelemetryMessage report;
+  report.moduleId = moduleId.c_str();
+  report.firmware = FIRMWARE_VERSION;
+  report.uptime = clockMillis();
+  report.freeHeap = ESP.getFreeHeap();
+  report.minFreeHeap = ESP.getMinFreeHeap();
+  report.maxAllocHeap = ESP.getMaxAllocHeap(); // Largest free block; shrinks as the heap fragments
+  report.configVersion = hardware->getConfigVersion();
+  report.rulesVersion = accessRules->getVersion();
+  report.toJson(doc);
+
+  JsonObject authStats = doc.createNestedObject("auth");
+  authStats["verified"] = auth->getVerifiedCount();
+  authStats["rejected"] = auth->getRejectedCount();
+  authStats["lastVerifyUs"] = auth->getLastVerifyMicros();
+  authStats["maxVerifyUs"] = auth->getMaxVerifyMicros();
+
+  params->toJson(doc.createNestedObject("params"));
+
+  if (mesh)
+  {
+    JsonObject meshStats = doc.createNestedObject("mesh");
+    meshStats["relayed"] = mesh->getFramesRelayed();
+    meshStats["dropped"] = mesh->getFramesDropped();
+    meshStats["duplicates"] = mesh->getDuplicatesSeen();
+    meshStats["peersEvicted"] = mesh->getPeersEvicted();
+  }
+
+  if (bus && bus->isEnabled())
+  {
+    bus->toJson(doc.createNestedObject("bus"));
+  }
+
+  if (deflateAccepted)
+  {
+    compressor.toJson(doc.createNestedObject("deflate"));
+  }
+
+  JsonObject rxStats = doc.createNestedObject("rx");
+  rxStats["frames"] = rxFrames;
+  rxStats["bytes"] = rxBytes;
+  rxStats["totalUs"] = rxParseMicros;
+  rxStats["maxUs"] = rxMaxParseMicros;
+  rxStats["maxPoolBytes"] = rxMaxPoolBytes;
+
+  sendQueue.toJson(doc.createNestedObject("sendQueue"));
+
+  JsonObject bulkStats = doc.createNestedObject("bulk");
+  bulkStats["connected"] = bulkConnected;
+  bulkStats["framesIn"] = bulkFramesIn;
+  bulkStats["bytesIn"] = bulkBytesIn;
+
+  JsonObject scratchStats = doc.createNestedObject("scratch");
+  scratchStats["highWater"] = scratchArena.getHighWater();
+  scratchStats["failures"] = scratchArena.getFailures();
+
+  hardware->nfcToJson(doc.createNestedObject("nfc"));
+  phone->toJson(doc.createNestedObject("phone"));
+  cardAuth->toJson(doc.createNestedObject("card"));
+  heapMonitor.toJson(doc.createNestedObject("heap"));
+  watchdog.toJson(doc.createNestedObject("watchdog"));
+
+  if (gateway && gateway->isGateway())
+  {
+    JsonObject gatewayStats = doc.createNestedObject("gateway");
+    gatewayStats["muxed"] = gateway->getFramesMuxed();
+    gatewayStats["pingsAbsorbed"] = gateway->getPingsAbsorbed();
+  }
+
+  // A full pool silently drops the sections added last; say so rather than
+  // report them as absent
+  if (doc.overflowed())
+    Serial.println(F("Telemetry document full, report truncated"));
+
+  size_t length = measureJson(doc);
+  if (length > SEND_TELEMETRY_SLOT_SIZE)
+  {
+    Serial.print(F("Telemetry too large for its slot: "));
+    Serial.println(length);
+    return;
+  }
+
+  sendDocument(doc, LANE_TELEMETRY);
 }
 
 void ServerManager::handleModuleConfiguration(const JsonDocument &doc)
 {
-  String configModuleId = doc["moduleId"];
-  JsonArrayConst lockerArray = doc["lockerIds"];
+  // The first provisioning is taken as is; once any key is held, a new
+  // configuration (and with it new keys) must be signed with the current one
+  if ((auth->isProvisioned() || phone->isProvisioned() || cardAuth->isProvisioned()) &&
+      !authorizeFrame(doc, true))
+    return;
 
-  String *lockerIds = new String[lockerArray.size()];
-  for (size_t i = 0; i < lockerArray.size(); i++)
+  ModuleConfiguredMessage config(doc);
+  const char *configModuleId = config.moduleId;
+
+  // Views into the receive buffer; only the NVS write copies them
+  const char *lockerIds[MAX_LOCKERS];
+  int count = 0;
+  for (JsonVariantConst lockerId : config.lockerIds)
   {
-    lockerIds[i] = lockerArray[i].as<String>();
+    if (count >= MAX_LOCKERS)
+      break;
+    lockerIds[count++] = lockerId | "";
   }
 
-  hardware->saveLockerConfiguration(configModuleId, lockerIds, lockerArray.size());
+  if (!configModuleId || !hardware->saveLockerConfiguration(configModuleId, lockerIds, count, config.configVersion))
+  {
+    sendCommandRejected(nullptr, "bad_config", ModuleConfiguredMessage::TYPE);
+    return;
+  }
+
+  // Compiled rules refer to locker slots, which a full reconfiguration reassigns
+  accessRules->clear();
 
-  delete[] lockerIds;
+  // Per-module command signing key, if the server issued one
+  if (config.authKey)
+  {
+    auth->saveKey(config.authKey);
+  }
+
+  // Site key for phone credentials, if the site uses them
+  if (config.phoneKey)
+  {
+    phone->saveKey(config.phoneKey);
+  }
+
+  // Master key secure cards' keys are diversified from
+  if (config.cardKey)
+  {
+    cardAuth->saveKey(config.cardKey);
+  }
 
   Serial.print(F("Module configured: "));
   Serial.println(configModuleId);
   hardware->updateLCD(F("Configured!"), F("Restarting..."));
 
-  delay(2000);
+  clockDelay(2000);
   ESP.restart();
-}
\ No newline at end of file
+}
+
+bool ServerManager::isOnline() const
+{
+  return isConnected || (gateway && gateway->isSecondary()) || (mesh && mesh->hasRoute());
+}
+
+// Outbound documents are serialized into the scratch arena, never a String
+bool ServerManager::sendDocument(const JsonDocument &doc, SendLane lane)
+{
+  ScratchScope scope;
+  char *message;
+  size_t length;
+  {
+    PerfProbe probe(PERF_ENCODE);
+    length = measureJson(doc);
+    message = scratchArena.allocateText(length);
+    if (message)
+      serializeJson(doc, message, length + 1);
+  }
+
+  if (!message)
+  {
+    Serial.println(F("Scratch arena full, frame dropped"));
+    return false;
+  }
+  return sendFrame(message, length, lane);
+}
+
+// Frames carrying another module's traffic go onto our own socket's control
+// lane as plain text: no compression, no tracing and no secondary or mesh
+// route, as they did before the queue existed
+bool ServerManager::sendRelayed(const JsonDocument &doc)
+{
+  if (!isConnected)
+    return false;
+
+  ScratchScope scope;
+  size_t length = measureJson(doc);
+  char *message = scratchArena.allocateText(length);
+  if (!message)
+  {
+    Serial.println(F("Scratch arena full, frame dropped"));
+    return false;
+  }
+  serializeJson(doc, message, length + 1);
+  return sendQueue.enqueue(LANE_CONTROL, message, length, false);
+}
+
+// Event frames go over our own socket when we have one, otherwise to the
+// neighbor with the shortest path to a module that does. Socket frames are
+// queued and written by the loop's pump.
+bool ServerManager::sendFrame(const char *message, size_t length, SendLane lane)
+{
+  traceRecorder.record("tx", message, length);
+  if (gateway && gateway->isSecondary())
+    return gateway->sendUpstream(message, length);
+  if (isConnected)
+    return sendQueue.enqueue(lane, message, length);
+  if (mesh)
+    return mesh->sendUplink(message, length);
+  return false;
+}
+
+// Bulk frames take the transfer socket when it is open
+bool ServerManager::transmitFrame(SendLane lane, const char *message, size_t length, bool compress)
+{
+  if (!isConnected)
+    return false;
+
+  WebsocketsClient *socket = lane == LANE_BULK && bulkConnected ? bulkSocket : webSocket;
+
+  if (compress && deflateAccepted && length >= DEFLATE_THRESHOLD)
+  {
+    ScratchScope scope;
+    uint8_t *packed = (uint8_t *)scratchArena.allocate(length);
+    size_t packedLength = 0;
+    if (packed)
+    {
+      memcpy(packed, DEFLATE_MAGIC, DEFLATE_MAGIC_SIZE);
+      packedLength = compressor.deflate(message, length, packed + DEFLATE_MAGIC_SIZE, length - DEFLATE_MAGIC_SIZE);
+    }
+    if (packedLength > 0)
+      return socket->sendBinary((const char *)packed, packedLength + DEFLATE_MAGIC_SIZE);
+  }
+  return socket->send(message, length);
+}
+
+void ServerManager::relayUplink(const uint8_t *origin, uint8_t hops, const char *payload)
+{
+  // Neighbors' traffic yields to our own once the control lane backs up
+  if (!isConnected || sendQueue.isBackedUp(LANE_CONTROL))
+    return;
+
+  char from[13];
+  MeshManager::formatMac(origin, from);
+
+  StaticJsonDocument<SMALL_JSON_SIZE> doc;
+  RelayUpMessage relay;
+  relay.from = from;
+  relay.via = macAddress.c_str();
+  relay.hops = hops;
+  relay.payload = payload;
+  relay.toJson(doc);
+
+  sendRelayed(doc);
+}
+
+// { "type": "relay", "to": "A1B2C3D4E5F6", "payload": { "type": "unlock", ... } }
+void ServerManager::handleRelay(const JsonDocument &doc)
+{
+  RelayDownMessage relay(doc);
+  uint8_t destination[6];
+  if (!mesh || !MeshManager::parseMac(relay.to, destination))
+    return;
+
+  char payload[MESH_MAX_PAYLOAD + 1];
+  if (measureJson(relay.payload) > MESH_MAX_PAYLOAD)
+  {
+    Serial.println(F("Relay payload too large for mesh"));
+    return;
+  }
+
+  size_t length = serializeJson(relay.payload, payload, sizeof(payload));
+  mesh->sendDownlink(destination, payload, length);
+}
+
+void ServerManager::relayMux(uint8_t channel, const char *payload)
+{
+  // Shed like relayed mesh frames
+  if (!isConnected || sendQueue.isBackedUp(LANE_CONTROL))
+    return;
+
+  StaticJsonDocument<SMALL_JSON_SIZE> doc;
+  MuxUpMessage up;
+  up.ch = channel;
+  up.payload = payload;
+  up.toJson(doc);
+
+  sendRelayed(doc);
+}
+
+void ServerManager::sendMuxAttach(uint8_t channel, const uint8_t *mac)
+{
+  if (!isConnected)
+    return;
+
+  char macHex[13];
+  MeshManager::formatMac(mac, macHex);
+
+  StaticJsonDocument<SMALL_JSON_SIZE> doc;
+  MuxAttachMessage attach;
+  attach.moduleId = moduleId.c_str();
+  attach.ch = channel;
+  attach.mac = macHex;
+  attach.toJson(doc);
+
+  sendRelayed(doc);
+}
+
+// { "type": "mux", "ch": 2, "payload": { "type": "unlock", ... } }
+void ServerManager::handleMux(const JsonDocument &doc)
+{
+  if (!gateway || !gateway->isGateway())
+    return;
+
+  MuxDownMessage mux(doc);
+  char payload[MESH_MAX_PAYLOAD + 1];
+  if (measureJson(mux.payload) > MESH_MAX_PAYLOAD)
+  {
+    Serial.println(F("Mux payload too large for ESP-NOW"));
+    return;
+  }
+
+  size_t length = serializeJson(mux.payload, payload, sizeof(payload));
+  if (!gateway->sendDownstream(mux.ch, payload, length))
+  {
+    Serial.print(F("Mux: no secondary on channel "));
+    Serial.println(mux.ch);
+  }
+}
+
+void ServerManager::handleSetRole(const JsonDocument &doc)
+{
+  if (!authorizeFrame(doc, false))
+    return;
+
+  SetRoleMessage request(doc);
+  if (!gateway || !gateway->setRole(request.role, request.gateway))
+  {
+    sendConfigAck(false, "bad_role");
+    return;
+  }
+
+  Serial.print(F("Role set to "));
+  Serial.println(request.role);
+  hardware->updateLCD(F("Role changed"), F("Restarting..."));
+
+  clockDelay(2000);
+  ESP.restart();
+}
+
+// { "type": "bus_configure", "version": 4, "doors": [["B01", 1, 0], ...] }
+void ServerManager::handleBusConfigure(const JsonDocument &doc)
+{
+  if (!authorizeFrame(doc, false))
+    return;
+
+  bool applied = bus && bus->configure(doc);
+
+  StaticJsonDocument<SMALL_JSON_SIZE> reply;
+  BusConfiguredMessage result;
+  result.moduleId = moduleId.c_str();
+  result.success = applied;
+  result.hasVersion = result.hasDoors = bus != nullptr;
+  if (bus)
+  {
+    result.version = bus->getVersion();
+    result.doors = bus->getDoorCount();
+  }
+  result.toJson(reply);
+
+  sendDocument(reply);
+}
+
+// The report is sent before any reset, so one query both reads and restarts
+// a measurement window
+void ServerManager::sendPerfReport(bool reset)
+{
+  // A dump is bulk traffic: it must not displace a queued telemetry report
+  if (sendQueue.isBackedUp(LANE_BULK))
+  {
+    Serial.println(F("Bulk lane busy, perf_report skipped"));
+    return;
+  }
+
+  ScratchScope scope;
+  ScratchJsonDocument doc(LARGE_JSON_SIZE * 2);
+  PerfReportMessage report;
+  report.moduleId = moduleId.c_str();
+  report.uptime = clockMillis();
+  report.toJson(doc);
+  perfCounters.toJson(doc.createNestedArray("sites"), doc.createNestedArray("dispatch"));
+  sendDocument(doc, LANE_BULK);
+
+  if (reset)
+    perfCounters.reset();
+}
+
+// Watchdog recovery for a slow or wedged connection: the close handler
+// resets state and the loop reconnects on its usual schedule. Without a WiFi
+// link there is nothing to reconnect over, so that counts as a failed
+// recovery and repeated ones escalate to a restart.
+bool ServerManager::dropConnection()
+{
+  if (isConnected)
+    webSocket->close();
+  closeBulk();
+  return WiFi.status() == WL_CONNECTED;
+}
@@ -4,43 +4,149 @@
 #include <ArduinoWebsockets.h>
 #include <ArduinoJson.h>
 #include "config.h"
+#include "command_auth.h"
+#include "frame_compression.h"
+#include "fixed_string.h"
+#include "send_queue.h"
 
 // Forward declaration to avoid circular dependency
 class HardwareManager;
+class PhoneCredentials;
+class CardAuthenticator;
+class AccessRules;
+class RuntimeParams;
+class OtaManager;
+class MeshManager;
+class GatewayManager;
+class BusManager;
 
 using namespace websockets;
 
+// Where an inbound frame came from. Only the server's own socket may carry
+// unsigned commands, and only to a module that holds no key.
+enum FrameSource : uint8_t
+{
+  SOURCE_SERVER,
+  SOURCE_MESH,   // Mesh downlink: a few command types, always signed
+  SOURCE_GATEWAY // A secondary's gateway: any type, commands always signed
+};
+
+// Progress of the bulk socket's connect task
+enum BulkConnect : uint8_t
+{
+  BULK_CONNECT_IDLE,
+  BULK_CONNECT_RUNNING,
+  BULK_CONNECT_OPENED,
+  BULK_CONNECT_FAILED
+};
+
 class ServerManager
 {
 private:
   WebsocketsClient *webSocket;
+  WebsocketsClient *bulkSocket; // Transfers; keeps commands off a busy stream
   HardwareManager *hardware;
-  String moduleId;
-  String macAddress;
+  CommandAuthenticator *auth;
+  PhoneCredentials *phone;
+  CardAuthenticator *cardAuth;
+  AccessRules *accessRules;
+  RuntimeParams *params;
+  OtaManager *ota;
+  MeshManager *mesh;
+  GatewayManager *gateway;
+  BusManager *bus;
+  FixedString<MODULE_ID_SIZE> moduleId;
+  FixedString<MAC_STRING_SIZE> macAddress;
+  String serverHost; // "ws://host:port"; built once, the client library takes a String
   String serverURL;
+  FixedString<32> bulkPath; // Offered by the server at registration; empty = none
   bool isConnected;
   bool isConfigured;
+  bool isRegistered;
+  bool deflateAccepted;
+  bool bulkConnected;
+  volatile BulkConnect bulkConnect; // Written by the connect task, read by loop()
+  String bulkUrl;
+  unsigned long bulkBackoff; // Grows with each failed attempt; 0 = the reconnect interval
+  FrameCompressor compressor;
+  SendQueue sendQueue;
+  StaticJsonDocument<MEDIUM_JSON_SIZE> inboundFilter;
+  CommandAuthenticator::Result frameAuth; // Whole-frame signature of the message being dispatched
+  FrameSource frameSource;
+
+  // Receive path counters for telemetry
+  uint32_t rxFrames;
+  uint32_t rxBytes;
+  uint32_t rxParseMicros;
+  uint32_t rxMaxParseMicros;
+  uint32_t rxMaxPoolBytes;
+  uint32_t bulkFramesIn;
+  uint32_t bulkBytesIn;
 
   unsigned long lastPing;
   unsigned long lastReconnectAttempt;
+  unsigned long lastBulkAttempt;
   unsigned long lastAvailableBroadcast;
+  unsigned long lastTelemetry;
 
-  void handleMessage(const String &message);
+  void handleSocketMessage(WebsocketsMessage &message);
+  void handleMessage(char *json, size_t length, FrameSource source = SOURCE_SERVER);
+  void handleBinaryMessage(const WSString &data);
+  void recordParse(unsigned long start, size_t length, size_t poolBytes);
+  void dispatchMessage(const JsonDocument &doc);
+  static bool isAcceptedFrom(FrameSource source, const char *type);
+  bool authorizeFrame(const JsonDocument &doc, bool required);
+  void handleAccessRules(const JsonDocument &doc);
+  void handleConfigPatch(const JsonDocument &doc);
+  void sendConfigAck(bool success, const char *error);
+  void handleSetParams(const JsonDocument &doc);
+  void handleOtaBegin(const JsonDocument &doc);
+  void handleOtaServe(const JsonDocument &doc);
+  void handleOtaAbort(const JsonDocument &doc);
+  void sendOtaServing(bool serving);
+  void handleOtaProgress(int result);
+  void sendOtaStatus();
   void handleModuleConfiguration(const JsonDocument &doc);
   void handleLockUnlockCommand(const JsonDocument &doc);
   bool reconnect();
+  void reconnectBulk(unsigned long currentTime);
+  static void bulkConnectEntry(void *arg);
+  void closeBulk();
+  void sendBulkAttach();
   void sendAvailableModuleBroadcast();
+  void sendCommandRejected(const char *lockerId, const char *reason, const char *command = nullptr);
+  bool sendDocument(const JsonDocument &doc, SendLane lane = LANE_CONTROL);
+  bool sendFrame(const char *message, size_t length, SendLane lane = LANE_CONTROL);
+  bool transmitFrame(SendLane lane, const char *message, size_t length, bool compress);
+  bool sendRelayed(const JsonDocument &doc);
+  bool isOnline() const;
+  void relayUplink(const uint8_t *origin, uint8_t hops, const char *payload);
+  void handleRelay(const JsonDocument &doc);
+  void relayMux(uint8_t channel, const char *payload);
+  void sendMuxAttach(uint8_t channel, const uint8_t *mac);
+  void handleMux(const JsonDocument &doc);
+  void handleSetRole(const JsonDocument &doc);
+  void handleBusConfigure(const JsonDocument &doc);
+  void sendPerfReport(bool reset);
+  void secondaryLoop(unsigned long currentTime);
 
 public:
-  ServerManager(HardwareManager *hw, const String &mac);
+  ServerManager(HardwareManager *hw, CommandAuthenticator *authenticator, PhoneCredentials *phoneCredentials,
+                CardAuthenticator *cardAuthenticator, AccessRules *rules, RuntimeParams *runtimeParams,
+                OtaManager *otaManager, MeshManager *meshManager, GatewayManager *gatewayManager,
+                BusManager *busManager, const char *mac);
   ~ServerManager();
 
   bool initialize(const String &serverIP, int serverPort);
   void loop();
 
   void registerModule();
-  void sendStatusUpdate(const String &lockerId, const String &status);
+  void sendStatusUpdate(const char *lockerId, const char *status);
   void sendPing();
+  void sendTelemetry();
+  void sendAccessEvent(const char *lockerId, const char *nfcCode, const char *decision, int reader,
+                       const char *credential);
+  bool dropConnection();
 
   bool getConnectionStatus() const { return isConnected; }
   bool getConfigurationStatus() const { return isConfigured; }
@@ -0,0 +1,321 @@
+#!/usr/bin/env python3
+"""Reference and emulated card for NexLock secure-card authentication.
+
+  python3 tools/desfire_card.py derive MASTER_KEY UID
+  python3 tools/desfire_card.py selftest [--taps 200]
+  python3 tools/desfire_card.py budget [--i2c-khz 100] [--card-ms 5] [--cached]
+
+derive prints the AES-128 key to write into a card's NexLock application
+(key CARD_KEY_NO). It is diversified from the site master key as in NXP
+AN10922, with the UID, the AID and the system id "NexLock".
+
+selftest checks the diversification against the AN10922 example. It then
+authenticates against an emulated DESFire EV1 card for a number of taps, one
+tap with a wrong key and one against a card without the application. The
+APDUs and the crypto steps are the ones the module uses.
+
+budget models one authenticated tap behind the module's I2C bus: three
+exchanges with their real sizes, plus the AES work, which is smaller when the
+card's key is cached. The module measures the real figure in telemetry.card
+and the cardAuth perf_report site.
+
+No dependencies; AES is implemented below.
+"""
+
+import argparse
+import os
+import sys
+import time
+
+AID = 0x4B584E  # "NXK"; sent least significant byte first
+KEY_NO = 1
+SYSTEM_ID = b"NexLock"
+BUDGET_MS = 150
+
+# Fixed costs, in ms
+ACK_MS = 1.0        # Reader accepts a command
+POLL_MS = 1.0       # Status byte polling interval on the module
+RF_BYTE_MS = 0.085  # ISO 14443 at 106 kbit/s, with parity
+RF_FRAME_BYTES = 3  # PCB and CRC around each I-block
+DERIVE_MS = 0.05    # Three AES blocks on the ESP32 accelerator, on a cache miss
+AES_MS = 0.05       # The four blocks of the authentication itself
+
+
+# AES-128, straight from FIPS-197; slow but self-contained
+def _sbox():
+    box, inverse = [0] * 256, [0] * 256
+    p = q = 1
+    while True:
+        p = p ^ ((p << 1) & 0xFF) ^ (0x1B if p & 0x80 else 0)
+        q ^= q << 1
+        q ^= q << 2
+        q ^= q << 4
+        q &= 0xFF
+        if q & 0x80:
+            q ^= 0x09
+        x = q ^ (q << 1 | q >> 7) ^ (q << 2 | q >> 6) ^ (q << 3 | q >> 5) ^ (q << 4 | q >> 4)
+        x = (x ^ 0x63) & 0xFF
+        box[p] = x
+        inverse[x] = p
+        if p == 1:
+            break
+    box[0] = 0x63
+    inverse[0x63] = 0
+    return box, inverse
+
+
+SBOX, INV_SBOX = _sbox()
+
+
+def _xtime(a):
+    return ((a << 1) ^ 0x1B) & 0xFF if a & 0x80 else a << 1
+
+
+def _mul(a, b):
+    result = 0
+    while b:
+        if b & 1:
+            result ^= a
+        a = _xtime(a)
+        b >>= 1
+    return result
+
+
+class AES128:
+    def __init__(self, key):
+        words = [list(key[i:i + 4]) for i in range(0, 16, 4)]
+        rcon = 1
+        for i in range(4, 44):
+            word = list(words[i - 1])
+            if i % 4 == 0:
+                word = [SBOX[b] for b in word[1:] + word[:1]]
+                word[0] ^= rcon
+                rcon = _xtime(rcon)
+            words.append([a ^ b for a, b in zip(words[i - 4], word)])
+        self.rounds = [sum(words[r * 4:r * 4 + 4], []) for r in range(11)]
+
+    @staticmethod
+    def _shift(state, inverse):
+        out = [0] * 16
+        for c in range(4):
+            for r in range(4):
+                source = (c - r) % 4 if inverse else (c + r) % 4
+                out[c * 4 + r] = state[source * 4 + r]
+        return out
+
+    @staticmethod
+    def _mix(state, matrix):
+        out = []
+        for c in range(4):
+            column = state[c * 4:c * 4 + 4]
+            for r in range(4):
+                value = 0
+                for k in range(4):
+                    value ^= _mul(column[k], matrix[(k - r) % 4])
+                out.append(value)
+        return out
+
+    def encrypt(self, block):
+        state = [a ^ b for a, b in zip(block, self.rounds[0])]
+        for r in range(1, 11):
+            state = self._shift([SBOX[b] for b in state], False)
+            if r < 10:
+                state = self._mix(state, (2, 3, 1, 1))
+            state = [a ^ b for a, b in zip(state, self.rounds[r])]
+        return bytes(state)
+
+    def decrypt(self, block):
+        state = [a ^ b for a, b in zip(block, self.rounds[10])]
+        for r in range(9, -1, -1):
+            state = [INV_SBOX[b] for b in self._shift(state, True)]
+            state = [a ^ b for a, b in zip(state, self.rounds[r])]
+            if r > 0:
+                state = self._mix(state, (14, 11, 13, 9))
+        return bytes(state)
+
+    def cbc_encrypt(self, iv, data):
+        out = b""
+        for i in range(0, len(data), 16):
+            iv = self.encrypt(bytes(a ^ b for a, b in zip(data[i:i + 16], iv)))
+            out += iv
+        return out
+
+    def cbc_decrypt(self, iv, data):
+        out = b""
+        for i in range(0, len(data), 16):
+            block = data[i:i + 16]
+            out += bytes(a ^ b for a, b in zip(self.decrypt(block), iv))
+            iv = block
+        return out
+
+
+def _shift_left(block):
+    value = int.from_bytes(block, "big") << 1
+    if block[0] & 0x80:
+        value ^= 0x87
+    return (value & ((1 << 128) - 1)).to_bytes(16, "big")
+
+
+def diversify(master, data):
+    """AN10922 AES-128: CMAC of 01 || data, always padded to two blocks."""
+    aes = AES128(master)
+    k1 = _shift_left(aes.encrypt(bytes(16)))
+    k2 = _shift_left(k1)
+    message = b"\x01" + data
+    subkey = k1
+    if len(message) < 32:
+        message += b"\x80" + bytes(31 - len(message))
+        subkey = k2
+    message = message[:16] + bytes(a ^ b for a, b in zip(message[16:], subkey))
+    return aes.cbc_encrypt(bytes(16), message)[16:]
+
+
+def aid_bytes(aid):
+    return bytes([aid & 0xFF, (aid >> 8) & 0xFF, (aid >> 16) & 0xFF])
+
+
+def card_key(master, uid):
+    return diversify(master, uid + aid_bytes(AID) + SYSTEM_ID)
+
+
+def rotate(block):
+    return block[1:] + block[:1]
+
+
+class EmulatedCard:
+    """DESFire EV1 with one AES application, answering wrapped native APDUs."""
+
+    def __init__(self, uid, key, aid=AID):
+        self.uid, self.aid, self.key = uid, aid, key
+        self.selected = False
+        self.step = None
+
+    def transceive(self, apdu):
+        command, data = apdu[1], apdu[5:5 + apdu[4]] if len(apdu) > 5 else b""
+        if command == 0x5A:
+            self.selected = data == aid_bytes(self.aid)
+            return b"\x91\x00" if self.selected else b"\x91\xA0"
+        if command == 0xAA and self.selected and data == bytes([KEY_NO]):
+            self.rnd_b = os.urandom(16)
+            self.iv = AES128(self.key).cbc_encrypt(bytes(16), self.rnd_b)
+            self.step = 1
+            return self.iv + b"\x91\xAF"
+        if command == 0xAF and self.step == 1:
+            self.step = None
+            aes = AES128(self.key)
+            plain = aes.cbc_decrypt(self.iv, data)
+            if plain[16:] != rotate(self.rnd_b):
+                return b"\x91\xAE"
+            return aes.cbc_encrypt(data[16:], rotate(plain[:16])) + b"\x91\x00"
+        return b"\x91\x1C"
+
+
+def authenticate(transceive, master, uid, cache):
+    """The module's side: SelectApplication, then both AuthenticateAES steps."""
+    response = transceive(bytes([0x90, 0x5A, 0x00, 0x00, 0x03]) + aid_bytes(AID) + b"\x00")
+    if response[-2:] != b"\x91\x00":
+        return "no_app"
+
+    key = cache.get(uid)
+    if key is None:
+        key = cache[uid] = card_key(master, uid)
+    aes = AES128(key)
+
+    response = transceive(bytes([0x90, 0xAA, 0x00, 0x00, 0x01, KEY_NO, 0x00]))
+    if len(response) != 18 or response[-2:] != b"\x91\xAF":
+        return "bad_response"
+    rnd_b = aes.cbc_decrypt(bytes(16), response[:16])
+
+    rnd_a = os.urandom(16)
+    token = aes.cbc_encrypt(response[:16], rnd_a + rotate(rnd_b))
+    response = transceive(bytes([0x90, 0xAF, 0x00, 0x00, 0x20]) + token + b"\x00")
+    if len(response) != 18 or response[-2:] != b"\x91\x00":
+        return "auth_failed"
+    if aes.cbc_decrypt(token[16:], response[:16]) != rotate(rnd_a):
+        return "auth_failed"
+    return "ok"
+
+
+def selftest(args):
+    # AN10922 section 2.2.1: AES-128 diversification example
+    master = bytes.fromhex("00112233445566778899AABBCCDDEEFF")
+    expected = bytes.fromhex("A8DD63A3B89D54B37CA802473FDA9175")
+    got = diversify(master, bytes.fromhex("04782E21801D803042F54E585020416275"))
+    print("AN10922 vector     %s" % ("ok" if got == expected else "FAILED " + got.hex().upper()))
+    failed = got != expected
+
+    master = os.urandom(16)
+    cache = {}
+    start = time.perf_counter()
+    results = {}
+    for i in range(args.taps):
+        uid = bytes([0x04]) + (i % 8).to_bytes(6, "big")  # Eight cards, so the cache is exercised
+        card = EmulatedCard(uid, card_key(master, uid))
+        result = authenticate(card.transceive, master, uid, cache)
+        results[result] = results.get(result, 0) + 1
+    elapsed = (time.perf_counter() - start) * 1000 / args.taps
+    print("emulated taps      %s (%.1f ms each in Python)" % (results, elapsed))
+    failed = failed or results != {"ok": args.taps}
+
+    uid = bytes.fromhex("04010203040506")
+    wrong = authenticate(EmulatedCard(uid, os.urandom(16)).transceive, master, uid, {})
+    other = authenticate(EmulatedCard(uid, card_key(master, uid), aid=0x010203).transceive, master, uid, {})
+    print("wrong key          %s" % wrong)
+    print("no application     %s" % other)
+    failed = failed or wrong != "auth_failed" or other != "no_app"
+    return 1 if failed else 0
+
+
+def budget(args):
+    byte_ms = 9.0 / args.i2c_khz  # 8 data bits and an ACK per byte
+
+    def exchange(name, command, response):
+        # InDataExchange frame: 00 00 FF LEN LCS D4 40 Tg data DCS 00, plus the address byte
+        write = (command + 11) * byte_ms
+        ack = ACK_MS + 8 * byte_ms
+        rf = (command + response + 2 * RF_FRAME_BYTES) * RF_BYTE_MS + args.card_ms
+        wait = POLL_MS / 2 + 2 * byte_ms
+        read = (response + 1 + 11) * byte_ms
+        return (name, write + ack + rf + wait + read)
+
+    rows = [("target read", (40 + 11) * byte_ms),
+            exchange("SelectApplication", 9, 2),
+            exchange("AuthenticateAES", 7, 18),
+            exchange("AuthenticateAES AF", 38, 18),
+            ("key derivation", 0.0 if args.cached else DERIVE_MS),
+            ("AES, 4 blocks", AES_MS)]
+
+    total = sum(ms for _, ms in rows)
+    for name, ms in rows:
+        print("%-20s %7.2f ms" % (name, ms))
+    print("%-20s %7.2f ms of %d" % ("tap to decision", total, BUDGET_MS))
+    return 0 if total <= BUDGET_MS else 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    derive = commands.add_parser("derive", help="Print a card's diversified key")
+    derive.add_argument("master_key")
+    derive.add_argument("uid")
+
+    test = commands.add_parser("selftest", help="Check against AN10922 and an emulated card")
+    test.add_argument("--taps", type=int, default=200)
+
+    model = commands.add_parser("budget", help="Model tap-to-decision time")
+    model.add_argument("--i2c-khz", type=float, default=100.0, help="Reader bus clock; the LCD limits it to 100")
+    model.add_argument("--card-ms", type=float, default=5.0, help="Card processing time per command")
+    model.add_argument("--cached", action="store_true", help="The card's key is already cached")
+
+    args = parser.parse_args()
+    if args.command == "derive":
+        print(card_key(bytes.fromhex(args.master_key), bytes.fromhex(args.uid)).hex().upper())
+    elif args.command == "selftest":
+        sys.exit(selftest(args))
+    else:
+        sys.exit(budget(args))
+
+
+if __name__ == "__main__":
+    main()
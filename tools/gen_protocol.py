@@ -0,0 +1,284 @@
+#!/usr/bin/env python3
+"""Generates protocol_messages.h and the README message reference from
+tools/protocol.json, so firmware codecs and docs come from one schema.
+
+Usage: python3 tools/gen_protocol.py [--check]
+"""
+
+import json
+import os
+import re
+import sys
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+SCHEMA = os.path.join(ROOT, "tools", "protocol.json")
+HEADER = os.path.join(ROOT, "protocol_messages.h")
+README = os.path.join(ROOT, "README.md")
+
+README_BEGIN = "<!-- protocol:begin -->"
+README_END = "<!-- protocol:end -->"
+
+# Schema type -> (member type, decode default, encode default)
+SCALARS = {
+    "string": ("const char *", '""', "nullptr"),
+    "uint": ("uint32_t", "0UL", "0"),
+    "int": ("int32_t", "0", "0"),
+    "bool": ("bool", "false", "false"),
+}
+VIEWS = {"array": "JsonArrayConst", "object": "JsonObjectConst", "json": "JsonVariantConst"}
+
+
+def types_of(message):
+    return message.get("types") or [message["type"]]
+
+
+def presence_flag(field):
+    """Optional numbers and flags have no null value, so a bool says whether to encode them."""
+    if field.get("optional") and field["type"] in ("uint", "int", "bool"):
+        return "has" + field["name"][0].upper() + field["name"][1:]
+    return None
+
+
+def comment(field, encoder):
+    notes = []
+    if field.get("doc"):
+        notes.append(field["doc"])
+    if field.get("optional") and field["type"] == "string":
+        notes.append("omitted when nullptr" if encoder else "nullptr when absent")
+    if encoder and presence_flag(field):
+        notes.append("omitted unless %s" % presence_flag(field))
+    return "; ".join(notes)
+
+
+def member_block(members):
+    """Declarations with their trailing comments aligned, as clang-format does."""
+    width = max(len(decl) for decl, note in members if note) if any(note for _, note in members) else 0
+    return ["  " + (decl.ljust(width) + " // " + note if note else decl) for decl, note in members]
+
+
+def declaration(ctype, name, default=None):
+    init = " = " + default if default else ""
+    return "%s%s%s%s;" % (ctype, "" if ctype.endswith("*") else " ", name, init)
+
+
+def type_constants(message):
+    types = types_of(message)
+    if len(types) == 1:
+        return ['  static constexpr const char *TYPE = "%s";' % types[0]]
+    return ['  static constexpr const char *%s = "%s";' % (t.upper(), t) for t in types]
+
+
+def emit_encoder(message):
+    lines = []
+    if message.get("doc"):
+        lines.append("// " + message["doc"])
+    lines.append("struct %sMessage" % message["name"])
+    lines.append("{")
+    lines += type_constants(message)
+
+    members = [f for f in message["fields"] if f["type"] in SCALARS or f["type"] == "raw"]
+    caller = [f["name"] for f in message["fields"] if f not in members]
+    block = []
+    for field in members:
+        if field["type"] == "raw":
+            block.append((declaration("const char *", field["name"], "nullptr"), "Serialized JSON, embedded as is"))
+        else:
+            ctype, _, default = SCALARS[field["type"]]
+            block.append((declaration(ctype, field["name"], default), comment(field, True)))
+    for field in members:
+        if presence_flag(field):
+            block.append((declaration("bool", presence_flag(field), "false"), ""))
+    lines += member_block(block)
+    if caller:
+        lines.append("  // Filled in by the caller after toJson: " + ", ".join(caller))
+
+    lines.append("")
+    lines.append("  %sMessage() {}" % message["name"])
+    lines.append("")
+    lines.append("  void toJson(JsonDocument &doc) const")
+    lines.append("  {")
+    lines.append('    doc["type"] = TYPE;')
+    for field in members:
+        value = "serialized(%s)" % field["name"] if field["type"] == "raw" else field["name"]
+        condition = field["name"] if field.get("optional") and field["type"] == "string" else presence_flag(field)
+        if condition:
+            lines.append("    if (%s)" % condition)
+            lines.append('      doc["%s"] = %s;' % (field["name"], value))
+        else:
+            lines.append('    doc["%s"] = %s;' % (field["name"], value))
+    lines.append("  }")
+    lines.append("};")
+    return lines
+
+
+def emit_decoder(message):
+    name = message["name"] + "Message"
+    lines = []
+    if message.get("doc"):
+        lines.append("// " + message["doc"])
+    lines.append("struct %s" % name)
+    lines.append("{")
+    lines += type_constants(message)
+
+    if not message["fields"]:
+        lines.append("};")
+        return lines
+
+    fields = list(message["fields"])
+    if len(types_of(message)) > 1:
+        fields.insert(0, {"name": "type", "type": "string"})
+
+    block = []
+    for field in fields:
+        ctype = VIEWS.get(field["type"]) or SCALARS[field["type"]][0]
+        block.append((declaration(ctype, field["name"]), comment(field, False)))
+    lines += member_block(block)
+
+    inits = []
+    for field in fields:
+        key = 'doc["%s"]' % field["name"]
+        if field["type"] in ("array", "object"):
+            inits.append("%s(%s.as<%s>())" % (field["name"], key, VIEWS[field["type"]]))
+        elif field["type"] == "json":
+            inits.append("%s(%s)" % (field["name"], key))
+        elif field["type"] == "string" and field.get("optional"):
+            inits.append("%s(%s.as<const char *>())" % (field["name"], key))
+        else:
+            inits.append("%s(%s | %s)" % (field["name"], key, SCALARS[field["type"]][1]))
+
+    lines.append("")
+    lines.append("  explicit %s(const JsonDocument &doc)" % name)
+    current = "      : "
+    for i, init in enumerate(inits):
+        piece = init + ("," if i < len(inits) - 1 else "")
+        if len(current) + len(piece) > 110 and current.strip() not in (":", ""):
+            lines.append(current.rstrip())
+            current = "        "
+        current += piece + " "
+    lines.append(current.rstrip())
+    lines.append("  {")
+    lines.append("  }")
+    lines.append("};")
+    return lines
+
+
+def inbound_keys(schema):
+    keys = ["type"]
+    for message in schema["down"]:
+        for field in message["fields"]:
+            if field["name"] not in keys:
+                keys.append(field["name"])
+    return keys
+
+
+def inbound_types(schema):
+    types = []
+    for message in schema["down"]:
+        types += [t for t in types_of(message) if t not in types]
+    return types
+
+
+def string_table(name, values):
+    lines = ["static const char *const %s[] = {" % name]
+    line = "   "
+    for value in values:
+        piece = ' "%s",' % value
+        if len(line) + len(piece) > 100:
+            lines.append(line)
+            line = "   "
+        line += piece
+    lines.append(line.rstrip(",") + "};")
+    return lines
+
+
+def generate_header(schema):
+    out = [
+        "// Generated by tools/gen_protocol.py from tools/protocol.json; do not edit.",
+        "// Change the schema and run: python3 tools/gen_protocol.py",
+        "#ifndef PROTOCOL_MESSAGES_H",
+        "#define PROTOCOL_MESSAGES_H",
+        "",
+        "#include <ArduinoJson.h>",
+        "",
+        "// Top-level fields of every server-to-module message; the parser skips",
+        "// everything else instead of spending document slots on it",
+    ]
+
+    out += string_table("PROTOCOL_INBOUND_KEYS", inbound_keys(schema))
+
+    out.append("")
+    out.append("// Every server-to-module message type, in schema order")
+    out += string_table("PROTOCOL_INBOUND_TYPES", inbound_types(schema))
+    out.append("static constexpr size_t PROTOCOL_INBOUND_TYPE_COUNT = sizeof(PROTOCOL_INBOUND_TYPES) / sizeof(const char *);")
+
+    out.append("")
+    out.append("// Module to server. Encoders are filled in field by field; their empty")
+    out.append("// constructors rule out positional brace initialization, which a schema")
+    out.append("// change would silently shift.")
+    for message in schema["up"]:
+        out.append("")
+        out += emit_encoder(message)
+
+    out.append("")
+    out.append("// Server to module. Decoders hold views into the parsed document and are")
+    out.append("// valid for as long as it is.")
+    for message in schema["down"]:
+        out.append("")
+        out += emit_decoder(message)
+
+    out.append("")
+    out.append("#endif")
+    return "\n".join(out) + "\n"
+
+
+def field_list(message):
+    parts = []
+    for field in message["fields"]:
+        parts.append("`%s%s`" % (field["name"], "?" if field.get("optional") else ""))
+    return ", ".join(parts) if parts else "-"
+
+
+def generate_readme_block(schema):
+    out = [README_BEGIN, ""]
+    out.append("Generated from `tools/protocol.json`; `?` marks optional fields.")
+    for title, direction in (("Module to server", "up"), ("Server to module", "down")):
+        out += ["", "#### " + title, "", "| Type | Fields | Notes |", "| --- | --- | --- |"]
+        for message in schema[direction]:
+            types = " / ".join("`%s`" % t for t in types_of(message))
+            out.append("| %s | %s | %s |" % (types, field_list(message), message.get("doc", "")))
+    out += ["", README_END]
+    return "\n".join(out)
+
+
+def main():
+    check = "--check" in sys.argv[1:]
+    with open(SCHEMA) as f:
+        schema = json.load(f)
+
+    header = generate_header(schema)
+    with open(README) as f:
+        readme = f.read()
+    pattern = re.compile(re.escape(README_BEGIN) + ".*?" + re.escape(README_END), re.S)
+    if not pattern.search(readme):
+        sys.exit("README.md has no %s ... %s block" % (README_BEGIN, README_END))
+    readme = pattern.sub(lambda _: generate_readme_block(schema), readme)
+
+    outputs = {HEADER: header, README: readme}
+    stale = []
+    for path, content in outputs.items():
+        current = open(path).read() if os.path.exists(path) else None
+        if current == content:
+            continue
+        stale.append(os.path.relpath(path, ROOT))
+        if not check:
+            with open(path, "w") as f:
+                f.write(content)
+
+    if check and stale:
+        sys.exit("Out of date: " + ", ".join(stale))
+    for path in stale:
+        print("Wrote " + path)
+
+
+if __name__ == "__main__":
+    main()
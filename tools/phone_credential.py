@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+"""Reference for the phone side of the NexLock credential exchange.
+
+  python3 tools/phone_credential.py respond SITE_KEY CREDENTIAL_ID CHALLENGE
+  python3 tools/phone_credential.py budget [--i2c-khz 100] [--phone-ms 20]
+
+respond prints the key a phone is issued for a credential id and its answer
+to a challenge APDU, so an app implementation can be checked against the
+module. Arguments are hex: a 32-byte site key, a 7-byte credential id and a
+16-byte challenge.
+
+budget models one tap on a PN532 behind the module's I2C bus. It covers the
+target read, SELECT and challenge exchanges with the real APDU sizes, the
+reader's ACK and status polling, the RF frames and the phone's processing
+time. It compares the total with the 150 ms tap budget. The module measures
+the real figure in telemetry.phone and the phoneExchange perf_report site.
+"""
+
+import argparse
+import hashlib
+import hmac
+import sys
+
+AID = bytes.fromhex("F04E584C4B01")
+CREDENTIAL_SIZE = 7
+CHALLENGE_SIZE = 16
+MAC_SIZE = 16
+BUDGET_MS = 150
+
+# Fixed costs, in ms
+ACK_MS = 1.0        # Reader accepts a command
+POLL_MS = 1.0       # Status byte polling interval on the module
+VERIFY_MS = 0.3     # Two HMAC-SHA256 on the ESP32 SHA accelerator
+RF_BYTE_MS = 0.085  # ISO 14443 at 106 kbit/s, with parity
+RF_FRAME_BYTES = 3  # PCB and CRC around each I-block
+
+
+def credential_key(site_key, credential_id):
+    return hmac.new(site_key, credential_id, hashlib.sha256).digest()
+
+
+def respond(args):
+    site_key = bytes.fromhex(args.site_key)
+    credential_id = bytes.fromhex(args.credential_id)
+    challenge = bytes.fromhex(args.challenge)
+    if len(site_key) != 32 or len(credential_id) != CREDENTIAL_SIZE or len(challenge) != CHALLENGE_SIZE:
+        sys.exit("Expected a 32-byte site key, a %d-byte credential id and a %d-byte challenge"
+                 % (CREDENTIAL_SIZE, CHALLENGE_SIZE))
+
+    key = credential_key(site_key, credential_id)
+    mac = hmac.new(key, challenge, hashlib.sha256).digest()[:MAC_SIZE]
+    select = bytes([0x00, 0xA4, 0x04, 0x00, len(AID)]) + AID + b"\x00"
+    command = bytes([0x80, 0x10, 0x00, 0x00, CHALLENGE_SIZE]) + challenge + b"\x00"
+
+    print("credential key  %s" % key.hex().upper())
+    print("SELECT          %s -> 9000" % select.hex().upper())
+    print("challenge APDU  %s" % command.hex().upper())
+    print("response        %s" % (credential_id + mac + b"\x90\x00").hex().upper())
+
+
+def budget(args):
+    byte_ms = 9.0 / args.i2c_khz  # 8 data bits and an ACK per byte
+
+    def exchange(name, command, response, phone_ms):
+        # InDataExchange frame: 00 00 FF LEN LCS D4 40 Tg data DCS 00, plus the address byte
+        write = (len(command) + 11) * byte_ms
+        ack = ACK_MS + 8 * byte_ms
+        rf = (len(command) + len(response) + 2 * RF_FRAME_BYTES) * RF_BYTE_MS
+        wait = POLL_MS / 2 + 2 * byte_ms
+        read = (len(response) + 1 + 11) * byte_ms
+        return [(name + " write", write), (name + " ACK", ack), (name + " RF", rf),
+                (name + " phone", phone_ms), (name + " poll", wait), (name + " read", read)]
+
+    select = bytes(5) + AID + bytes(1)
+    challenge = bytes(5 + CHALLENGE_SIZE + 1)
+    rows = [("target read", (40 + 11) * byte_ms)]
+    rows += exchange("SELECT", select, bytes(2), args.phone_ms)
+    rows += exchange("challenge", challenge, bytes(CREDENTIAL_SIZE + MAC_SIZE + 2), args.phone_ms)
+    rows.append(("verify", VERIFY_MS))
+
+    total = sum(ms for _, ms in rows)
+    for name, ms in rows:
+        print("%-18s %7.2f ms" % (name, ms))
+    print("%-18s %7.2f ms of %d" % ("tap to decision", total, BUDGET_MS))
+    return 0 if total <= BUDGET_MS else 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    reference = commands.add_parser("respond", help="Compute a phone's answer to a challenge")
+    reference.add_argument("site_key")
+    reference.add_argument("credential_id")
+    reference.add_argument("challenge")
+
+    model = commands.add_parser("budget", help="Model tap-to-decision time")
+    model.add_argument("--i2c-khz", type=float, default=100.0, help="Reader bus clock; the LCD limits it to 100")
+    model.add_argument("--phone-ms", type=float, default=20.0, help="App time per APDU, HCE routing included")
+
+    args = parser.parse_args()
+    if args.command == "respond":
+        respond(args)
+    else:
+        sys.exit(budget(args))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+"""Compares NFC polling policies against the card taps in a session trace.
+
+  python3 tools/poll_policy.py capture.log [--poll-timeout 100] [--loop-delay 100] [--readers 1]
+
+The module polls every nfcFastInterval ms for nfcActiveWindow ms after
+activity and every nfcIdleInterval ms otherwise, with the RF field off between
+polls. This tool replays the recorded tap times against a grid of those
+settings. For each one it prints the mean and p95 time from a card arriving to
+its detection, and the share of time the RF field is on. The recorded taps are
+detection times under the policy that was running, so they approximate
+arrivals to within one poll interval.
+
+With --readers N it models N readers behind a multiplexer. Every loop pass
+services each reader, arming it, checking its status byte or collecting its
+result, and each of those costs bus time. Taps go to the reader recorded in
+the trace, or round-robin when the trace has none. The worst per-reader p95
+shows whether latency stays bounded as readers are added.
+"""
+
+import argparse
+import os
+import statistics
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from replay_trace import parse_trace  # noqa: E402
+
+READ_MS = 30      # Card in the field to a response frame being ready
+ARM_MS = 3.0      # RFConfiguration on plus InListPassiveTarget, with ACKs
+DISARM_MS = 2.0   # Abort and RFConfiguration off
+STATUS_MS = 0.2   # One status byte read
+SELECT_MS = 0.1   # TCA9548A channel write; skipped with a single reader
+
+FAST = (0, 100, 250)
+IDLE = (250, 500, 1000, 2000)
+WINDOWS = (10000, 30000, 60000)
+
+
+def assign(taps, readers):
+    """Maps each (time, reader or None) tap to a reader index."""
+    lanes = [[] for _ in range(readers)]
+    for i, (at, reader) in enumerate(taps):
+        lanes[reader if reader is not None and reader < readers else i % readers].append(at)
+    return lanes
+
+
+def simulate(lanes, fast, idle, window, poll_timeout, loop_delay):
+    """Steps the main loop over the taps; returns (latencies per reader, duty)."""
+    first = min(lane[0] for lane in lanes if lane)
+    last = max(lane[-1] for lane in lanes if lane)
+    now = float(first - window)  # Start idle
+    end = last + poll_timeout + loop_delay
+    start = now
+    last_activity = now - window - 1
+    select = SELECT_MS if len(lanes) > 1 else 0.0
+
+    state = [{"armed": None, "last_poll": None, "pending": list(lane), "field": 0.0, "lat": []}
+             for lane in lanes]
+
+    while now < end:
+        interval = fast if now - last_activity < window else idle
+        for reader in state:
+            if reader["armed"] is not None:
+                now += select + STATUS_MS
+                pending = reader["pending"]
+                ready = pending and now >= max(pending[0], reader["armed"]) + READ_MS
+                if not ready and now - reader["armed"] < poll_timeout:
+                    continue
+                now += DISARM_MS
+                reader["field"] += now - reader["armed"]
+                reader["armed"] = None
+                if ready:
+                    reader["lat"].append(now - pending.pop(0))
+                    last_activity = now
+                    break  # The tap is handled before the next pass
+            if reader["last_poll"] is None or now - reader["last_poll"] >= interval:
+                reader["last_poll"] = now
+                now += select + ARM_MS
+                reader["armed"] = now
+        now += loop_delay
+
+    span = now - start
+    duty = sum(reader["field"] for reader in state) / span / len(state)
+    return [reader["lat"] for reader in state], duty
+
+
+def p95(values):
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(len(ordered) * 0.95))]
+
+
+def tap_reader(payload):
+    """Reader index from an "r<index>" tap payload (older traces: "<uid> r<index>"), if recorded."""
+    for part in payload.split():
+        if part.startswith("r") and part[1:].isdigit():
+            return int(part[1:])
+    return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("trace")
+    parser.add_argument("--poll-timeout", type=int, default=100, help="nfcPollTimeout on the module")
+    parser.add_argument("--loop-delay", type=int, default=100, help="loopDelay on the module")
+    parser.add_argument("--readers", type=int, default=1, help="Readers behind the multiplexer")
+    args = parser.parse_args()
+
+    taps = sorted((at, tap_reader(payload)) for at, tag, payload in parse_trace(args.trace) if tag == "tap")
+    if not taps:
+        sys.exit("Trace has no tap events; record with the trace parameter set to 1")
+    lanes = assign(taps, max(1, args.readers))
+
+    print("%d taps over %.1f min on %d reader(s)"
+          % (len(taps), (taps[-1][0] - taps[0][0]) / 60000.0, len(lanes)))
+    print("%6s %6s %7s %10s %10s %14s %8s" % ("fast", "idle", "window", "mean ms", "p95 ms", "worst p95 ms", "RF duty"))
+    for window in WINDOWS:
+        for fast in FAST:
+            for idle in IDLE:
+                per_reader, duty = simulate(lanes, fast, idle, window, args.poll_timeout, args.loop_delay)
+                latencies = [value for lane in per_reader for value in lane]
+                worst = max(p95(lane) for lane in per_reader if lane)
+                print("%6d %6d %7d %10.0f %10.0f %14.0f %7.1f%%"
+                      % (fast, idle, window, statistics.mean(latencies), p95(latencies), worst, duty * 100))
+
+
+if __name__ == "__main__":
+    main()
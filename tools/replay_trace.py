@@ -0,0 +1,268 @@
+#!/usr/bin/env python3
+"""Plays a recorded session trace back against a module.
+
+Capture a trace by setting the "trace" runtime parameter to 1 and logging the
+module's serial output. Then point the module at this machine and run:
+
+  python3 tools/replay_trace.py capture.log [--port 3000] [--speed 10]
+
+The tool stands in for the server. It sends the recorded inbound frames with
+their original spacing, divided by --speed, and compares each reply with the
+recorded one. Divergences and per-message reply latency are reported at the
+end. Card taps, OTA chunks, and inbound frames the module redacted or
+truncated when tracing are listed but not replayed. Signed commands
+are refused as replays unless the module's nonce is behind the recorded one,
+e.g. after a factory reset or with no signing key.
+
+For soak runs, --repeat N replays the session over N successive connections.
+The module reconnects between them. The tool collects the "heap" object from
+every telemetry frame and fails if the module reports heap drift; set a short
+telemetryInterval and heapTrendWindow first.
+
+Requires the websockets package (pip install websockets).
+"""
+
+import argparse
+import asyncio
+import json
+import statistics
+import sys
+import zlib
+
+DEFLATE_MAGIC = b"NXZ\x01"
+
+# Timer-driven frames; they do not answer anything in the trace
+BACKGROUND = {"ping", "pong", "telemetry", "module_available", "perf_report"}
+
+# Fields that differ between runs by design
+VOLATILE = {"timestamp", "uptime", "freeHeap", "minFreeHeap", "maxAllocHeap", "offset", "bytesPerSec"}
+
+# Written as "<redacted>" by the module's trace recorder
+REDACTED = {"authKey", "phoneKey", "cardKey", "sig", "credentials", "nfcCode", "uid"}
+REDACTED_MARK = '"<redacted>"'
+
+
+def parse_trace(path):
+    events = []
+    with open(path, errors="replace") as f:
+        for line in f:
+            line = line.rstrip("\r\n")
+            if not line.startswith("@trace "):
+                continue
+            parts = line.split(" ", 3)
+            if len(parts) < 3 or not parts[1].isdigit():
+                continue
+            events.append((int(parts[1]), parts[2], parts[3] if len(parts) > 3 else ""))
+    return events
+
+
+def sessions(events):
+    """Splits the trace at socket opens; each session is replayed on its own."""
+    found, current = [], None
+    for event in events:
+        if event[1] == "open":
+            current = []
+            found.append(current)
+        elif current is not None:
+            current.append(event)
+            if event[1] == "close":
+                current = None
+    return found
+
+
+def message_type(text):
+    try:
+        return json.loads(text).get("type", "?")
+    except (ValueError, AttributeError):
+        return "?"
+
+
+def normalize(text):
+    try:
+        doc = json.loads(text)
+    except ValueError:
+        return text
+    if isinstance(doc, dict):
+        for key in VOLATILE | REDACTED:
+            doc.pop(key, None)
+    return json.dumps(doc, sort_keys=True)
+
+
+def replayable(payload):
+    """Redacted or truncated frames no longer say what the module was sent."""
+    return REDACTED_MARK not in payload and message_type(payload) != "?"
+
+
+def build_steps(session):
+    """Pairs each inbound frame with the foreground frames the module sent before the next one."""
+    steps, skipped = [], []
+    step = {"at": None, "rx": None, "tx": []}
+    for at, tag, payload in session:
+        if tag == "rx" and not replayable(payload):
+            # Its replies are dropped with it
+            steps.append(step)
+            step = {"at": at, "rx": None, "tx": [], "skip": True}
+            skipped.append((at, tag, payload[:80]))
+        elif tag == "rx" and message_type(payload) not in BACKGROUND:
+            steps.append(step)
+            step = {"at": at, "rx": payload, "tx": []}
+        elif tag == "tx" and message_type(payload) not in BACKGROUND:
+            step["tx"].append(payload)
+        elif tag in ("tap", "rxbin"):
+            skipped.append((at, tag, payload))
+    steps.append(step)
+    return steps, skipped
+
+
+class Replay:
+    def __init__(self, steps, speed, timeout):
+        self.steps = steps
+        self.speed = speed
+        self.timeout = timeout
+        self.runs = 0
+        self.divergences = []
+        self.latencies = {}
+        self.heap = []  # (freeHeap, heap object) per telemetry frame
+
+    async def receive(self, socket, inbox):
+        async for frame in socket:
+            if isinstance(frame, bytes):
+                if not frame.startswith(DEFLATE_MAGIC):
+                    continue
+                frame = zlib.decompress(frame[len(DEFLATE_MAGIC):], -15).decode()
+            kind = message_type(frame)
+            if kind == "ping":
+                await socket.send(json.dumps({"type": "pong"}))
+            elif kind == "telemetry":
+                report = json.loads(frame)
+                if "heap" in report:
+                    self.heap.append((report.get("freeHeap", 0), report["heap"]))
+            if kind not in BACKGROUND:
+                await inbox.put((asyncio.get_running_loop().time(), frame))
+
+    async def collect(self, inbox, expected):
+        frames = []
+        loop = asyncio.get_running_loop()
+        deadline = loop.time() + self.timeout
+        while len(frames) < expected:
+            try:
+                frames.append(await asyncio.wait_for(inbox.get(), max(0, deadline - loop.time())))
+            except asyncio.TimeoutError:
+                break
+        return frames
+
+    def compare(self, index, rx, expected, frames):
+        got = [frame for _, frame in frames]
+        for i in range(max(len(expected), len(got))):
+            want = normalize(expected[i]) if i < len(expected) else None
+            have = normalize(got[i]) if i < len(got) else None
+            if want != have:
+                self.divergences.append((self.runs, index, message_type(rx) if rx else "(open)", want, have))
+
+    async def run(self, socket):
+        inbox = asyncio.Queue()
+        reader = asyncio.ensure_future(self.receive(socket, inbox))
+        loop = asyncio.get_running_loop()
+        try:
+            previous = None
+            for index, step in enumerate(self.steps):
+                if step.get("skip"):
+                    continue
+                if step["rx"] is not None:
+                    if previous is not None:
+                        await asyncio.sleep((step["at"] - previous) / 1000.0 / self.speed)
+                    previous = step["at"]
+                    sent = loop.time()
+                    await socket.send(step["rx"])
+                else:
+                    sent = loop.time()
+                frames = await self.collect(inbox, len(step["tx"]))
+                if step["rx"] is not None and frames:
+                    kind = message_type(step["rx"])
+                    self.latencies.setdefault(kind, []).append((frames[0][0] - sent) * 1000.0)
+                self.compare(index, step["rx"], step["tx"], frames)
+        finally:
+            reader.cancel()
+            self.runs += 1
+
+
+def report(replay, skipped):
+    print("Steps replayed: %d x %d run(s)" % (len(replay.steps), replay.runs))
+    for at, tag, payload in skipped:
+        print("Not replayed: %s at %d ms %s" % (tag, at, payload))
+
+    print("\nReply latency (ms)")
+    for kind, values in sorted(replay.latencies.items()):
+        ordered = sorted(values)
+        p95 = ordered[min(len(ordered) - 1, int(len(ordered) * 0.95))]
+        print("  %-22s n=%-4d median=%-8.1f p95=%-8.1f max=%.1f"
+              % (kind, len(values), statistics.median(values), p95, ordered[-1]))
+
+    print("\nDivergences: %d" % len(replay.divergences))
+    for run, index, kind, want, have in replay.divergences:
+        print("  run %d step %d after %s" % (run, index, kind))
+        print("    recorded: %s" % want)
+        print("    replayed: %s" % have)
+
+    if replay.heap:
+        first, last = replay.heap[0], replay.heap[-1]
+        print("\nHeap: free %d -> %d, fragmentation %s -> %s per mille, trend %s B/h"
+              % (first[0], last[0], first[1].get("fragPermille"), last[1].get("fragPermille"),
+                 last[1].get("freeTrend")))
+        if any(heap.get("drifting") for _, heap in replay.heap):
+            print("Heap drift reported by the module")
+
+
+async def serve(args, steps):
+    import websockets  # Only needed to serve; tools/poll_policy.py reuses the parser
+
+    replay = Replay(steps, args.speed, args.timeout)
+    done = asyncio.Event()
+    busy = False
+
+    # One control connection at a time; the bulk socket is turned away.
+    # Returning from the handler closes the socket and the module reconnects.
+    async def handler(socket, path=None):
+        nonlocal busy
+        path = path or getattr(getattr(socket, "request", None), "path", "/ws")
+        if busy or done.is_set() or path != "/ws":
+            await socket.close()
+            return
+        busy = True
+        try:
+            await replay.run(socket)
+        finally:
+            busy = False
+            if replay.runs >= args.repeat:
+                done.set()
+
+    async with websockets.serve(handler, args.host, args.port):
+        print("Waiting for the module on ws://%s:%d/ws" % (args.host, args.port))
+        await done.wait()
+    return replay
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("trace")
+    parser.add_argument("--host", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=3000)
+    parser.add_argument("--speed", type=float, default=1.0, help="Replay faster than recorded by this factor")
+    parser.add_argument("--session", type=int, default=0, help="Which socket session in the trace to replay")
+    parser.add_argument("--timeout", type=float, default=3.0, help="Seconds to wait for each reply")
+    parser.add_argument("--repeat", type=int, default=1, help="Replay over this many connections (soak)")
+    args = parser.parse_args()
+
+    found = sessions(parse_trace(args.trace))
+    if args.session >= len(found):
+        sys.exit("Trace has %d session(s)" % len(found))
+
+    steps, skipped = build_steps(found[args.session])
+    replay = asyncio.run(serve(args, steps))
+    report(replay, skipped)
+    drifting = any(heap.get("drifting") for _, heap in replay.heap)
+    sys.exit(1 if replay.divergences or drifting else 0)
+
+
+if __name__ == "__main__":
+    main()
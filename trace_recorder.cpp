@@ -0,0 +1,150 @@
+#include "trace_recorder.h"
+#include "virtual_clock.h"
+
+TraceRecorder traceRecorder;
+
+void TraceRecorder::begin(const char *tag)
+{
+  Serial.print(F("@trace "));
+  Serial.print(clockMillis());
+  Serial.print(' ');
+  Serial.print(tag);
+  Serial.print(' ');
+}
+
+// Members whose values never reach the log: keys, signatures, and anything
+// that identifies a card or a phone
+static const char *const REDACTED_KEYS[] = {"authKey", "phoneKey", "cardKey", "sig", "credentials", "nfcCode", "uid"};
+static const char REDACTED[] = "\"<redacted>\"";
+
+// Index just past the string starting at data[i] (an opening quote)
+static size_t skipString(const char *data, size_t length, size_t i)
+{
+  for (i++; i < length; i++)
+  {
+    if (data[i] == '\\')
+      i++;
+    else if (data[i] == '"')
+      return i + 1;
+  }
+  return length;
+}
+
+// Index just past the JSON value starting at data[i]
+static size_t skipValue(const char *data, size_t length, size_t i)
+{
+  if (i < length && data[i] == '"')
+    return skipString(data, length, i);
+
+  int depth = 0;
+  while (i < length)
+  {
+    char c = data[i];
+    if (c == '"')
+    {
+      i = skipString(data, length, i);
+      continue;
+    }
+    if (c == '[' || c == '{')
+      depth++;
+    else if (c == ']' || c == '}')
+    {
+      if (depth == 0)
+        return i;
+      if (--depth == 0)
+        return i + 1;
+    }
+    else if (c == ',' && depth == 0)
+      return i;
+    i++;
+  }
+  return length;
+}
+
+static bool isRedactedKey(const char *key, size_t length)
+{
+  for (const char *name : REDACTED_KEYS)
+  {
+    if (strlen(name) == length && memcmp(name, key, length) == 0)
+      return true;
+  }
+  return false;
+}
+
+// Copies data to out with redacted values replaced and line breaks turned
+// into spaces, stopping when out is full. Returns the bytes written and sets
+// consumed to the input bytes covered.
+size_t TraceRecorder::redact(const char *data, size_t length, char *out, size_t capacity, size_t &consumed)
+{
+  size_t written = 0;
+  size_t i = 0;
+
+  while (i < length && written < capacity)
+  {
+    char c = data[i];
+    if (c != '"')
+    {
+      out[written++] = c == '\n' || c == '\r' ? ' ' : c;
+      i++;
+      continue;
+    }
+
+    size_t end = skipString(data, length, i);
+    size_t next = end;
+    while (next < length && (data[next] == ' ' || data[next] == '\n' || data[next] == '\r' || data[next] == '\t'))
+      next++;
+    bool redactValue = next < length && data[next] == ':' && isRedactedKey(data + i + 1, end - i - 2);
+
+    size_t copy = min(end - i, capacity - written);
+    memcpy(out + written, data + i, copy);
+    written += copy;
+    i += copy;
+    if (!redactValue || i < end)
+      continue;
+
+    // Keep the key and colon, then swap the value for the marker
+    if (written + 1 + sizeof(REDACTED) - 1 > capacity)
+      break;
+    out[written++] = ':';
+    i = next + 1;
+    while (i < length && (data[i] == ' ' || data[i] == '\n' || data[i] == '\r' || data[i] == '\t'))
+      i++;
+    i = skipValue(data, length, i);
+    memcpy(out + written, REDACTED, sizeof(REDACTED) - 1);
+    written += sizeof(REDACTED) - 1;
+  }
+
+  consumed = i;
+  return written;
+}
+
+void TraceRecorder::record(const char *tag, const char *data, size_t length)
+{
+  if (!enabled)
+    return;
+
+  // Built first and written in one call, so a record costs at most
+  // TRACE_MAX_RECORD bytes of Serial time
+  char line[TRACE_MAX_RECORD];
+  size_t consumed = 0;
+  size_t written = redact(data, length, line, sizeof(line), consumed);
+
+  begin(tag);
+  Serial.write((const uint8_t *)line, written);
+  if (consumed < length)
+  {
+    Serial.print(F(" [truncated "));
+    Serial.print(length);
+    Serial.print(']');
+  }
+  Serial.println();
+}
+
+void TraceRecorder::recordLength(const char *tag, size_t length)
+{
+  if (!enabled)
+    return;
+
+  begin(tag);
+  Serial.println(length);
+}
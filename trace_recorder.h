@@ -0,0 +1,39 @@
+#ifndef TRACE_RECORDER_H
+#define TRACE_RECORDER_H
+
+#include <Arduino.h>
+#include "config.h"
+
+// Writes what the module saw and said as one Serial line per event:
+//
+//   @trace <millis> <tag> <payload>
+//
+// Tags: rx / tx (JSON frames, after inflate and before deflate), rxbin (an
+// OTA chunk; length only), tap (reader index; the UID is withheld), open /
+// close (server socket). Keys, signatures, credential lists and card UIDs
+// are written as "<redacted>", and payloads past TRACE_MAX_RECORD bytes are
+// cut with a " [truncated <length>]" suffix.
+// tools/replay_trace.py plays a captured log back against a module.
+// Off unless the "trace" runtime parameter is 1.
+class TraceRecorder
+{
+private:
+  bool enabled;
+
+  void begin(const char *tag);
+  static size_t redact(const char *data, size_t length, char *out, size_t capacity, size_t &consumed);
+
+public:
+  TraceRecorder() : enabled(false) {}
+
+  void setEnabled(bool on) { enabled = on; }
+  bool isEnabled() const { return enabled; }
+
+  void record(const char *tag, const char *data, size_t length);
+  void record(const char *tag, const char *text) { record(tag, text, text ? strlen(text) : 0); }
+  void recordLength(const char *tag, size_t length);
+};
+
+extern TraceRecorder traceRecorder;
+
+#endif
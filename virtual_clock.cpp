@@ -0,0 +1,23 @@
+#include "virtual_clock.h"
+
+#ifdef NEXLOCK_VIRTUAL_CLOCK
+
+// Starts at zero like millis() after boot and wraps the same way
+static unsigned long virtualNow = 0;
+
+unsigned long clockMillis()
+{
+  return virtualNow;
+}
+
+void clockDelay(unsigned long ms)
+{
+  virtualNow += ms;
+}
+
+void clockAdvance(unsigned long ms)
+{
+  virtualNow += ms;
+}
+
+#endif
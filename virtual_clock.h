@@ -0,0 +1,20 @@
+#ifndef VIRTUAL_CLOCK_H
+#define VIRTUAL_CLOCK_H
+
+#include <Arduino.h>
+
+// Every timer in the loop task reads time through here. On the device these
+// are millis() and delay(). A host build defines NEXLOCK_VIRTUAL_CLOCK and
+// owns time instead: clockDelay() advances the clock without sleeping, so a
+// day of setup()/loop() runs in seconds and the same inputs give the same
+// timings. The bus task and micros()-based perf probes stay on real time.
+#ifdef NEXLOCK_VIRTUAL_CLOCK
+unsigned long clockMillis();
+void clockDelay(unsigned long ms);
+void clockAdvance(unsigned long ms); // For the harness: time passing between loop() calls
+#else
+inline unsigned long clockMillis() { return millis(); }
+inline void clockDelay(unsigned long ms) { delay(ms); }
+#endif
+
+#endif
@@ -0,0 +1,187 @@
+#include "watchdog.h"
+#include "virtual_clock.h"
+#include <esp_attr.h>
+#include <esp_system.h>
+#include <esp_task_wdt.h>
+#include <esp_idf_version.h>
+
+Watchdog watchdog;
+
+#define WATCHDOG_RTC_MAGIC 0x57444F47 // "WDOG"
+
+// Survive a watchdog reset; garbage after power-on until the magic is set
+RTC_NOINIT_ATTR static uint32_t rtcMagic;
+RTC_NOINIT_ATTR static uint32_t rtcOpenSections; // Bit per subsystem
+RTC_NOINIT_ATTR static uint32_t rtcEscalated;    // Subsystem + 1 that forced a restart, 0 = none
+
+static const char *const SUBSYSTEM_NAMES[WD_SUBSYSTEM_COUNT] = {"network", "nfc", "actuation", "display"};
+static const ParamId BUDGETS[WD_SUBSYSTEM_COUNT] = {PARAM_SLO_NETWORK, PARAM_SLO_NFC, PARAM_SLO_ACTUATION, PARAM_SLO_DISPLAY};
+
+static const char *resetReasonName(esp_reset_reason_t reason)
+{
+  switch (reason)
+  {
+  case ESP_RST_POWERON:
+    return "power_on";
+  case ESP_RST_SW:
+    return "software";
+  case ESP_RST_PANIC:
+    return "panic";
+  case ESP_RST_INT_WDT:
+    return "int_wdt";
+  case ESP_RST_TASK_WDT:
+    return "task_wdt";
+  case ESP_RST_WDT:
+    return "wdt";
+  case ESP_RST_BROWNOUT:
+    return "brownout";
+  default:
+    return "other";
+  }
+}
+
+Watchdog::Watchdog() : params(nullptr), reinits(0), attached(false), resetReason("unknown")
+{
+  for (int i = 0; i < WD_SUBSYSTEM_COUNT; i++)
+  {
+    subsystems[i] = Subsystem();
+  }
+}
+
+const char *Watchdog::subsystemName(WatchdogSubsystem subsystem)
+{
+  return SUBSYSTEM_NAMES[subsystem];
+}
+
+void Watchdog::begin(const RuntimeParams *runtimeParams)
+{
+  params = runtimeParams;
+  esp_reset_reason_t reason = esp_reset_reason();
+  resetReason = resetReasonName(reason);
+
+  if (rtcMagic == WATCHDOG_RTC_MAGIC)
+  {
+    bool watchdogReset = reason == ESP_RST_TASK_WDT || reason == ESP_RST_INT_WDT || reason == ESP_RST_PANIC;
+    uint32_t hung = watchdogReset ? rtcOpenSections : 0;
+    if (reason == ESP_RST_SW && rtcEscalated != 0 && rtcEscalated <= WD_SUBSYSTEM_COUNT)
+      hung = 1 << (rtcEscalated - 1);
+
+    for (int i = 0; i < WD_SUBSYSTEM_COUNT; i++)
+    {
+      if (hung & (1 << i))
+      {
+        if (!hungAtReset.isEmpty())
+          hungAtReset.append(',');
+        hungAtReset.append(SUBSYSTEM_NAMES[i]);
+      }
+    }
+  }
+
+  rtcMagic = WATCHDOG_RTC_MAGIC;
+  rtcOpenSections = 0;
+  rtcEscalated = 0;
+
+  if (!hungAtReset.isEmpty())
+  {
+    Serial.print(F("Watchdog: last boot hung in "));
+    Serial.println(hungAtReset.c_str());
+  }
+
+#if ESP_IDF_VERSION_MAJOR >= 5
+  // Keep watching every core's idle task, as the core's own config does
+  esp_task_wdt_config_t config = {WATCHDOG_TIMEOUT, (1 << portNUM_PROCESSORS) - 1, true};
+  esp_err_t result = esp_task_wdt_reconfigure(&config);
+  if (result == ESP_ERR_INVALID_STATE)
+    result = esp_task_wdt_init(&config); // The core did not start the TWDT
+#else
+  // IDF 4 takes seconds and reconfigures in place; idle task watching is
+  // left as sdkconfig set it
+  esp_err_t result = esp_task_wdt_init(WATCHDOG_TIMEOUT / 1000, true);
+#endif
+
+  attached = result == ESP_OK && esp_task_wdt_add(nullptr) == ESP_OK;
+  Serial.println(attached ? F("Watchdog: loop task attached") : F("Watchdog: task WDT unavailable"));
+}
+
+void Watchdog::loop()
+{
+  if (attached)
+    esp_task_wdt_reset();
+
+  for (int i = 0; i < WD_SUBSYSTEM_COUNT; i++)
+  {
+    Subsystem &state = subsystems[i];
+    if (!state.recoveryDue)
+      continue;
+
+    state.recoveryDue = false;
+    reinits++;
+    Serial.print(F("Watchdog: reinitialising "));
+    Serial.println(SUBSYSTEM_NAMES[i]);
+
+    if (!state.recover || state.recover())
+      continue;
+
+    if (++state.failedReinits >= WATCHDOG_MAX_REINITS)
+    {
+      Serial.print(F("Watchdog: restarting, no recovery for "));
+      Serial.println(SUBSYSTEM_NAMES[i]);
+      rtcEscalated = i + 1;
+      clockDelay(100);
+      ESP.restart();
+    }
+  }
+}
+
+void Watchdog::enter(WatchdogSubsystem subsystem)
+{
+  subsystems[subsystem].openedAt = clockMillis();
+  rtcOpenSections |= 1 << subsystem;
+}
+
+void Watchdog::leave(WatchdogSubsystem subsystem)
+{
+  Subsystem &state = subsystems[subsystem];
+  uint32_t elapsed = clockMillis() - state.openedAt;
+  rtcOpenSections &= ~(1 << subsystem);
+
+  if (elapsed > state.maxMs)
+    state.maxMs = elapsed;
+
+  // Read live so a set_params change applies to the next section
+  uint32_t budget = params ? params->get(BUDGETS[subsystem]) : RuntimeParams::spec(BUDGETS[subsystem]).defaultValue;
+  if (elapsed <= budget)
+  {
+    state.strikes = 0;
+    state.failedReinits = 0;
+    return;
+  }
+
+  state.overBudget++;
+  if (++state.strikes >= WATCHDOG_STRIKES)
+  {
+    state.strikes = 0;
+    state.recoveryDue = true; // Run from loop(), outside any section
+  }
+}
+
+void Watchdog::onRecover(WatchdogSubsystem subsystem, RecoveryCallback callback)
+{
+  subsystems[subsystem].recover = callback;
+}
+
+// Arrays are in WatchdogSubsystem order: network, nfc, actuation, display
+void Watchdog::toJson(JsonObject out) const
+{
+  JsonArray over = out.createNestedArray("over");
+  JsonArray maxMs = out.createNestedArray("maxMs");
+  for (int i = 0; i < WD_SUBSYSTEM_COUNT; i++)
+  {
+    over.add(subsystems[i].overBudget);
+    maxMs.add(subsystems[i].maxMs);
+  }
+  out["reinits"] = reinits;
+  out["reset"] = resetReason;
+  if (!hungAtReset.isEmpty())
+    out["hung"] = hungAtReset.c_str();
+}
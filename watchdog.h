@@ -0,0 +1,79 @@
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <functional>
+#include "config.h"
+#include "fixed_string.h"
+#include "runtime_params.h"
+
+enum WatchdogSubsystem
+{
+  WD_NETWORK,
+  WD_NFC,
+  WD_ACTUATION,
+  WD_DISPLAY,
+  WD_SUBSYSTEM_COUNT
+};
+
+// Two layers. The loop task is registered with the IDF task watchdog, so a
+// call that never returns (a wedged I2C bus, a stuck connect) ends in a panic
+// and restart after WATCHDOG_TIMEOUT. Before that, each subsystem's work is
+// bracketed by a WatchdogSection and held to a latency budget, read from the
+// runtime parameters at the end of each section. Repeated
+// overruns trigger that subsystem's recovery callback; recoveries that keep
+// failing escalate to a restart. The sections open at a watchdog reset are
+// kept in RTC memory and reported after the reboot.
+class Watchdog
+{
+public:
+  // Returns true if the subsystem answered after reinitialising
+  typedef std::function<bool()> RecoveryCallback;
+
+private:
+  struct Subsystem
+  {
+    unsigned long openedAt;
+    uint32_t overBudget;
+    uint32_t maxMs;
+    uint8_t strikes;
+    uint8_t failedReinits;
+    bool recoveryDue;
+    RecoveryCallback recover;
+  };
+
+  Subsystem subsystems[WD_SUBSYSTEM_COUNT];
+  const RuntimeParams *params;
+  uint32_t reinits;
+  bool attached;
+  const char *resetReason;
+  FixedString<40> hungAtReset; // Sections open when the last boot ended in a watchdog reset
+
+public:
+  Watchdog();
+
+  void begin(const RuntimeParams *runtimeParams);
+  void loop();
+
+  void enter(WatchdogSubsystem subsystem);
+  void leave(WatchdogSubsystem subsystem);
+  void onRecover(WatchdogSubsystem subsystem, RecoveryCallback callback);
+
+  static const char *subsystemName(WatchdogSubsystem subsystem);
+  void toJson(JsonObject out) const;
+};
+
+extern Watchdog watchdog;
+
+class WatchdogSection
+{
+private:
+  WatchdogSubsystem subsystem;
+
+public:
+  explicit WatchdogSection(WatchdogSubsystem which) : subsystem(which) { watchdog.enter(subsystem); }
+  ~WatchdogSection() { watchdog.leave(subsystem); }
+};
+
+#endif
@@ -1,7 +1,9 @@
 #include "wifi_manager.h"
+#include "virtual_clock.h"
 #include <esp_wifi.h>
 
-WiFiManager::WiFiManager(Preferences *prefs) : preferences(prefs), isProvisioned(false), serverPort(DEFAULT_SERVER_PORT), useESPProvisioning(false)
+WiFiManager::WiFiManager(Preferences *prefs) : preferences(prefs), isProvisioned(false), serverPort(DEFAULT_SERVER_PORT), useESPProvisioning(false),
+                                              reconnecting(false), reconnectStarted(0), lastReconnectAttempt(0)
 {
   provisioningServer = new WebServer(80);
   generateMacAddress();
@@ -110,7 +112,7 @@ void WiFiManager::setupProvisioningServer()
     provisioningServer->send(200, "text/html", 
       "<h2>Saved!</h2><p>Restarting...</p>");
     
-    delay(1000);
+    clockDelay(1000);
     ESP.restart(); });
 }
 
@@ -122,7 +124,7 @@ bool WiFiManager::connectToWiFi()
   int attempts = 0;
   while (WiFi.status() != WL_CONNECTED && attempts < WIFI_CONNECTION_TIMEOUT)
   {
-    delay(1000);
+    clockDelay(1000);
     attempts++;
     Serial.println("Connecting to WiFi... " + String(attempts));
   }
@@ -130,6 +132,9 @@ bool WiFiManager::connectToWiFi()
   if (WiFi.status() == WL_CONNECTED)
   {
     Serial.println("WiFi connected: " + WiFi.localIP().toString());
+
+    // Access rule windows need wall-clock time; the RTC keeps it through outages
+    configTime(0, 0, NTP_SERVER);
     return true;
   }
 
@@ -137,6 +142,46 @@ bool WiFiManager::connectToWiFi()
   return false;
 }
 
+// Non-blocking counterpart of connectToWiFi() for use after an outage: the
+// loop keeps running so taps and mesh relaying continue between attempts
+bool WiFiManager::serviceReconnect(unsigned long retryInterval)
+{
+  unsigned long now = clockMillis();
+
+  if (isConnected())
+  {
+    if (reconnecting)
+    {
+      reconnecting = false;
+      Serial.println("WiFi reconnected: " + WiFi.localIP().toString());
+      configTime(0, 0, NTP_SERVER);
+    }
+    return true;
+  }
+
+  if (reconnecting)
+  {
+    if (now - reconnectStarted < WIFI_CONNECTION_TIMEOUT * 1000UL)
+      return false;
+
+    // Give up on this attempt and leave the radio on the mesh channel
+    WiFi.disconnect();
+    reconnecting = false;
+    lastReconnectAttempt = now;
+    Serial.println("WiFi reconnect attempt timed out");
+    return false;
+  }
+
+  if (now - lastReconnectAttempt < retryInterval)
+    return false;
+
+  Serial.println("WiFi reconnect attempt");
+  WiFi.begin(ssid.c_str(), password.c_str());
+  reconnecting = true;
+  reconnectStarted = now;
+  return false;
+}
+
 void WiFiManager::handleProvisioning()
 {
   if (useESPProvisioning)
@@ -20,6 +20,9 @@ private:
   int serverPort;
   bool isProvisioned;
   bool useESPProvisioning;
+  bool reconnecting;
+  unsigned long reconnectStarted;
+  unsigned long lastReconnectAttempt;
 
   void setupProvisioningServer();
   void generateMacAddress();
@@ -33,6 +36,7 @@ public:
   bool initialize();
   void startProvisioningMode(bool preferESP = true);
   bool connectToWiFi();
+  bool serviceReconnect(unsigned long retryInterval);
   void handleProvisioning();
   bool isConnected() const;
   bool getProvisioningStatus() const;
@@ -41,6 +45,7 @@ public:
   String getMacAddress() const { return macAddress; }
   String getServerIP() const { return serverIP; }
   int getServerPort() const { return serverPort; }
+  bool isReconnecting() const { return reconnecting; }
 
   // Configuration
   void saveWiFiConfig(const String &ssid, const String &password,